@@ -1,15 +1,42 @@
 TEMPLATE = app
-CONFIG += console c++11
+CONFIG += console c++17
 CONFIG -= app_bundle
 CONFIG -= qt
+CONFIG += thread
 
 SOURCES += main.cpp \
     CLexer.cpp \
     CPreprocessor.cpp \
-    CLineTranslator.cpp
+    CLineTranslator.cpp \
+    CSourceBuffer.cpp \
+    CIncludeCache.cpp \
+    CThreadPool.cpp \
+    CIncludePrefetcher.cpp \
+    CDefineTable.cpp \
+    CSymbolTable.cpp \
+    CCondition.cpp \
+    COutputSink.cpp \
+    CPrecompiledHeader.cpp \
+    CSourceMap.cpp \
+    CTrace.cpp \
+    CArena.cpp \
+    CDiagnostics.cpp
 
 HEADERS += \
     CLexer.hpp \
     CPreprocessor.hpp \
-    CLineTranslator.hpp
+    CLineTranslator.hpp \
+    CSourceBuffer.hpp \
+    CIncludeCache.hpp \
+    CThreadPool.hpp \
+    CIncludePrefetcher.hpp \
+    CDefineTable.hpp \
+    CSymbolTable.hpp \
+    CCondition.hpp \
+    COutputSink.hpp \
+    CPrecompiledHeader.hpp \
+    CSourceMap.hpp \
+    CTrace.hpp \
+    CArena.hpp \
+    CDiagnostics.hpp
 
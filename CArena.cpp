@@ -0,0 +1,92 @@
+#include "CArena.hpp"
+#include <algorithm>
+#include <stdint.h>
+
+static const size_t BlockAlignment = alignof(std::max_align_t);
+
+CArena::CArena(std::pmr::memory_resource* upstream, size_t blockSize, size_t retainLimit)
+    : m_upstream(upstream),
+      m_firstBlockSize(std::max<size_t>(blockSize, 1024)),
+      m_blockSize(m_firstBlockSize),
+      m_retainLimit(retainLimit),
+      m_next(nullptr),
+      m_end(nullptr),
+      m_used(0),
+      m_capacity(0)
+{
+}
+
+CArena::~CArena()
+{
+    _freeBlocks();
+}
+
+void CArena::reset()
+{
+    // A run that needed several blocks gets them as a single block next time, unless that's
+    // more than may be kept
+    if (m_blocks.size() > 1 || m_capacity > std::max(m_retainLimit, m_firstBlockSize))
+    {
+        size_t size = std::min(m_capacity, m_retainLimit);
+        _freeBlocks();
+        m_blockSize = m_firstBlockSize;
+        _addBlock(size);
+    }
+    else if (!m_blocks.empty())
+    {
+        m_next = m_blocks.back().data;
+        m_end = m_next + m_blocks.back().size;
+    }
+    m_used = 0;
+}
+
+void CArena::release()
+{
+    _freeBlocks();
+    m_used = 0;
+}
+
+void* CArena::do_allocate(size_t bytes, size_t alignment)
+{
+    uintptr_t address = (uintptr_t(m_next) + alignment - 1) & ~uintptr_t(alignment - 1);
+    if (!m_next || address + bytes > uintptr_t(m_end))
+    {
+        _addBlock(bytes + alignment);
+        address = (uintptr_t(m_next) + alignment - 1) & ~uintptr_t(alignment - 1);
+    }
+
+    m_next = (char*)(address + bytes);
+    m_used += bytes;
+    return (void*)address;
+}
+
+void CArena::do_deallocate(void*, size_t, size_t)
+{
+}
+
+bool CArena::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    return this == &other;
+}
+
+void CArena::_addBlock(size_t minimumSize)
+{
+    Block block;
+    block.size = std::max(m_blockSize, minimumSize);
+    block.data = (char*)m_upstream->allocate(block.size, BlockAlignment);
+    m_blocks.push_back(block);
+    m_capacity += block.size;
+    m_blockSize = std::max(m_blockSize, block.size) * 2;
+    m_next = block.data;
+    m_end = block.data + block.size;
+}
+
+void CArena::_freeBlocks()
+{
+    for (const Block& block : m_blocks)
+        m_upstream->deallocate(block.data, block.size, BlockAlignment);
+    m_blocks.clear();
+    m_capacity = 0;
+    m_next = nullptr;
+    m_end = nullptr;
+}
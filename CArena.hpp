@@ -0,0 +1,61 @@
+#ifndef CARENA_HPP
+#define CARENA_HPP
+
+#include <memory_resource>
+#include <vector>
+#include <stddef.h>
+
+// Monotonic memory resource for everything that only lives as long as a preprocessing run.
+// Allocations bump a pointer through blocks taken from the upstream resource, deallocation does
+// nothing. reset gives all of it back at once but keeps the blocks, merged into one as large as
+// the last run needed, so a warmed up arena serves a run without going upstream at all. No more
+// than the retain limit is kept, so one unusually large run doesn't hold on to its memory for
+// every run after it.
+//
+// Not thread safe, each run has an arena of its own.
+class CArena : public std::pmr::memory_resource
+{
+public:
+    explicit CArena(std::pmr::memory_resource* upstream = std::pmr::get_default_resource(), size_t blockSize = 64 * 1024, size_t retainLimit = 16 * 1024 * 1024);
+    ~CArena();
+    CArena(const CArena&) = delete;
+    CArena& operator=(const CArena&) = delete;
+
+    // Everything allocated so far must no longer be in use
+    void reset();
+    // Like reset, but hands the blocks back upstream as well
+    void release();
+
+    // Bytes reset keeps at most, a single block of the initial block size is always kept
+    inline void setRetainLimit(size_t bytes) { m_retainLimit = bytes; }
+    inline size_t retainLimit() const { return m_retainLimit; }
+
+    inline size_t bytesUsed() const { return m_used; }
+    inline size_t capacity() const { return m_capacity; }
+    inline std::pmr::memory_resource* upstream() const { return m_upstream; }
+private:
+    struct Block
+    {
+        char* data;
+        size_t size;
+    };
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* pointer, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+    void _addBlock(size_t minimumSize);
+    void _freeBlocks();
+
+    std::pmr::memory_resource* m_upstream;
+    size_t m_firstBlockSize;
+    size_t m_blockSize;	//Size of the next block, grows with every block added
+    size_t m_retainLimit;
+    std::vector<Block> m_blocks;	//The last one is being allocated from
+    char* m_next;
+    char* m_end;
+    size_t m_used;	//Bytes handed out since the last reset
+    size_t m_capacity;	//Bytes in all blocks
+};
+
+#endif // CARENA_HPP
@@ -0,0 +1,524 @@
+#include "CCondition.hpp"
+
+struct BinaryOperator
+{
+    std::string_view text;
+    int precedence;
+    CCondition::OpCode op;
+};
+
+static const BinaryOperator binaryOperators[] =
+{
+    {"||",  1,  CCondition::OP_OR_JUMP},
+    {"^^",  2,  CCondition::OP_LOGICAL_XOR},
+    {"&&",  3,  CCondition::OP_AND_JUMP},
+    {"|",   4,  CCondition::OP_OR},
+    {"^",   5,  CCondition::OP_XOR},
+    {"&",   6,  CCondition::OP_AND},
+    {"==",  7,  CCondition::OP_EQUAL},
+    {"!=",  7,  CCondition::OP_NOT_EQUAL},
+    {"<",   8,  CCondition::OP_LESS},
+    {">",   8,  CCondition::OP_GREATER},
+    {"<=",  8,  CCondition::OP_LESS_EQUAL},
+    {">=",  8,  CCondition::OP_GREATER_EQUAL},
+    {"<<",  9,  CCondition::OP_SHIFT_LEFT},
+    {">>",  9,  CCondition::OP_SHIFT_RIGHT},
+    {">>>", 9,  CCondition::OP_SHIFT_RIGHT_LOGICAL},
+    {"+",   10, CCondition::OP_ADD},
+    {"-",   10, CCondition::OP_SUBTRACT},
+    {"*",   11, CCondition::OP_MULTIPLY},
+    {"/",   11, CCondition::OP_DIVIDE},
+    {"%",   11, CCondition::OP_MODULO},
+    {"**",  12, CCondition::OP_POWER}	//Right associative
+};
+
+static bool isSignificant(const CLexer::Token& token)
+{
+    return token.type != CLexer::WHITESPACE && token.type != CLexer::COMMENT &&
+           token.type != CLexer::IGNORE && token.type != CLexer::NEWLINE;
+}
+
+static CSymbolTable::Id symbolOf(const CLexer::Token& token)
+{
+    return token.symbol != CSymbolTable::None ? token.symbol : CSymbolTable::global().intern(token.value);
+}
+
+// Recursive descent over the significant tokens, precedence climbing for binary operators
+class CCondition::Compiler
+{
+public:
+    Compiler(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, std::vector<Instruction>& code, std::string& error)
+        : m_code(code),
+          m_error(error),
+          m_pos(0)
+    {
+        for (; begin != end; ++begin)
+        {
+            if (isSignificant(*begin))
+                m_tokens.push_back(&*begin);
+        }
+    }
+
+    bool compile()
+    {
+        if (m_tokens.empty())
+            return _fail("Expected an expression");
+        if (!_ternary())
+            return false;
+        if (m_pos != m_tokens.size())
+            return _fail("Unexpected '" + std::string(m_tokens[m_pos]->value) + "' in condition");
+        return true;
+    }
+private:
+    bool _fail(const std::string& error)
+    {
+        m_error = error;
+        return false;
+    }
+
+    const CLexer::Token* _peek() const
+    {
+        return m_pos < m_tokens.size() ? m_tokens[m_pos] : nullptr;
+    }
+
+    bool _accept(std::string_view text)
+    {
+        const CLexer::Token* token = _peek();
+        if (!token || token->value != text || token->type == CLexer::STRING)
+            return false;
+        ++m_pos;
+        return true;
+    }
+
+    size_t _emit(OpCode op, int64_t operand = 0)
+    {
+        m_code.push_back({op, operand});
+        return m_code.size() - 1;
+    }
+
+    bool _ternary()
+    {
+        if (!_binary(1))
+            return false;
+        if (!_accept("?"))
+            return true;
+
+        size_t toElse = _emit(OP_JUMP_IF_ZERO);
+        if (!_ternary())
+            return false;
+        if (!_accept(":"))
+            return _fail("Expected ':' in condition");
+        size_t toEnd = _emit(OP_JUMP);
+        m_code[toElse].operand = m_code.size();
+        if (!_ternary())
+            return false;
+        m_code[toEnd].operand = m_code.size();
+        return true;
+    }
+
+    bool _binary(int minPrecedence)
+    {
+        if (!_unary())
+            return false;
+
+        while (const CLexer::Token* token = _peek())
+        {
+            if (token->type != CLexer::OPERATOR)
+                break;
+
+            const BinaryOperator* op = nullptr;
+            for (const BinaryOperator& candidate : binaryOperators)
+            {
+                if (candidate.text == token->value)
+                {
+                    op = &candidate;
+                    break;
+                }
+            }
+            if (!op || op->precedence < minPrecedence)
+                break;
+            ++m_pos;
+
+            if (op->op == OP_AND_JUMP || op->op == OP_OR_JUMP)
+            {
+                // Short circuit, so defined(X) && 10 / X doesn't divide by zero
+                size_t jump = _emit(op->op);
+                if (!_binary(op->precedence + 1))
+                    return false;
+                _emit(OP_TO_BOOL);
+                m_code[jump].operand = m_code.size();
+            }
+            else
+            {
+                if (!_binary(op->op == OP_POWER ? op->precedence : op->precedence + 1))
+                    return false;
+                _emit(op->op);
+            }
+        }
+        return true;
+    }
+
+    bool _unary()
+    {
+        const CLexer::Token* token = _peek();
+        if (token && token->type == CLexer::OPERATOR)
+        {
+            OpCode op;
+            if (token->value == "-")
+                op = OP_NEGATE;
+            else if (token->value == "!")
+                op = OP_NOT;
+            else if (token->value == "~")
+                op = OP_COMPLEMENT;
+            else if (token->value == "+")
+            {
+                ++m_pos;
+                return _unary();
+            }
+            else
+                return _primary();
+
+            ++m_pos;
+            if (!_unary())
+                return false;
+            _emit(op);
+            return true;
+        }
+        return _primary();
+    }
+
+    bool _primary()
+    {
+        const CLexer::Token* token = _peek();
+        if (!token)
+            return _fail("Unexpected end of condition");
+
+        if (_accept("("))
+        {
+            if (!_ternary())
+                return false;
+            if (!_accept(")"))
+                return _fail("Expected ')' in condition");
+            return true;
+        }
+
+        ++m_pos;
+        switch (token->type)
+        {
+        case CLexer::NUMBER:
+            // Decoded by the lexer
+            if (token->numberType != CLexer::NUMBER_INTEGER)
+                return _fail("Invalid integer '" + std::string(token->value) + "' in condition");
+            _emit(OP_CONST, token->integer);
+            return true;
+        case CLexer::KEYWORD:
+            if (token->value == "true" || token->value == "false")
+            {
+                _emit(OP_CONST, token->value == "true");
+                return true;
+            }
+            break;
+        case CLexer::IDENTIFIER:
+        case CLexer::FUNCTION:
+            if (token->value == "defined")
+                return _defined();
+            _emit(OP_VALUE, symbolOf(*token));
+            return true;
+        default:
+            break;
+        }
+        return _fail("Unexpected '" + std::string(token->value) + "' in condition");
+    }
+
+    bool _defined()
+    {
+        bool parenthesized = _accept("(");
+        const CLexer::Token* name = _peek();
+        if (!name || (name->type != CLexer::IDENTIFIER && name->type != CLexer::FUNCTION && name->type != CLexer::KEYWORD))
+            return _fail("Expected a name after defined");
+        ++m_pos;
+        if (parenthesized && !_accept(")"))
+            return _fail("Expected ')' after defined");
+
+        _emit(OP_DEFINED, symbolOf(*name));
+        return true;
+    }
+
+    std::vector<const CLexer::Token*> m_tokens;
+    std::vector<Instruction>& m_code;
+    std::string& m_error;
+    size_t m_pos;
+};
+
+CCondition::Ptr CCondition::compile(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, std::string& error)
+{
+    std::shared_ptr<CCondition> condition = std::make_shared<CCondition>();
+    Compiler compiler(begin, end, condition->m_code, error);
+    if (!compiler.compile())
+        return Ptr();
+
+    condition->m_code.shrink_to_fit();
+    return condition;
+}
+
+bool CCondition::evaluate(const DefinedCallback& defined, const ValueCallback& value, int64_t& result, std::string& error) const
+{
+    // Deep enough for nearly any condition without going to the heap
+    int64_t buffer[16];
+    std::pmr::monotonic_buffer_resource memory(buffer, sizeof(buffer));
+    std::pmr::vector<int64_t> stack(&memory);
+    stack.reserve(16);
+
+    size_t pc = 0;
+    while (pc < m_code.size())
+    {
+        const Instruction& instruction = m_code[pc++];
+        switch (instruction.op)
+        {
+        case OP_CONST:
+            stack.push_back(instruction.operand);
+            continue;
+        case OP_DEFINED:
+            stack.push_back(defined(CSymbolTable::Id(instruction.operand)) ? 1 : 0);
+            continue;
+        case OP_VALUE:
+        {
+            int64_t symbolValue = 0;
+            if (!value(CSymbolTable::Id(instruction.operand), symbolValue, error))
+                return false;
+            stack.push_back(symbolValue);
+            continue;
+        }
+        case OP_NEGATE:
+            stack.back() = int64_t(0 - uint64_t(stack.back()));
+            continue;
+        case OP_NOT:
+            stack.back() = !stack.back();
+            continue;
+        case OP_COMPLEMENT:
+            stack.back() = ~stack.back();
+            continue;
+        case OP_TO_BOOL:
+            stack.back() = stack.back() != 0;
+            continue;
+        case OP_JUMP:
+            pc = size_t(instruction.operand);
+            continue;
+        case OP_JUMP_IF_ZERO:
+        {
+            int64_t top = stack.back();
+            stack.pop_back();
+            if (top == 0)
+                pc = size_t(instruction.operand);
+            continue;
+        }
+        case OP_AND_JUMP:
+            if (stack.back() == 0)
+                pc = size_t(instruction.operand);
+            else
+                stack.pop_back();
+            continue;
+        case OP_OR_JUMP:
+            if (stack.back() != 0)
+            {
+                stack.back() = 1;
+                pc = size_t(instruction.operand);
+            }
+            else
+                stack.pop_back();
+            continue;
+        default:
+            break;
+        }
+
+        // Everything else is a binary operator
+        int64_t b = stack.back();
+        stack.pop_back();
+        int64_t& a = stack.back();
+        switch (instruction.op)
+        {
+        case OP_MULTIPLY:		a = int64_t(uint64_t(a) * uint64_t(b)); break;
+        case OP_ADD:			a = int64_t(uint64_t(a) + uint64_t(b)); break;
+        case OP_SUBTRACT:		a = int64_t(uint64_t(a) - uint64_t(b)); break;
+        case OP_LESS:			a = a < b;  break;
+        case OP_GREATER:		a = a > b;  break;
+        case OP_LESS_EQUAL:		a = a <= b; break;
+        case OP_GREATER_EQUAL:		a = a >= b; break;
+        case OP_EQUAL:			a = a == b; break;
+        case OP_NOT_EQUAL:		a = a != b; break;
+        case OP_AND:			a = a & b;  break;
+        case OP_XOR:			a = a ^ b;  break;
+        case OP_OR:			a = a | b;  break;
+        case OP_LOGICAL_XOR:		a = (a != 0) != (b != 0); break;
+        case OP_DIVIDE:
+        case OP_MODULO:
+            if (b == 0)
+            {
+                error = "Division by zero in condition";
+                return false;
+            }
+            if (b == -1)	//Avoids overflowing on the most negative value
+                a = (instruction.op == OP_DIVIDE) ? int64_t(0 - uint64_t(a)) : 0;
+            else
+                a = (instruction.op == OP_DIVIDE) ? a / b : a % b;
+            break;
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_SHIFT_RIGHT_LOGICAL:
+            if (b < 0 || b >= 64)
+            {
+                error = "Shift out of range in condition";
+                return false;
+            }
+            if (instruction.op == OP_SHIFT_LEFT)
+                a = int64_t(uint64_t(a) << b);
+            else if (instruction.op == OP_SHIFT_RIGHT)
+                a = a >> b;
+            else
+                a = int64_t(uint64_t(a) >> b);
+            break;
+        case OP_POWER:
+        {
+            if (b < 0)
+            {
+                error = "Negative exponent in condition";
+                return false;
+            }
+            uint64_t base = uint64_t(a);
+            uint64_t power = 1;
+            for (; b != 0; b >>= 1)
+            {
+                if (b & 1)
+                    power *= base;
+                base *= base;
+            }
+            a = int64_t(power);
+            break;
+        }
+        default:
+            error = "Invalid condition bytecode";
+            return false;
+        }
+    }
+
+    result = stack.back();
+    return true;
+}
+
+CConditionCache::CConditionCache(size_t memoryBudget)
+    : m_memoryBudget(memoryBudget),
+      m_memoryUsed(0),
+      m_compiles(0),
+      m_evictions(0)
+{
+}
+
+CCondition::Ptr CConditionCache::get(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, std::string& error)
+{
+    // Reused, so a condition that was compiled before is found without allocating. Each token
+    // is tagged with its type, so an identifier a, a string "a" and a character 'a' differ.
+    // Integers are keyed by their decoded value, which is what gets compiled, anything else by
+    // its length and text.
+    static thread_local std::string key;
+    key.clear();
+    for (CLexer::ConstTokenIterator iter = begin; iter != end; ++iter)
+    {
+        if (!isSignificant(*iter))
+            continue;
+        key += char(iter->type);
+        if (iter->type == CLexer::NUMBER && iter->numberType == CLexer::NUMBER_INTEGER)
+        {
+            key += '#';
+            key.append(reinterpret_cast<const char*>(&iter->integer), sizeof(iter->integer));
+            continue;
+        }
+        uint32_t size = uint32_t(iter->value.size());
+        key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        key += iter->value;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_conditions.find(key);
+        if (found != m_conditions.end())
+        {
+            m_lru.splice(m_lru.begin(), m_lru, found->second.lru);
+            return found->second.condition;
+        }
+    }
+
+    // Compiled outside the lock, if another thread got there first its result is kept
+    CCondition::Ptr condition = CCondition::compile(begin, end, error);
+    if (!condition)
+        return condition;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_compiles++;
+    auto inserted = m_conditions.emplace(key, Slot());
+    Slot& slot = inserted.first->second;
+    if (!inserted.second)
+    {
+        m_lru.splice(m_lru.begin(), m_lru, slot.lru);
+        return slot.condition;
+    }
+
+    // The key is held twice, by the map and the list
+    m_lru.push_front(key);
+    slot.condition = condition;
+    slot.lru = m_lru.begin();
+    slot.memory = sizeof(Slot) + sizeof(CCondition) + 2 * key.size() + condition->code().size() * sizeof(CCondition::Instruction);
+    m_memoryUsed += slot.memory;
+    _evict();
+    return condition;
+}
+
+void CConditionCache::_evict()
+{
+    while (m_memoryUsed > m_memoryBudget && !m_lru.empty())
+    {
+        auto iter = m_conditions.find(m_lru.back());
+        m_memoryUsed -= iter->second.memory;
+        m_conditions.erase(iter);
+        m_lru.pop_back();
+        m_evictions++;
+    }
+}
+
+void CConditionCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_conditions.clear();
+    m_lru.clear();
+    m_memoryUsed = 0;
+}
+
+void CConditionCache::setMemoryBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_memoryBudget = bytes;
+    _evict();
+}
+
+size_t CConditionCache::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_conditions.size();
+}
+
+size_t CConditionCache::memoryUsed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_memoryUsed;
+}
+
+size_t CConditionCache::compiles() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_compiles;
+}
+
+size_t CConditionCache::evictions() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_evictions;
+}
@@ -0,0 +1,119 @@
+#ifndef CCONDITION_HPP
+#define CCONDITION_HPP
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "CLexer.hpp"
+#include "CSymbolTable.hpp"
+
+// A #if/#elif expression compiled to a small stack machine. Supports integer literals, true and
+// false, defined X / defined(X), names (resolved through a callback when evaluated), the unary
+// operators + - ! ~ and the usual binary, logical and ternary operators with C precedence, plus
+// AngelScript's ** and ^^.
+class CCondition
+{
+public:
+    enum OpCode : uint8_t
+    {
+        OP_CONST,		//Push operand
+        OP_DEFINED,		//Push 1 if the symbol in operand is defined, otherwise 0
+        OP_VALUE,		//Push the value of the symbol in operand
+        OP_NEGATE,
+        OP_NOT,
+        OP_COMPLEMENT,
+        OP_MULTIPLY,
+        OP_DIVIDE,
+        OP_MODULO,
+        OP_POWER,
+        OP_ADD,
+        OP_SUBTRACT,
+        OP_SHIFT_LEFT,
+        OP_SHIFT_RIGHT,
+        OP_SHIFT_RIGHT_LOGICAL,
+        OP_LESS,
+        OP_GREATER,
+        OP_LESS_EQUAL,
+        OP_GREATER_EQUAL,
+        OP_EQUAL,
+        OP_NOT_EQUAL,
+        OP_AND,
+        OP_XOR,
+        OP_OR,
+        OP_LOGICAL_XOR,
+        OP_TO_BOOL,
+        OP_JUMP,		//Jump to operand
+        OP_JUMP_IF_ZERO,	//Pop, jump to operand if it was 0
+        OP_AND_JUMP,		//If the top is 0 keep it and jump to operand, otherwise pop it
+        OP_OR_JUMP		//If the top isn't 0 replace it with 1 and jump to operand, otherwise pop it
+    };
+
+    struct Instruction
+    {
+        OpCode  op;
+        int64_t operand;
+    };
+
+    typedef std::shared_ptr<const CCondition> Ptr;
+    typedef std::function<bool(CSymbolTable::Id)> DefinedCallback;
+    // Returns false and sets the error if the symbol can't be used as a value. Undefined names are 0.
+    typedef std::function<bool(CSymbolTable::Id, int64_t&, std::string&)> ValueCallback;
+
+    // Compiles the tokens of an expression, whitespace and comments are ignored. Returns nullptr
+    // and sets error if the expression isn't valid.
+    static Ptr compile(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, std::string& error);
+
+    bool evaluate(const DefinedCallback& defined, const ValueCallback& value, int64_t& result, std::string& error) const;
+
+    inline const std::vector<Instruction>& code() const { return m_code; }
+private:
+    class Compiler;
+
+    std::vector<Instruction> m_code;
+};
+
+// Compiled conditions shared by every run, keyed by the expression's tokens so the same
+// condition written in several files or seen again in a later run is only compiled once. Least
+// recently used conditions are evicted once the memory budget is exceeded. Safe to use from
+// several threads.
+class CConditionCache
+{
+public:
+    explicit CConditionCache(size_t memoryBudget = 4 * 1024 * 1024);
+
+    CCondition::Ptr get(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, std::string& error);
+    void clear();
+
+    void setMemoryBudget(size_t bytes);
+    inline size_t memoryBudget() const { return m_memoryBudget; }
+
+    size_t size() const;
+    size_t memoryUsed() const;
+    size_t compiles() const;	//Number of conditions compiled so far, cache hits don't count
+    size_t evictions() const;
+private:
+    typedef std::list<std::string> LruList;
+    struct Slot
+    {
+        CCondition::Ptr condition;
+        LruList::iterator lru;
+        size_t memory;
+    };
+
+    void _evict();
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Slot> m_conditions;
+    LruList m_lru;	//Most recently used first
+    size_t  m_memoryBudget;
+    size_t  m_memoryUsed;
+    size_t  m_compiles;
+    size_t  m_evictions;
+};
+
+#endif // CCONDITION_HPP
@@ -0,0 +1,183 @@
+#include "CDefineTable.hpp"
+#include <algorithm>
+
+static inline size_t slotFor(CSymbolTable::Id id, size_t mask)
+{
+    // Ids are dense, Fibonacci hashing spreads neighbouring ids over the table
+    return (uint32_t(id * 2654435769u) >> 8) & mask;
+}
+
+CDefineTable::Layer::Layer(std::pmr::memory_resource* resource)
+    : keys(resource),
+      values(resource),
+      count(0)
+{
+}
+
+const std::optional<CDefineTable::Entry>* CDefineTable::Layer::find(CSymbolTable::Id id) const
+{
+    if (count == 0)
+        return nullptr;
+
+    size_t mask = keys.size() - 1;
+    for (size_t slot = slotFor(id, mask); keys[slot] != CSymbolTable::None; slot = (slot + 1) & mask)
+    {
+        if (keys[slot] == id)
+            return &values[slot];
+    }
+    return nullptr;
+}
+
+std::optional<CDefineTable::Entry>& CDefineTable::Layer::insert(CSymbolTable::Id id)
+{
+    if ((count + 1) * 2 > keys.size())
+    {
+        // Rehash into twice the space to keep the load factor under a half
+        std::pmr::vector<CSymbolTable::Id> oldKeys(std::max<size_t>(keys.size() * 2, 16), CSymbolTable::None, keys.get_allocator());
+        std::pmr::vector<std::optional<Entry> > oldValues(oldKeys.size(), values.get_allocator());
+        oldKeys.swap(keys);
+        oldValues.swap(values);
+
+        size_t mask = keys.size() - 1;
+        for (size_t i = 0; i < oldKeys.size(); i++)
+        {
+            if (oldKeys[i] == CSymbolTable::None)
+                continue;
+            size_t slot = slotFor(oldKeys[i], mask);
+            while (keys[slot] != CSymbolTable::None)
+                slot = (slot + 1) & mask;
+            keys[slot] = oldKeys[i];
+            values[slot] = std::move(oldValues[i]);
+        }
+    }
+
+    size_t mask = keys.size() - 1;
+    size_t slot = slotFor(id, mask);
+    while (keys[slot] != CSymbolTable::None && keys[slot] != id)
+        slot = (slot + 1) & mask;
+
+    if (keys[slot] == CSymbolTable::None)
+    {
+        keys[slot] = id;
+        count++;
+    }
+    return values[slot];
+}
+
+CDefineTable::CDefineTable()
+    : m_consulted(nullptr)
+{
+}
+
+CDefineTable::CDefineTable(Snapshot base, std::pmr::memory_resource* resource)
+    : m_base(std::move(base)),
+      m_overlay(resource),
+      m_snapshot(m_base),
+      m_consulted(nullptr)
+{
+}
+
+const CDefineTable::Entry* CDefineTable::find(CSymbolTable::Id id) const
+{
+    if (m_consulted)
+    {
+        if (id >= m_consulted->size())
+            m_consulted->resize(std::max<size_t>(id + 1, m_consulted->size() * 2));
+        (*m_consulted)[id] = true;
+    }
+
+    const std::optional<Entry>* entry = m_overlay.find(id);
+    if (!entry && m_base)
+        entry = m_base->find(id);
+
+    return (entry && *entry) ? &**entry : nullptr;
+}
+
+const CDefineTable::Entry* CDefineTable::find(std::string_view name) const
+{
+    // Interned even if it's unknown, so a lookup that failed is still recorded
+    if (m_consulted)
+        return find(CSymbolTable::global().intern(name));
+
+    CSymbolTable::Id id = CSymbolTable::global().find(name);
+    return id != CSymbolTable::None ? find(id) : nullptr;
+}
+
+const CDefineTable::Entry* CDefineTable::find(const CLexer::Token& token) const
+{
+    if (token.symbol != CSymbolTable::None)
+        return find(token.symbol);
+
+    // Identifiers made up by hooks weren't interned by the lexer
+    if (token.type == CLexer::IDENTIFIER)
+        return find(token.value);
+    return nullptr;
+}
+
+void CDefineTable::set(CSymbolTable::Id id, Entry entry)
+{
+    m_overlay.insert(id) = std::move(entry);
+    m_snapshot.reset();
+}
+
+void CDefineTable::set(std::string_view name, Entry entry)
+{
+    set(CSymbolTable::global().intern(name), std::move(entry));
+}
+
+void CDefineTable::erase(CSymbolTable::Id id)
+{
+    if (!find(id))
+        return;
+
+    // The base is shared and can't be touched, an empty overlay slot hides its entry instead
+    m_overlay.insert(id).reset();
+    m_snapshot.reset();
+}
+
+void CDefineTable::erase(std::string_view name)
+{
+    CSymbolTable::Id id = CSymbolTable::global().find(name);
+    if (id != CSymbolTable::None)
+        erase(id);
+}
+
+void CDefineTable::clear()
+{
+    m_base.reset();
+    m_overlay = Layer(m_overlay.keys.get_allocator().resource());
+    m_snapshot.reset();
+}
+
+void CDefineTable::rebase(Snapshot base)
+{
+    if (hasChanges())
+        return;
+
+    m_base = std::move(base);
+    m_snapshot = m_base;
+}
+
+CDefineTable::Snapshot CDefineTable::snapshot() const
+{
+    if (m_snapshot)
+        return m_snapshot;
+
+    std::shared_ptr<Layer> flat = std::make_shared<Layer>();
+    if (m_base)
+    {
+        for (size_t i = 0; i < m_base->keys.size(); i++)
+        {
+            if (m_base->keys[i] != CSymbolTable::None && !m_overlay.find(m_base->keys[i]))
+                flat->insert(m_base->keys[i]) = m_base->values[i];
+        }
+    }
+    for (size_t i = 0; i < m_overlay.keys.size(); i++)
+    {
+        if (m_overlay.keys[i] != CSymbolTable::None && m_overlay.values[i])
+            flat->insert(m_overlay.keys[i]) = m_overlay.values[i];
+    }
+
+    m_snapshot = flat;
+    return m_snapshot;
+}
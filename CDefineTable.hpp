@@ -0,0 +1,94 @@
+#ifndef CDEFINETABLE_HPP
+#define CDEFINETABLE_HPP
+
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "CLexer.hpp"
+#include "CSymbolTable.hpp"
+
+// Define table made of an immutable, shared base layer and a private overlay holding every
+// #define and #undef made since. Creating a table on top of a base is O(1) no matter how large
+// the base is, so each run can start from the application defines without copying them.
+// Both layers are flat hash tables keyed by interned symbol id.
+class CDefineTable
+{
+public:
+    typedef std::map<std::string, int, std::less<> > ArgSet;
+    struct Entry
+    {
+        Entry() {}
+        explicit Entry(std::pmr::memory_resource* resource) : tokens(resource) {}
+
+        CLexer::TokenList tokens;
+        ArgSet arguments;
+    };
+
+    // Open addressing table from symbol id to entry. An empty optional marks an #undef that
+    // hides an entry of the layer below. Copies are made on the heap whatever the resource of
+    // the original.
+    struct Layer
+    {
+        explicit Layer(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+        const std::optional<Entry>* find(CSymbolTable::Id id) const;
+        std::optional<Entry>& insert(CSymbolTable::Id id);
+
+        std::pmr::vector<CSymbolTable::Id> keys;	//None marks a free slot
+        std::pmr::vector<std::optional<Entry> > values;
+        size_t count;
+    };
+    typedef std::shared_ptr<const Layer> Snapshot;
+
+    CDefineTable();
+    // The overlay is kept in resource, snapshots are always made on the heap
+    explicit CDefineTable(Snapshot base, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+    // nullptr if the name isn't defined
+    const Entry* find(CSymbolTable::Id id) const;
+    const Entry* find(std::string_view name) const;
+    // Uses the token's symbol, so lexed identifiers are found without touching their text
+    const Entry* find(const CLexer::Token& token) const;
+    inline bool contains(std::string_view name) const { return find(name) != nullptr; }
+
+    // Marks consulted[id] for every name looked up from now on, growing it as needed. Used to
+    // work out which defines a run depended on.
+    inline void recordLookups(std::pmr::vector<bool>* consulted) { m_consulted = consulted; }
+
+    void set(CSymbolTable::Id id, Entry entry);
+    void set(std::string_view name, Entry entry);
+    void erase(CSymbolTable::Id id);
+    void erase(std::string_view name);
+    void clear();
+
+    // Whether anything was defined or undefined on top of the base
+    inline bool hasChanges() const { return m_overlay.count != 0; }
+    // Calls func(id, entry) for every define made on top of the base, entry is null for an #undef
+    template <typename Func>
+    void forEachChange(Func func) const
+    {
+        for (size_t i = 0; i < m_overlay.keys.size(); i++)
+        {
+            if (m_overlay.keys[i] != CSymbolTable::None)
+                func(m_overlay.keys[i], m_overlay.values[i] ? &*m_overlay.values[i] : nullptr);
+        }
+    }
+    // Swaps the base for another one, only while there are no changes on top of it
+    void rebase(Snapshot base);
+
+    // Flattens both layers into a layer that can be shared as the base of other tables. The
+    // result is kept until the table changes again, so this is not safe to call from several
+    // threads unless the table has been snapshotted once already.
+    Snapshot snapshot() const;
+private:
+    Snapshot m_base;
+    Layer    m_overlay;
+    mutable Snapshot m_snapshot;
+    std::pmr::vector<bool>* m_consulted;
+};
+
+#endif // CDEFINETABLE_HPP
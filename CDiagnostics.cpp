@@ -0,0 +1,104 @@
+#include "CDiagnostics.hpp"
+
+static const std::string NoFileName;
+
+CDiagnostics::CDiagnostics()
+    : m_limit(0),
+      m_silent(false),
+      m_dropped(0)
+{
+    m_counts[WARNING] = 0;
+    m_counts[ERROR] = 0;
+}
+
+void CDiagnostics::report(Severity severity, Code code, unsigned int file, unsigned int line, unsigned int column, std::initializer_list<std::string_view> message)
+{
+    m_counts[severity]++;
+    if (m_silent || (m_limit != 0 && m_records.size() >= m_limit))
+    {
+        m_dropped++;
+        return;
+    }
+
+    Record record;
+    record.severity = severity;
+    record.code = code;
+    record.file = file;
+    record.line = line;
+    record.column = column;
+    size_t length = 0;
+    for (std::string_view part : message)
+        length += part.size();
+    record.message.reserve(length);
+    for (std::string_view part : message)
+        record.message += part;
+    m_records.push_back(std::move(record));
+}
+
+unsigned int CDiagnostics::fileId(std::string_view file)
+{
+    // A run reports about a handful of files at most
+    for (size_t i = 0; i < m_files.size(); i++)
+    {
+        if (m_files[i] == file)
+            return (unsigned int)i;
+    }
+    m_files.push_back(std::string(file));
+    return (unsigned int)m_files.size() - 1;
+}
+
+void CDiagnostics::clear()
+{
+    m_records.clear();
+    m_files.clear();
+    m_counts[WARNING] = 0;
+    m_counts[ERROR] = 0;
+    m_dropped = 0;
+}
+
+const std::string& CDiagnostics::fileName(unsigned int file) const
+{
+    return file < m_files.size() ? m_files[file] : NoFileName;
+}
+
+const char* CDiagnostics::severityName(Severity severity)
+{
+    return severity == ERROR ? "error" : "warning";
+}
+
+std::string CDiagnostics::format(const Record& record) const
+{
+    std::string text;
+    if (record.file != NoFile)
+    {
+        text += fileName(record.file);
+        if (record.line != 0)
+        {
+            text += ':';
+            text += std::to_string(record.line);
+            if (record.column != 0)
+            {
+                text += ':';
+                text += std::to_string(record.column);
+            }
+        }
+        text += ": ";
+    }
+    text += severityName(record.severity);
+    text += ": ";
+    text += record.message;
+    return text;
+}
+
+std::string CDiagnostics::format() const
+{
+    std::string text;
+    for (const Record& record : m_records)
+    {
+        text += format(record);
+        text += '\n';
+    }
+    if (m_dropped != 0 && !m_silent)
+        text += std::to_string(m_dropped) + " more not shown\n";
+    return text;
+}
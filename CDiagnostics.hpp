@@ -0,0 +1,88 @@
+#ifndef CDIAGNOSTICS_HPP
+#define CDIAGNOSTICS_HPP
+
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stddef.h>
+
+// Warnings and errors of a run, kept as records instead of being printed as they happen. Once
+// the limit is reached further records are only counted, and in silent mode nothing is kept at
+// all, so a flood of errors costs little more than the counting.
+class CDiagnostics
+{
+public:
+    enum Severity
+    {
+        WARNING,
+        ERROR
+    };
+
+    enum Code
+    {
+        EMPTY_SOURCE,	//File missing or empty
+        MISSING_NEWLINE,	//No new line at the end of a file
+        INCLUDE_NOT_FOUND,
+        UNMATCHED_CONDITIONAL,	//#elif, #else or #endif without #if
+        BAD_CONDITION,	//#if or #elif that can't be evaluated
+        BAD_DIRECTIVE,	//Malformed arguments of a directive
+        BAD_DEFINE,	//Malformed or repeated #define
+        BAD_EXPANSION,	//Arguments of a define or macro that don't fit
+        DEGENERATE_TOKEN,
+        UNKNOWN_PRAGMA,
+        USER_WARNING,	//#warning
+        USER_ERROR,	//#error
+        PRECOMPILED_HEADER,	//Precompiled header not written or not used
+        CODE_COUNT
+    };
+
+    struct Record
+    {
+        Severity severity;
+        Code code;
+        unsigned int file;	//Index into files, NoFile if it isn't about a file
+        unsigned int line;	//From 1, 0 if unknown
+        unsigned int column;	//From 1, 0 if unknown
+        std::string message;
+    };
+    static const unsigned int NoFile = ~0u;
+
+    CDiagnostics();
+
+    // Records beyond limit are only counted, 0 keeps every record
+    inline void setLimit(size_t limit) { m_limit = limit; }
+    inline size_t limit() const { return m_limit; }
+    // Count only, keep no records
+    inline void setSilent(bool silent) { m_silent = silent; }
+    inline bool silent() const { return m_silent; }
+
+    // The message is made of parts, which are only put together if the record is kept
+    void report(Severity severity, Code code, unsigned int file, unsigned int line, unsigned int column, std::initializer_list<std::string_view> message);
+    unsigned int fileId(std::string_view file);
+    void clear();
+
+    inline const std::vector<Record>& records() const { return m_records; }
+    inline const std::vector<std::string>& files() const { return m_files; }
+    const std::string& fileName(unsigned int file) const;
+    // Counted whether kept or not
+    inline unsigned int errorCount() const { return m_counts[ERROR]; }
+    inline unsigned int warningCount() const { return m_counts[WARNING]; }
+    // Counted but not kept, because of the limit or silent mode
+    inline unsigned int dropped() const { return m_dropped; }
+
+    static const char* severityName(Severity severity);
+    // "file:line:column: severity: message", leaving out what isn't known
+    std::string format(const Record& record) const;
+    // Every record on a line of its own, and a note about the dropped ones
+    std::string format() const;
+private:
+    size_t m_limit;
+    bool m_silent;
+    std::vector<Record> m_records;
+    std::vector<std::string> m_files;
+    unsigned int m_counts[2];
+    unsigned int m_dropped;
+};
+
+#endif // CDIAGNOSTICS_HPP
@@ -0,0 +1,277 @@
+#include "CIncludeCache.hpp"
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define stat _stat64
+#else
+#include <limits.h>
+#endif
+
+bool CIncludeCache::statFile(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+
+    size = st.st_size;
+#if defined(__APPLE__)
+    mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    mtime = int64_t(st.st_mtime) * 1000000000;
+#else
+    mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+std::string CIncludeCache::canonicalPath(const std::string& filename)
+{
+#ifdef _WIN32
+    char buffer[_MAX_PATH];
+    if (_fullpath(buffer, filename.c_str(), _MAX_PATH))
+        return buffer;
+#else
+    char buffer[PATH_MAX];
+    if (realpath(filename.c_str(), buffer))
+        return buffer;
+#endif
+    return filename;
+}
+
+CIncludeCache::CIncludeCache(size_t memoryBudget)
+    : m_memoryBudget(memoryBudget),
+      m_memoryUsed(0),
+      m_validateContents(false),
+      m_hits(0),
+      m_misses(0),
+      m_evictions(0)
+{
+}
+
+CIncludeCache::EntryPtr CIncludeCache::load(const std::string& filename)
+{
+    std::string path = canonicalPath(filename);
+    uint64_t size;
+    int64_t mtime;
+    if (!statFile(path, size, mtime))
+        return EntryPtr();
+
+    EntryPtr cached;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_entries.find(path);
+        if (iter != m_entries.end())
+        {
+            cached = iter->second.entry;
+            if (cached->size == size && cached->mtime == mtime)
+            {
+                m_hits++;
+                m_lru.splice(m_lru.begin(), m_lru, iter->second.lru);
+                return cached;
+            }
+        }
+    }
+
+    // Missing or out of date, load it without holding the lock so other runs aren't held up
+    CSourceBuffer::Ptr source = CSourceBuffer::fromFile(path);
+    if (!source)
+        return EntryPtr();
+
+    EntryPtr entry;
+    bool unchanged = false;
+    if (cached && m_validateContents && cached->size == size &&
+        hashContents(source->begin(), source->size()) == cached->hash)
+    {
+        // Touched but not modified, the existing tokens are still good
+        std::shared_ptr<Entry> refreshed = std::make_shared<Entry>(*cached);
+        refreshed->mtime = mtime;
+        entry = refreshed;
+        unchanged = true;
+    }
+    else
+        entry = _lex(path, source, size, mtime);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (unchanged)
+        m_hits++;
+    else
+        m_misses++;
+    _insert(entry);
+    return entry;
+}
+
+CIncludeCache::EntryPtr CIncludeCache::_lex(const std::string& path, CSourceBuffer::Ptr source, uint64_t size, int64_t mtime)
+{
+    if (!source)
+        return EntryPtr();
+
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    entry->path = path;
+    entry->source = source;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->hash = m_validateContents ? hashContents(source->begin(), source->size()) : 0;
+
+    CLexer lexer;
+    if (!source->empty())
+        lexer.lex(source->begin(), source->contentEnd(), entry->tokens);
+    entry->tokens.shrink_to_fit();
+    entry->includeGuard = detectIncludeGuard(entry->tokens);
+    entry->memory = sizeof(Entry) + source->size() + entry->tokens.size() * sizeof(CLexer::Token);
+    return entry;
+}
+
+void CIncludeCache::_insert(const EntryPtr& entry)
+{
+    auto iter = m_entries.find(entry->path);
+    if (iter != m_entries.end())
+    {
+        m_memoryUsed -= iter->second.entry->memory;
+        m_lru.erase(iter->second.lru);
+        m_entries.erase(iter);
+    }
+
+    if (entry->memory > m_memoryBudget)
+        return;
+
+    m_lru.push_front(entry->path);
+    Slot& slot = m_entries[entry->path];
+    slot.entry = entry;
+    slot.lru = m_lru.begin();
+    m_memoryUsed += entry->memory;
+    _evict();
+}
+
+void CIncludeCache::_evict()
+{
+    while (m_memoryUsed > m_memoryBudget && !m_lru.empty())
+    {
+        auto iter = m_entries.find(m_lru.back());
+        m_memoryUsed -= iter->second.entry->memory;
+        m_entries.erase(iter);
+        m_lru.pop_back();
+        m_evictions++;
+    }
+}
+
+void CIncludeCache::setMemoryBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_memoryBudget = bytes;
+    _evict();
+}
+
+void CIncludeCache::setValidateContents(bool validate)
+{
+    // Existing entries have no hash to compare against
+    if (validate != m_validateContents)
+        clear();
+    m_validateContents = validate;
+}
+
+void CIncludeCache::invalidate(const std::string& filename)
+{
+    std::string path = canonicalPath(filename);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_entries.find(path);
+    if (iter == m_entries.end())
+        return;
+
+    m_memoryUsed -= iter->second.entry->memory;
+    m_lru.erase(iter->second.lru);
+    m_entries.erase(iter);
+}
+
+void CIncludeCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_lru.clear();
+    m_memoryUsed = 0;
+}
+
+CIncludeCache::Stats CIncludeCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.entries = m_entries.size();
+    stats.memoryUsed = m_memoryUsed;
+    return stats;
+}
+
+void CIncludeCache::resetStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+}
+
+uint64_t CIncludeCache::hashContents(const char* data, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool isSignificant(const CLexer::Token& token)
+{
+    return token.type != CLexer::WHITESPACE && token.type != CLexer::NEWLINE && token.type != CLexer::COMMENT;
+}
+
+static CLexer::ConstTokenIterator nextSignificant(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end)
+{
+    while (begin != end && !isSignificant(*begin))
+        ++begin;
+    return begin;
+}
+
+std::string CIncludeCache::detectIncludeGuard(const CLexer::TokenList& tokens)
+{
+    CLexer::ConstTokenIterator end = tokens.end();
+    CLexer::ConstTokenIterator iter = nextSignificant(tokens.begin(), end);
+    if (iter == end || iter->type != CLexer::PREPROCESSOR || iter->directive != CLexer::DIRECTIVE_IFNDEF)
+        return std::string();
+
+    iter = nextSignificant(++iter, end);
+    if (iter == end || iter->type != CLexer::IDENTIFIER)
+        return std::string();
+    std::string_view guard = iter->value;
+
+    iter = nextSignificant(++iter, end);
+    if (iter == end || iter->type != CLexer::PREPROCESSOR || iter->directive != CLexer::DIRECTIVE_DEFINE)
+        return std::string();
+    iter = nextSignificant(++iter, end);
+    if (iter == end || iter->value != guard)
+        return std::string();
+
+    // The #endif closing the guard has to be the last thing in the file, and the guard can't
+    // have an #else or #elif branch of its own
+    int depth = 0;
+    for (++iter; iter != end; ++iter)
+    {
+        if (iter->type != CLexer::PREPROCESSOR)
+            continue;
+        CLexer::DirectiveType directive = iter->directive;
+        if (directive == CLexer::DIRECTIVE_IF || directive == CLexer::DIRECTIVE_IFDEF || directive == CLexer::DIRECTIVE_IFNDEF)
+            depth++;
+        else if ((directive == CLexer::DIRECTIVE_ELIF || directive == CLexer::DIRECTIVE_ELSE) && depth == 0)
+            return std::string();
+        else if (directive == CLexer::DIRECTIVE_ENDIF && depth-- == 0)
+            break;
+    }
+
+    if (iter == end || nextSignificant(++iter, end) != end)
+        return std::string();
+
+    return std::string(guard);
+}
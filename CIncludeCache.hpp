@@ -0,0 +1,87 @@
+#ifndef CINCLUDECACHE_HPP
+#define CINCLUDECACHE_HPP
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include "CLexer.hpp"
+#include "CSourceBuffer.hpp"
+
+// Keeps loaded and lexed include files around between runs. Entries are keyed by canonical
+// path and revalidated against the file's size and modification time on every lookup, or
+// against a hash of its contents when content validation is enabled. Least recently used
+// entries are evicted once the memory budget is exceeded. Lookups are safe from several threads,
+// the settings should only be changed while nothing is being preprocessed.
+class CIncludeCache
+{
+public:
+    struct Entry
+    {
+        std::string path;	//Canonical path
+        CSourceBuffer::Ptr source;
+        CLexer::TokenList tokens;	//Points into source
+        uint64_t size;
+        int64_t  mtime;	//Nanoseconds
+        uint64_t hash;	//Only computed when content validation is enabled
+        size_t   memory;
+        std::string includeGuard;	//X if the whole file is wrapped in #ifndef X / #define X ... #endif
+    };
+    typedef std::shared_ptr<const Entry> EntryPtr;
+
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t entries;
+        size_t memoryUsed;
+    };
+
+    explicit CIncludeCache(size_t memoryBudget = 64 * 1024 * 1024);
+
+    // Returns the lexed file, loading it if it isn't cached or has changed. Returns null if the file can't be read.
+    EntryPtr load(const std::string& filename);
+
+    void setMemoryBudget(size_t bytes);
+    inline size_t memoryBudget() const { return m_memoryBudget; }
+    void setValidateContents(bool validate);
+    inline bool validateContents() const { return m_validateContents; }
+
+    // Drops the file, so the next load reads it again whatever its size and modification time say
+    void invalidate(const std::string& filename);
+    void clear();
+    Stats stats() const;
+    void resetStats();
+
+    static std::string canonicalPath(const std::string& filename);
+    // Size in bytes and modification time in nanoseconds, false if the file doesn't exist
+    static bool statFile(const std::string& path, uint64_t& size, int64_t& mtime);
+    static uint64_t hashContents(const char* data, size_t size);
+    static std::string detectIncludeGuard(const CLexer::TokenList& tokens);
+private:
+    typedef std::list<std::string> LruList;
+    struct Slot
+    {
+        EntryPtr entry;
+        LruList::iterator lru;
+    };
+
+    EntryPtr _lex(const std::string& path, CSourceBuffer::Ptr source, uint64_t size, int64_t mtime);
+    void _insert(const EntryPtr& entry);
+    void _evict();
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Slot> m_entries;
+    LruList m_lru;	//Most recently used first
+    size_t  m_memoryBudget;
+    size_t  m_memoryUsed;
+    bool    m_validateContents;
+    size_t  m_hits;
+    size_t  m_misses;
+    size_t  m_evictions;
+};
+
+#endif // CINCLUDECACHE_HPP
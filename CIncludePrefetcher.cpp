@@ -0,0 +1,162 @@
+#include "CIncludePrefetcher.hpp"
+#include <string.h>
+
+CIncludePrefetcher::CIncludePrefetcher(CIncludeCache& cache, unsigned int threadCount, bool lexAhead)
+    : m_cache(cache),
+      m_lexAhead(lexAhead),
+      m_stopping(false)
+{
+    if (threadCount == 0)
+        threadCount = 1;
+    for (unsigned int i = 0; i < threadCount; ++i)
+        m_threads.emplace_back(&CIncludePrefetcher::_work, this);
+}
+
+CIncludePrefetcher::~CIncludePrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        // Whoever still waits on a dropped job gets a broken promise and loads it directly
+        m_jobs.clear();
+    }
+    m_condition.notify_all();
+    for (std::thread& thread : m_threads)
+        thread.join();
+}
+
+CIncludePrefetcher::SessionPtr CIncludePrefetcher::beginSession()
+{
+    return std::make_shared<Session>();
+}
+
+void CIncludePrefetcher::prefetchIncludes(const SessionPtr& session, const CSourceBuffer& source)
+{
+    std::vector<std::string> includes;
+    scanIncludes(source.begin(), source.end(), includes);
+
+    for (const std::string& filename : includes)
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        if (session->pending.count(filename))
+            continue;
+
+        // The session keeps the task's future, so the task only holds on to it weakly
+        std::weak_ptr<Session> weakSession = session;
+        auto task = std::make_shared<std::packaged_task<CIncludeCache::EntryPtr()> >([this, weakSession, filename]()
+        {
+            SessionPtr session = weakSession.lock();
+            if (!m_lexAhead)
+            {
+                // Only pull the file into the OS cache, the preprocessor lexes it when it gets there
+                CSourceBuffer::Ptr source = CSourceBuffer::fromFile(filename);
+                if (source)
+                {
+                    volatile char sum = 0;
+                    for (const char* page = source->begin(); page < source->end(); page += 4096)
+                        sum += *page;
+                    if (session)
+                        prefetchIncludes(session, *source);
+                }
+                return CIncludeCache::EntryPtr();
+            }
+
+            CIncludeCache::EntryPtr entry = m_cache.load(filename);
+            if (entry && session)
+                prefetchIncludes(session, *entry->source);
+            return entry;
+        });
+
+        session->pending[filename] = task->get_future().share();
+        _enqueue([task]() { (*task)(); });
+    }
+}
+
+bool CIncludePrefetcher::wait(const SessionPtr& session, const std::string& filename, CIncludeCache::EntryPtr& entry)
+{
+    Pending pending;
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        auto iter = session->pending.find(filename);
+        if (iter == session->pending.end())
+            return false;
+        pending = iter->second;
+    }
+
+    try
+    {
+        entry = pending.get();
+    }
+    catch (const std::future_error&)
+    {
+        return false;
+    }
+    return entry != nullptr;
+}
+
+void CIncludePrefetcher::scanIncludes(const char* begin, const char* end, std::vector<std::string>& out)
+{
+    static const char directive[] = "include";
+    const size_t directiveLength = sizeof(directive) - 1;
+
+    const char* cur = begin;
+    while (cur < end)
+    {
+        const char* hash = (const char*)memchr(cur, '#', end - cur);
+        if (!hash)
+            break;
+
+        // Only directives at the start of a line count
+        const char* lineStart = hash;
+        while (lineStart > begin && (lineStart[-1] == ' ' || lineStart[-1] == '\t'))
+            --lineStart;
+        cur = hash + 1;
+        if (lineStart != begin && lineStart[-1] != '\n')
+            continue;
+
+        if (size_t(end - cur) < directiveLength || memcmp(cur, directive, directiveLength) != 0)
+            continue;
+        cur += directiveLength;
+
+        while (cur < end && (*cur == ' ' || *cur == '\t'))
+            ++cur;
+        if (cur == end || *cur != '\"')
+            continue;
+
+        const char* nameStart = ++cur;
+        while (cur < end && *cur != '\"' && *cur != '\n')
+            ++cur;
+        if (cur == end || *cur != '\"')
+            continue;
+
+        out.emplace_back(nameStart, cur - nameStart);
+    }
+}
+
+void CIncludePrefetcher::_enqueue(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stopping)
+            return;
+        m_jobs.push_back(std::move(job));
+    }
+    m_condition.notify_one();
+}
+
+void CIncludePrefetcher::_work()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+            if (m_stopping)
+                return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
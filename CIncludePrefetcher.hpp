@@ -0,0 +1,63 @@
+#ifndef CINCLUDEPREFETCHER_HPP
+#define CINCLUDEPREFETCHER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "CIncludeCache.hpp"
+
+// Loads includes ahead of the preprocessor. As soon as a buffer is available its raw bytes are
+// scanned for #include lines, and those files are read (and optionally lexed into the include
+// cache) on background threads, recursively. By the time the main pass reaches a directive the
+// file is usually ready.
+class CIncludePrefetcher
+{
+public:
+    typedef std::shared_future<CIncludeCache::EntryPtr> Pending;
+
+    // The prefetches issued for one run
+    class Session
+    {
+        friend class CIncludePrefetcher;
+        std::mutex mutex;
+        std::unordered_map<std::string, Pending> pending;
+    };
+    typedef std::shared_ptr<Session> SessionPtr;
+
+    CIncludePrefetcher(CIncludeCache& cache, unsigned int threadCount, bool lexAhead);
+    ~CIncludePrefetcher();
+    CIncludePrefetcher(const CIncludePrefetcher&) = delete;
+    CIncludePrefetcher& operator=(const CIncludePrefetcher&) = delete;
+
+    SessionPtr beginSession();
+
+    // Queues every file source includes that the session hasn't asked for yet
+    void prefetchIncludes(const SessionPtr& session, const CSourceBuffer& source);
+
+    // Waits for a prefetched include. Returns false if it was never requested, or if it was only
+    // read ahead and still has to be lexed.
+    bool wait(const SessionPtr& session, const std::string& filename, CIncludeCache::EntryPtr& entry);
+
+    // Quoted #include targets found at the start of a line, comments and strings aren't considered
+    static void scanIncludes(const char* begin, const char* end, std::vector<std::string>& out);
+private:
+    void _enqueue(std::function<void()> job);
+    void _work();
+
+    CIncludeCache& m_cache;
+    bool m_lexAhead;
+    bool m_stopping;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<std::function<void()> > m_jobs;
+    std::vector<std::thread> m_threads;
+};
+
+#endif // CINCLUDEPREFETCHER_HPP
@@ -1,13 +1,10 @@
 #include "CLexer.hpp"
-#include <algorithm>
+#include <charconv>
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
 
-const std::string numbers = "0123456789";
-const std::string identifierStart = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
-const std::string identifierBody = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-const std::string hexnumbers = "0123456789abcdefABCDEF";
-const std::string binaryNumbers = "01";
-const std::vector<std::string> keywords =
+static constexpr std::string_view keywords[] =
 {
     "and", "abstract", "auto", "bool", "break",
     "case", "cast", "class", "const", "continue",
@@ -24,43 +21,479 @@ const std::vector<std::string> keywords =
     "void", "while", "xor"
 };
 
-const std::string trivials = ",;\n\r\t [{(]})";
-const std::string opStart = "*/%+-<=>!?:^&>@|~.";
+static constexpr std::string_view operators[] =
+{
+    "+", "-", "*", "/", "%", "**", "++", "--",
+    "=", "+=", "-=", "*=", "/=", "%=", "**=",
+    "==", "!=", "<", ">", "<=", ">=",
+    "&&", "||", "!", "^^",
+    "&", "|", "^", "~", "<<", ">>", ">>>",
+    "&=", "|=", "^=", "<<=", ">>=", ">>>=",
+    "?", ":", "::", ".", "@"
+};
+
+static constexpr char operatorChars[] = "*/%+-<=>!?:^&@|~.";
+
+// Keywords are found through a perfect hash over the length and three characters of the word.
+// The seed is searched for at compile time, so editing the keyword list can't introduce collisions.
+static constexpr size_t KeywordTableSize = 256;
+
+static constexpr size_t keywordHash(std::string_view word, uint32_t seed)
+{
+    uint32_t hash = seed ^ uint32_t(word.size());
+    hash = (hash * 16777619u) ^ (unsigned char)word[0];
+    hash = (hash * 16777619u) ^ (unsigned char)word[word.size() / 2];
+    hash = (hash * 16777619u) ^ (unsigned char)word[word.size() - 1];
+    return (hash ^ (hash >> 15)) & (KeywordTableSize - 1);
+}
+
+struct KeywordTable
+{
+    std::string_view slots[KeywordTableSize];
+    uint32_t seed;
+    bool perfect;
+};
+
+static constexpr KeywordTable buildKeywordTable()
+{
+    for (uint32_t seed = 0; seed < 4096; ++seed)
+    {
+        KeywordTable table = {};
+        table.seed = seed;
+        table.perfect = true;
+        for (std::string_view keyword : keywords)
+        {
+            std::string_view& slot = table.slots[keywordHash(keyword, seed)];
+            if (!slot.empty())
+            {
+                table.perfect = false;
+                break;
+            }
+            slot = keyword;
+        }
+
+        if (table.perfect)
+            return table;
+    }
+
+    return KeywordTable();
+}
+
+static constexpr KeywordTable keywordTable = buildKeywordTable();
+static_assert(keywordTable.perfect, "No collision free seed for the keyword table, adjust keywordHash");
+
+// Operators are recognized by walking a trie built from the operator list, state 0 is the root
+// and a transition to state 0 means there is no longer operator.
+static constexpr size_t OperatorStateCount = 64;
+static constexpr size_t OperatorCharCount = sizeof(operatorChars) - 1;
+
+struct OperatorTrie
+{
+    uint8_t next[OperatorStateCount][OperatorCharCount];
+    bool accepts[OperatorStateCount];
+    uint8_t column[256];	//1 + index into operatorChars, 0 for characters that can't be part of an operator
+};
+
+static constexpr OperatorTrie buildOperatorTrie()
+{
+    OperatorTrie trie = {};
+    for (size_t i = 0; i < OperatorCharCount; ++i)
+        trie.column[(unsigned char)operatorChars[i]] = uint8_t(i + 1);
+
+    size_t stateCount = 1;
+    for (std::string_view op : operators)
+    {
+        size_t state = 0;
+        for (char c : op)
+        {
+            uint8_t& next = trie.next[state][trie.column[(unsigned char)c] - 1];
+            if (!next)
+                next = uint8_t(stateCount++);
+            state = next;
+        }
+        trie.accepts[state] = true;
+    }
+    return trie;
+}
+
+static constexpr OperatorTrie operatorTrie = buildOperatorTrie();
 
-const std::vector<std::string> operators=
+enum CharClass : uint8_t
 {
-    "*","**","/","%","+","-","<=",">"">=","==",
-    "!=","?","+=","-=","*=","/=","%=","**=","++",
-    "--","&","|","~","^","<<",">>",">>>","<<=",
-    ">>=",">>>=",".","||","!","^^","::","="
+    CHAR_TRIVIAL          = 1 << 0,
+    CHAR_IDENTIFIER_START = 1 << 1,
+    CHAR_IDENTIFIER_BODY  = 1 << 2,
+    CHAR_NUMBER           = 1 << 3,
+    CHAR_BINARY           = 1 << 4,
+    CHAR_HEX              = 1 << 5,
+    CHAR_OPERATOR_START   = 1 << 6,
+    CHAR_SCAN_STOP        = 1 << 7	//Bytes the directive scanner has to look at
 };
 
-const CLexer::TokenType TrivialTypes[] =
-{
-    CLexer::COMMA,
-    CLexer::SEMICOLON,
-    CLexer::NEWLINE,
-    CLexer::WHITESPACE,
-    CLexer::WHITESPACE,
-    CLexer::WHITESPACE,
-    CLexer::OPEN,
-    CLexer::OPEN,
-    CLexer::OPEN,
-    CLexer::CLOSE,
-    CLexer::CLOSE,
-    CLexer::CLOSE
+struct CharTable
+{
+    uint8_t classes[256];
+    CLexer::TokenType trivialTypes[256];
+};
+
+static constexpr void markChars(CharTable& table, const char* chars, uint8_t charClass)
+{
+    for (; *chars; ++chars)
+        table.classes[(unsigned char)*chars] |= charClass;
+}
+
+static constexpr void markTrivial(CharTable& table, const char* chars, CLexer::TokenType type)
+{
+    for (; *chars; ++chars)
+    {
+        table.classes[(unsigned char)*chars] |= CHAR_TRIVIAL;
+        table.trivialTypes[(unsigned char)*chars] = type;
+    }
+}
+
+static constexpr CharTable buildCharTable()
+{
+    CharTable table = {};
+    markChars(table, "0123456789", CHAR_NUMBER);
+    markChars(table, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ", CHAR_IDENTIFIER_START);
+    markChars(table, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789", CHAR_IDENTIFIER_BODY);
+    markChars(table, "0123456789abcdefABCDEF", CHAR_HEX);
+    markChars(table, "01", CHAR_BINARY);
+    markChars(table, operatorChars, CHAR_OPERATOR_START);
+    markChars(table, "\n/\"'\\", CHAR_SCAN_STOP);
+    markTrivial(table, ",", CLexer::COMMA);
+    markTrivial(table, ";", CLexer::SEMICOLON);
+    markTrivial(table, "\n", CLexer::NEWLINE);
+    markTrivial(table, "\r\t ", CLexer::WHITESPACE);
+    markTrivial(table, "[{(", CLexer::OPEN);
+    markTrivial(table, "]})", CLexer::CLOSE);
+    return table;
+}
+
+// One load per byte instead of a find_first_of over each character set
+static constexpr CharTable charTable = buildCharTable();
+
+static inline bool hasClass(char in, uint8_t charClass)
+{
+    return (charTable.classes[(unsigned char)in] & charClass) != 0;
+}
+
+enum ScanAction
+{
+    SCAN_CONTINUE,
+    SCAN_STOP_AT_LINE_START,	//Stop at the start of the directive's line
+    SCAN_STOP_AT_LINE_END	//Stop after the new line ending the directive
 };
 
+static inline const char* findByte(const char* start, const char* end, char c)
+{
+    const void* found = memchr(start, c, end - start);
+    return found ? static_cast<const char*>(found) : end;
+}
+
+// Skip a comment or literal starting at start, which is just past the opening /* or quote, and
+// return the byte after it. They end where the lexer ends them.
+static inline const char* skipBlockComment(const char* start, const char* end)
+{
+    while (true)
+    {
+        start = findByte(start, end, '*');
+        if (start == end)
+            return end;
+        ++start;
+        if (start != end && *start == '/')
+            return start + 1;
+    }
+}
+
+static inline const char* skipStringLiteral(const char* start, const char* end)
+{
+    while (start != end && *start != '"')
+    {
+        if (*start == '\\' && ++start == end)
+            break;
+        ++start;
+    }
+    return start != end ? start + 1 : end;
+}
+
+static inline const char* skipCharacterLiteral(const char* start, const char* end)
+{
+    // Same fixed width as _parseCharacterLiteral
+    if (start != end && *start == '\\')
+        ++start;
+    for (int i = 0; i < 2 && start != end; i++)
+        ++start;
+    return start;
+}
+
+// Walks the raw bytes calling visit(name) for every directive at the start of a line,
+// and skips comments, literals and line continuations of directives the same way the lexer
+// reads them so nothing inside them is mistaken for a directive, and a directive's line only
+// ends where the lexer ends it. Returns where visit asked to stop, or nullptr at end.
+template <typename Visitor>
+static const char* scanDirectives(const char* start, const char* end, bool atLineStart, Visitor visit)
+{
+    bool stopAtLineEnd = false;
+    bool inDirective = false;	//Backslashes continue the line, except on an #include
+    while (start != end)
+    {
+        if (atLineStart)
+        {
+            if (stopAtLineEnd)
+                return start;
+            atLineStart = false;
+
+            const char* lineStart = start;
+            while (start != end && (*start == ' ' || *start == '\t'))
+                ++start;
+            if (start != end && *start == '#')
+            {
+                const char* nameEnd = start + 1;
+                while (nameEnd != end && hasClass(*nameEnd, CHAR_IDENTIFIER_BODY))
+                    ++nameEnd;
+
+                std::string_view name(start, nameEnd - start);
+                ScanAction action = visit(name);
+                if (action == SCAN_STOP_AT_LINE_START)
+                    return lineStart;
+                inDirective = CLexer::directiveType(name) != CLexer::DIRECTIVE_INCLUDE;
+                stopAtLineEnd = (action == SCAN_STOP_AT_LINE_END);
+                start = nameEnd;
+            }
+            continue;
+        }
+
+        while (start != end && !hasClass(*start, CHAR_SCAN_STOP))
+            ++start;
+        if (start == end)
+            break;
+
+        switch (*start)
+        {
+        case '\n':
+            ++start;
+            atLineStart = true;
+            inDirective = false;
+            break;
+        case '\\':
+            // Like _parseToken, the rest of the line and its new line are swallowed
+            ++start;
+            if (inDirective)
+            {
+                start = findByte(start, end, '\n');
+                if (start != end)
+                    ++start;
+            }
+            break;
+        case '/':
+            ++start;
+            if (start == end)
+                break;
+            if (*start == '/')
+                start = findByte(start, end, '\n');	//The new line itself still ends the line
+            else if (*start == '*')
+                start = skipBlockComment(start + 1, end);
+            break;
+        case '"':
+            start = skipStringLiteral(start + 1, end);
+            break;
+        case '\'':
+            start = skipCharacterLiteral(start + 1, end);
+            break;
+        }
+    }
+
+    return stopAtLineEnd ? end : nullptr;
+}
+
+CLexer::DirectiveType CLexer::directiveType(std::string_view name)
+{
+    // Only a few lengths are possible, so most names take a single compare
+    switch (name.size())
+    {
+    case 3:
+        return name == "#if" ? DIRECTIVE_IF : DIRECTIVE_NONE;
+    case 5:
+        if (name == "#elif")
+            return DIRECTIVE_ELIF;
+        return name == "#else" ? DIRECTIVE_ELSE : DIRECTIVE_NONE;
+    case 6:
+        if (name == "#endif")
+            return DIRECTIVE_ENDIF;
+        if (name == "#ifdef")
+            return DIRECTIVE_IFDEF;
+        if (name == "#undef")
+            return DIRECTIVE_UNDEF;
+        return name == "#error" ? DIRECTIVE_ERROR : DIRECTIVE_NONE;
+    case 7:
+        if (name == "#define")
+            return DIRECTIVE_DEFINE;
+        if (name == "#ifndef")
+            return DIRECTIVE_IFNDEF;
+        return name == "#pragma" ? DIRECTIVE_PRAGMA : DIRECTIVE_NONE;
+    case 8:
+        if (name == "#include")
+            return DIRECTIVE_INCLUDE;
+        return name == "#warning" ? DIRECTIVE_WARNING : DIRECTIVE_NONE;
+    default:
+        return DIRECTIVE_NONE;
+    }
+}
+
+const char* CLexer::findConditional(const char* start, const char* end, bool atLineStart)
+{
+    const char* found = scanDirectives(start, end, atLineStart, [](std::string_view name) -> ScanAction
+    {
+        switch (directiveType(name))
+        {
+        case DIRECTIVE_IF:
+        case DIRECTIVE_IFDEF:
+        case DIRECTIVE_IFNDEF:
+        case DIRECTIVE_ELIF:
+        case DIRECTIVE_ELSE:
+        case DIRECTIVE_ENDIF:
+            return SCAN_STOP_AT_LINE_END;
+        default:
+            return SCAN_CONTINUE;
+        }
+    });
+    return found ? found : end;
+}
+
+const char* CLexer::findStatementBreak(const char* start, const char* end, const char* limit, bool atLineStart)
+{
+    int depth = 0;	//Open parentheses and brackets
+    char last = 0;	//Last byte of code so far, whitespace and comments aside
+    bool inDirective = false;
+    bool continues = false;	//Backslashes continue the directive's line
+    while (start != end)
+    {
+        if (atLineStart)
+        {
+            // Nothing after a finished statement or directive can belong to what came before,
+            // unless it's inside the arguments of a macro call
+            if (start >= limit && depth == 0 && (last == ';' || last == '{' || last == '}'))
+                return start;
+            atLineStart = false;
+
+            while (start != end && (*start == ' ' || *start == '\t'))
+                ++start;
+            if (start != end && *start == '#')
+            {
+                const char* nameEnd = start + 1;
+                while (nameEnd != end && hasClass(*nameEnd, CHAR_IDENTIFIER_BODY))
+                    ++nameEnd;
+                inDirective = true;
+                continues = directiveType(std::string_view(start, nameEnd - start)) != DIRECTIVE_INCLUDE;
+                start = nameEnd;
+            }
+            continue;
+        }
+
+        switch (*start)
+        {
+        case '\n':
+            ++start;
+            atLineStart = true;
+            if (inDirective)
+                last = ';';
+            inDirective = false;
+            break;
+        case ' ':
+        case '\t':
+        case '\r':
+            ++start;
+            break;
+        case '\\':
+            ++start;
+            if (inDirective && continues)
+            {
+                start = findByte(start, end, '\n');
+                if (start != end)
+                    ++start;
+            }
+            break;
+        case '/':
+            ++start;
+            if (start != end && *start == '/')
+                start = findByte(start, end, '\n');
+            else if (start != end && *start == '*')
+                start = skipBlockComment(start + 1, end);
+            else
+                last = '/';
+            break;
+        case '"':
+            start = skipStringLiteral(start + 1, end);
+            last = '"';
+            break;
+        case '\'':
+            start = skipCharacterLiteral(start + 1, end);
+            last = '\'';
+            break;
+        case '(':
+        case '[':
+            if (!inDirective)
+                depth++;
+            last = *start++;
+            break;
+        case ')':
+        case ']':
+            if (!inDirective && depth > 0)
+                depth--;
+            last = *start++;
+            break;
+        default:
+            last = *start++;
+            break;
+        }
+    }
+    return end;
+}
+
+const char* CLexer::skipConditional(const char* start, const char* end, bool toEndif)
+{
+    int depth = 0;
+    return scanDirectives(start, end, true, [&depth, toEndif](std::string_view name) -> ScanAction
+    {
+        switch (directiveType(name))
+        {
+        case DIRECTIVE_IF:
+        case DIRECTIVE_IFDEF:
+        case DIRECTIVE_IFNDEF:
+            depth++;
+            break;
+        case DIRECTIVE_ENDIF:
+            if (depth-- == 0)
+                return SCAN_STOP_AT_LINE_START;
+            break;
+        case DIRECTIVE_ELIF:
+        case DIRECTIVE_ELSE:
+            if (depth == 0 && !toEndif)
+                return SCAN_STOP_AT_LINE_START;
+            break;
+        default:
+            break;
+        }
+        return SCAN_CONTINUE;
+    });
+}
+
 CLexer::CLexer()
-    : m_lastIdentifier(nullptr)
+    : m_tokens(nullptr),
+      m_lastIdentifier(NoIdentifier)
 {
+    for (SymbolCacheSlot& slot : m_symbolCache)
+        slot.id = CSymbolTable::None;
 }
 
-void CLexer::lex(char* start, char* end, TokenList& tokens)
+void CLexer::lex(const char* start, const char* end, TokenList& tokens)
 {
     assert(start != 0 && end != 0 && "start and end cannot be null");
     assert(start <= end && "degenerate lex detected: end < start");
 
+    m_tokens = &tokens;
+    m_lastIdentifier = NoIdentifier;
     while (true)
     {
         CLexer::Token currentToken;
@@ -68,72 +501,101 @@ void CLexer::lex(char* start, char* end, TokenList& tokens)
         if (currentToken.type != CLexer::INVALID)
             tokens.push_back(currentToken);
 
-        if (currentToken.value != "#include")
+        if (currentToken.directive != CLexer::DIRECTIVE_INCLUDE)
         {
-            if ((currentToken.type == CLexer::IDENTIFIER || currentToken.type == CLexer::PREPROCESSOR) && !m_lastIdentifier)
-                m_lastIdentifier = &tokens.back();
+            if ((currentToken.type == CLexer::IDENTIFIER || currentToken.type == CLexer::PREPROCESSOR) && !_lastIdentifier())
+                m_lastIdentifier = tokens.size() - 1;
         }
         else
-            m_lastIdentifier = nullptr;
+            m_lastIdentifier = NoIdentifier;
 
         if (start == end)
             break;
     }
 }
 
-bool CLexer::_searchString(const std::string& str, char in) const
+CLexer::Token* CLexer::_lastIdentifier()
 {
-    return (str.find_first_of(in) != std::string::npos);
+    if (m_lastIdentifier == NoIdentifier)
+        return nullptr;
+    return &(*m_tokens)[m_lastIdentifier];
+}
+
+CSymbolTable::Id CLexer::_intern(std::string_view name)
+{
+    uint32_t hash = CSymbolTable::hash(name);
+    SymbolCacheSlot& slot = m_symbolCache[hash % SymbolCacheSize];
+    if (slot.id == CSymbolTable::None || slot.name != name)
+    {
+        slot.id = CSymbolTable::global().intern(name, hash);
+        slot.name = CSymbolTable::global().name(slot.id);
+    }
+    return slot.id;
 }
 
 bool CLexer::_isTrivial(char in) const
 {
-    return _searchString(trivials, in);
+    return hasClass(in, CHAR_TRIVIAL);
 }
 
 bool CLexer::_isIdentifierStart(char in) const
 {
-    return _searchString(identifierStart, in);
+    return hasClass(in, CHAR_IDENTIFIER_START);
 }
 
 bool CLexer::_isIdentifierBody(char in) const
 {
-    return _searchString(identifierBody, in);
+    return hasClass(in, CHAR_IDENTIFIER_BODY);
 }
 
 bool CLexer::_isNumber(char in) const
 {
-    return _searchString(numbers, in);
+    return hasClass(in, CHAR_NUMBER);
 }
 
 bool CLexer::_isBinary(char in) const
 {
-    return _searchString(binaryNumbers, in);
+    return hasClass(in, CHAR_BINARY);
 }
 
 bool CLexer::_isHex(char in) const
 {
-    return _searchString(hexnumbers, in);
+    return hasClass(in, CHAR_HEX);
 }
 
 bool CLexer::_isOperatorStart(char in) const
 {
-    return _searchString(opStart, in);
+    return hasClass(in, CHAR_OPERATOR_START);
 }
 
-bool CLexer::_isOperator(const std::string& val) const
+size_t CLexer::_matchOperator(const char* start, const char* end) const
 {
-    auto it = std::find(operators.begin(), operators.end(), val);
-    return (it != operators.end());
+    // Maximal munch, remember the longest prefix that ended on an accepting state
+    size_t state = 0;
+    size_t matched = 0;
+    for (const char* cur = start; cur != end; ++cur)
+    {
+        uint8_t column = operatorTrie.column[(unsigned char)*cur];
+        if (!column)
+            break;
+        state = operatorTrie.next[state][column - 1];
+        if (!state)
+            break;
+        if (operatorTrie.accepts[state])
+            matched = cur - start + 1;
+    }
+
+    return matched;
 }
 
-bool CLexer::_isKeyword(const std::string& val) const
+bool CLexer::_isKeyword(std::string_view val) const
 {
-    auto it = std::find(keywords.begin(), keywords.end(), val);
-    return (it != keywords.end());
+    if (val.empty())
+        return false;
+    return keywordTable.slots[keywordHash(val, keywordTable.seed)] == val;
 }
 
-char* CLexer::_parseToken(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseToken(const char* start, const char* end, CLexer::Token& out)
 {
     if (start == end)
         return start;
@@ -141,30 +603,34 @@ char* CLexer::_parseToken(char* start, char* end, CLexer::Token& out)
 
     if (_isTrivial(curChar))
     {
-        out.value += curChar;
-        out.type = TrivialTypes[trivials.find_first_of(curChar)];
-        if (out.value == "(" && m_lastIdentifier)
+        out.value = std::string_view(start, 1);
+        out.type = charTable.trivialTypes[(unsigned char)curChar];
+        Token* lastIdentifier = _lastIdentifier();
+        if (out.value == "(" && lastIdentifier)
         {
-            if (m_lastIdentifier->type == CLexer::IDENTIFIER)
-                m_lastIdentifier->type = CLexer::FUNCTION;
-            else if (m_lastIdentifier->type == CLexer::PREPROCESSOR && m_lastIdentifier->value == "#define")
-                m_lastIdentifier->type = CLexer::MACRO;
+            if (lastIdentifier->type == CLexer::IDENTIFIER)
+                lastIdentifier->type = CLexer::FUNCTION;
+            else if (lastIdentifier->type == CLexer::PREPROCESSOR && lastIdentifier->directive == CLexer::DIRECTIVE_DEFINE)
+                lastIdentifier->type = CLexer::MACRO;
         }
         else if (out.value == "\n")
-            m_lastIdentifier = nullptr;
+            m_lastIdentifier = NoIdentifier;
 
         return ++start;
     }
 
-    if (m_lastIdentifier && curChar == '\\')
+    Token* lastIdentifier = _lastIdentifier();
+    if (lastIdentifier && curChar == '\\')
     {
-        if ((m_lastIdentifier->type == CLexer::PREPROCESSOR || m_lastIdentifier->type == CLexer::MACRO))
+        if ((lastIdentifier->type == CLexer::PREPROCESSOR || lastIdentifier->type == CLexer::MACRO))
         {
-            // only handle this if we're working on a preprocessor or a macro
-            while(*start != '\n')
+            // only handle this if we're working on a preprocessor or a macro, the line break is
+            // swallowed and the directive continues after a single space
+            while (start != end && *start != '\n')
                 ++start;
-            *start = ' ';
-            return start;
+            out.value = " ";
+            out.type = CLexer::WHITESPACE;
+            return (start == end) ? start : ++start;
         }
     }
 
@@ -173,6 +639,8 @@ char* CLexer::_parseToken(char* start, char* end, CLexer::Token& out)
         start = _parseIdentifier(start, end, out);
         if (_isKeyword(out.value))
             out.type = CLexer::KEYWORD;
+        else
+            out.symbol = _intern(out.value);
 
         return start;
     }
@@ -181,6 +649,8 @@ char* CLexer::_parseToken(char* start, char* end, CLexer::Token& out)
     {
         start = _parseIdentifier(start, end, out);
         out.type = CLexer::PREPROCESSOR;
+        out.symbol = _intern(out.value);	//The # keeps directives apart from identifiers
+        out.directive = directiveType(out.value);
         return start;
     }
 
@@ -206,31 +676,33 @@ char* CLexer::_parseToken(char* start, char* end, CLexer::Token& out)
         return _parseOperator(start, end, out);
 
     // Nothing intradasting
-    out.value = curChar;
+    out.value = std::string_view(start, 1);
     out.type = CLexer::IGNORE;
     return ++start;
 }
 
-char* CLexer::_parseLineComment(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseLineComment(const char* start, const char* end, CLexer::Token& out)
 {
     out.type = CLexer::COMMENT;
-    out.value += "//";
+    const char* tokenStart = start - 1;
 
     while (true)
     {
         ++start;
         if (start == end)
-            return start;
-        out.value += *start;
+            break;
         if  (*start == '\n')
-            return start;
+            break;
     }
+
+    out.value = std::string_view(tokenStart, start - tokenStart + (start != end));
+    return start;
 }
 
-char* CLexer::_parseBlockComment(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseBlockComment(const char* start, const char* end, CLexer::Token& out)
 {
     out.type = CLexer::COMMENT;
-    out.value += "/*";
+    const char* tokenStart = start - 1;
     bool opened = true;
 
     while (true)
@@ -239,7 +711,6 @@ char* CLexer::_parseBlockComment(char* start, char* end, CLexer::Token& out)
         if (start == end)
             break;
 
-        out.value += *start;
         if (*start == '*')
         {
             ++start;
@@ -247,7 +718,6 @@ char* CLexer::_parseBlockComment(char* start, char* end, CLexer::Token& out)
                 break;
             if (*start == '/')
             {
-                out.value += *start;
                 ++start;
                 opened = false;
                 break;
@@ -257,67 +727,101 @@ char* CLexer::_parseBlockComment(char* start, char* end, CLexer::Token& out)
         }
     }
 
+    out.value = std::string_view(tokenStart, start - tokenStart);
     out.degenerate = opened;
     return start;
 }
 
-char* CLexer::_parseNumber(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseNumber(const char* start, const char* end, CLexer::Token& out)
 {
     out.type = CLexer::NUMBER;
-    out.value += *start;
+    const char* tokenStart = start;
     while (true)
     {
         ++start;
         if (start == end)
-            return start;
-        if (_isNumber(*start))
-            out.value += *start;
+            break;
+        if (_isNumber(*start) || *start == 'd')
+            continue;
         else if (*start == '.')
-            return _parseFloatingPoint(start, end, out);
+            start = _parseFloatingPoint(start, end, out);
         else if (*start == 'x')
-            return _parseHexConstant(start, end, out);
-        else if (*start == 'd')
-            out.value += *start;
+            start = _parseHexConstant(start, end, out);
         else if (*start == 'b')
-            return _parseBinaryConstant(start, end, out);
-        else
-            return start;
+            start = _parseBinaryConstant(start, end, out);
+        break;
+    }
+
+    out.value = std::string_view(tokenStart, start - tokenStart);
+    _decodeNumber(out);
+    return start;
+}
+
+void CLexer::_decodeNumber(CLexer::Token& out) const
+{
+    const char* first = out.value.data();
+    const char* last = first + out.value.size();
+    int base = 10;
+    if (out.value.size() > 2 && first[0] == '0')
+    {
+        switch (first[1])
+        {
+        case 'x': base = 16; first += 2; break;
+        case 'b': base = 2;  first += 2; break;
+        case 'd': base = 10; first += 2; break;
+        }
+    }
+
+    uint64_t integer;
+    std::from_chars_result result = std::from_chars(first, last, integer, base);
+    if (result.ec == std::errc() && result.ptr == last)
+    {
+        out.numberType = NUMBER_INTEGER;
+        out.integer = int64_t(integer);
+        return;
+    }
+
+    if (base != 10 || first != out.value.data())
+        return;
+    if (last[-1] == 'f')
+        --last;
+    double real;
+    result = std::from_chars(first, last, real);
+    if (result.ec == std::errc() && result.ptr == last)
+    {
+        out.numberType = NUMBER_REAL;
+        out.real = real;
     }
 }
 
-char* CLexer::_parseBinaryConstant(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseBinaryConstant(const char* start, const char* end, CLexer::Token& out)
 {
-    out.value += *start;
+    (void)(out);
     while (true)
     {
         ++start;
         if (start == end)
             return start;
-        if (_isBinary(*start))
-            out.value += *start;
-        else
+        if (!_isBinary(*start))
             return start;
     }
 }
 
-char* CLexer::_parseHexConstant(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseHexConstant(const char* start, const char* end, CLexer::Token& out)
 {
-    out.value += *start;
+    (void)(out);
     while (true)
     {
         ++start;
         if (start == end)
             return start;
-        if (_isHex(*start))
-            out.value += *start;
-        else
+        if (!_isHex(*start))
             return start;
     }
 }
 
-char* CLexer::_parseFloatingPoint(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseFloatingPoint(const char* start, const char* end, CLexer::Token& out)
 {
-    out.value += *start;
     bool hasExponent = false;
     while (true)
     {
@@ -329,24 +833,20 @@ char* CLexer::_parseFloatingPoint(char* start, char* end, CLexer::Token& out)
             if (*start == 'e')
             {
                 out.degenerate = hasExponent;
-                out.value += *start;
                 hasExponent = true;
                 continue;
             }
             else if (*start == 'f')
             {
-                out.value += *start;
                 ++start;
                 return start;
             }
             return start;
         }
-        else
-            out.value += *start;
     }
 }
 
-char* CLexer::_parseCharacterLiteral(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseCharacterLiteral(const char* start, const char* end, CLexer::Token& out)
 {
     ++start;
     if (start == end)
@@ -357,12 +857,22 @@ char* CLexer::_parseCharacterLiteral(char* start, char* end, CLexer::Token& out)
         ++start;
         if (start == end)
             return start;
-        if (*start == 'n')
-            out.value = '\n';
-        if (*start == 't')
-            out.value = '\t';
-        if (*start == 'r')
-            out.value = '\r';
+        // Escapes don't exist verbatim in the source, point at static storage instead
+        switch (*start)
+        {
+        case 'n': out.value = "\n"; break;
+        case 't': out.value = "\t"; break;
+        case 'r': out.value = "\r"; break;
+        case 'a': out.value = "\a"; break;
+        case 'b': out.value = "\b"; break;
+        case 'f': out.value = "\f"; break;
+        case 'v': out.value = "\v"; break;
+        case '0': out.value = std::string_view("\0", 1); break;
+        // \\, \', \" and the like stand for the escaped character itself
+        default: out.value = std::string_view(start, 1); break;
+        }
+        out.numberType = NUMBER_INTEGER;
+        out.integer = (unsigned char)out.value[0];
         ++start;
         if (start == end)
             return start;
@@ -370,7 +880,9 @@ char* CLexer::_parseCharacterLiteral(char* start, char* end, CLexer::Token& out)
     }
     else
     {
-        out.value = *start;
+        out.value = std::string_view(start, 1);
+        out.numberType = NUMBER_INTEGER;
+        out.integer = (unsigned char)*start;
         ++start;
         if (start == end)
             return start;
@@ -379,71 +891,60 @@ char* CLexer::_parseCharacterLiteral(char* start, char* end, CLexer::Token& out)
     return start;
 }
 
-char* CLexer::_parseStringLiteral(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseStringLiteral(const char* start, const char* end, CLexer::Token& out)
 {
     out.type = CLexer::STRING;
-    out.value += *start;
+    const char* tokenStart = start;
 
     while (true)
     {
         ++start;
         if (start == end)
-            return start;
-        out.value += *start;
+            break;
 
         // Are we at the end of the string?
         if (*start == '\"')
-            return ++start;
+        {
+            ++start;
+            break;
+        }
         // Is it an escape sequence?
         if (*start == '\\')
         {
             ++start;
             if (start == end)
-                return start;
-            out.value += *start;
+                break;
         }
     }
+
+    out.value = std::string_view(tokenStart, start - tokenStart);
+    return start;
 }
 
-char* CLexer::_parseIdentifier(char* start, char* end, CLexer::Token& out)
+const char* CLexer::_parseIdentifier(const char* start, const char* end, CLexer::Token& out)
 {
     out.type = CLexer::IDENTIFIER;
-    out.value += *start;
+    const char* tokenStart = start;
     while (true)
     {
         ++start;
         if (start == end)
-            return start;
-        if (_isIdentifierBody(*start))
-            out.value += *start;
-        else
-            return start;
-    }
-}
-
-char* CLexer::_parseOperator(char* start, char* end, CLexer::Token& out)
-{
-    out.type = CLexer::OPERATOR;
-    std::string operatorValue;
-
-    while (true)
-    {
-        if (start == end)
-        {
-            out.type = CLexer::INVALID;
-            return start;
-        }
-        if (_isOperatorStart(*start))
-            operatorValue += *start;
-        else
             break;
-
-        ++start;
+        if (!_isIdentifierBody(*start))
+            break;
     }
 
-    if (_isOperator(operatorValue))
-        out.value = operatorValue;
+    out.value = std::string_view(tokenStart, start - tokenStart);
     return start;
 }
 
+const char* CLexer::_parseOperator(const char* start, const char* end, CLexer::Token& out)
+{
+    out.type = CLexer::OPERATOR;
+    size_t length = _matchOperator(start, end);
+    if (length == 0)
+        length = 1;
 
+    out.value = std::string_view(start, length);
+    return start + length;
+}
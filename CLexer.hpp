@@ -2,13 +2,20 @@
 #define CLEXER_HPP
 
 
-#include <list>
+#include <memory>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include "CSymbolTable.hpp"
 
 class CLexer
 {
 public:
-    enum TokenType
+    // Kept to a byte, like NumberType, so a token stays as small as it was before it could
+    // hold a number
+    enum TokenType : uint8_t
     {
         INVALID,
         IDENTIFIER,		//Names which can be expanded.
@@ -33,31 +40,112 @@ public:
     {
     };
 
+    // What the lexer made of a NUMBER token
+    enum NumberType : uint8_t
+    {
+        NUMBER_NONE,	//Not a number, or not one that could be decoded
+        NUMBER_INTEGER,	//In integer, character literals included
+        NUMBER_REAL	//In real
+    };
+
+    // Directives the preprocessor handles itself, told apart once by the lexer
+    enum DirectiveType : uint8_t
+    {
+        DIRECTIVE_NONE,	//Not a directive, or one left to hooks
+        DIRECTIVE_DEFINE,
+        DIRECTIVE_UNDEF,
+        DIRECTIVE_IF,
+        DIRECTIVE_IFDEF,
+        DIRECTIVE_IFNDEF,
+        DIRECTIVE_ELIF,
+        DIRECTIVE_ELSE,
+        DIRECTIVE_ENDIF,
+        DIRECTIVE_INCLUDE,
+        DIRECTIVE_PRAGMA,
+        DIRECTIVE_WARNING,
+        DIRECTIVE_ERROR
+    };
+
     struct Token
     {
         Token()
             : type(INVALID),
-              degenerate(false)
+              numberType(NUMBER_NONE),
+              directive(DIRECTIVE_NONE),
+              degenerate(false),
+              symbol(CSymbolTable::None),
+              integer(0)
+        {
+        }
+
+        Token(TokenType type, std::string text)
+            : type(type),
+              numberType(NUMBER_NONE),
+              directive(DIRECTIVE_NONE),
+              degenerate(false),
+              symbol(CSymbolTable::None),
+              integer(0)
+        {
+            assign(std::move(text));
+        }
+
+        // Gives the token its own copy of text, for tokens that don't come from a source buffer.
+        void assign(std::string text)
+        {
+            std::shared_ptr<const std::string> owned = std::make_shared<const std::string>(std::move(text));
+            value = *owned;
+            storage = std::move(owned);
+        }
+
+        // The same, with the text and its bookkeeping taken from the resource the text uses
+        void assign(std::pmr::string text)
         {
+            std::pmr::polymorphic_allocator<std::pmr::string> allocator(text.get_allocator());
+            std::shared_ptr<const std::pmr::string> owned = std::allocate_shared<std::pmr::string>(allocator, std::move(text));
+            value = *owned;
+            storage = std::move(owned);
         }
 
-        std::string value;
+        std::string_view value;	//Points into the lexed source buffer, or into storage.
         TokenType type;
+        NumberType numberType;
+        DirectiveType directive;	//Of PREPROCESSOR and MACRO tokens
+        bool degenerate;
+        CSymbolTable::Id symbol;	//Interned name of identifiers and directives (with the #), None for everything else.
         union
         {
             OperatorType opType;
+            int64_t integer;
+            double real;
         };
-        bool degenerate;
+        std::shared_ptr<const void> storage;
     };
 
-    typedef std::list<CLexer::Token> TokenList;
+    // Tokens are kept wherever the list's memory resource puts them, the heap unless the list
+    // was given another resource
+    typedef std::pmr::vector<CLexer::Token> TokenList;
     typedef TokenList::iterator TokenIterator;
+    typedef TokenList::const_iterator ConstTokenIterator;
 
     CLexer();
 
-    void lex(char* start, char* end, TokenList& tokens);
+    void lex(const char* start, const char* end, TokenList& tokens);
+
+    // Byte level scanning, used to step over code without tokenizing it. Comments and literals
+    // are skipped the way lex reads them and directives are only recognised at the start of a line.
+    // findConditional returns the end of the next line holding a conditional directive, or end.
+    // skipConditional returns the start of the line holding the #elif or #else continuing the
+    // block start is in or the #endif closing it, or nullptr if the block is never closed. With
+    // toEndif only the #endif ends the skip.
+    static const char* findConditional(const char* start, const char* end, bool atLineStart);
+    // Start of the first line at or after limit that follows a statement or directive, outside
+    // any parentheses or brackets, so nothing from before continues on it. Returns end if there
+    // is no such line. Lets a long stretch of code be lexed a piece at a time.
+    static const char* findStatementBreak(const char* start, const char* end, const char* limit, bool atLineStart);
+    static const char* skipConditional(const char* start, const char* end, bool toEndif);
+    // name includes the #
+    static DirectiveType directiveType(std::string_view name);
 private:
-    bool _searchString(const std::string& str, char in) const;
     bool _isTrivial(char in) const;
     bool _isIdentifierStart(char in) const;
     bool _isIdentifierBody(char in) const;
@@ -65,21 +153,36 @@ private:
     bool _isBinary(char in) const;
     bool _isHex(char in) const;
     bool _isOperatorStart(char in) const;
-    bool _isOperator(const std::string& val) const;
-    bool _isKeyword(const std::string& val) const;
-    char* _parseToken(char* start, char* end, Token& out);
-    char* _parseLiteral(char* start, char* end, Token& out);
-    char* _parseLineComment(char* start, char* end, Token& out);
-    char* _parseBlockComment(char* start, char* end, Token& out);
-    char* _parseNumber(char* start, char* end, Token& out);
-    char* _parseBinaryConstant(char* start, char* end, Token& out);
-    char* _parseHexConstant(char* start, char* end, Token& out);
-    char* _parseFloatingPoint(char* start, char* end, Token& out);
-    char* _parseCharacterLiteral(char* start, char* end, Token& out);
-    char* _parseStringLiteral(char* start, char* end, Token& out);
-    char* _parseIdentifier(char* start, char* end, Token& out);
-    char* _parseOperator(char* start, char* end, Token& out);
-    Token* m_lastIdentifier;
+    size_t _matchOperator(const char* start, const char* end) const;
+    bool _isKeyword(std::string_view val) const;
+    const char* _parseToken(const char* start, const char* end, Token& out);
+    const char* _parseLiteral(const char* start, const char* end, Token& out);
+    const char* _parseLineComment(const char* start, const char* end, Token& out);
+    const char* _parseBlockComment(const char* start, const char* end, Token& out);
+    const char* _parseNumber(const char* start, const char* end, Token& out);
+    void _decodeNumber(Token& out) const;
+    const char* _parseBinaryConstant(const char* start, const char* end, Token& out);
+    const char* _parseHexConstant(const char* start, const char* end, Token& out);
+    const char* _parseFloatingPoint(const char* start, const char* end, Token& out);
+    const char* _parseCharacterLiteral(const char* start, const char* end, Token& out);
+    const char* _parseStringLiteral(const char* start, const char* end, Token& out);
+    const char* _parseIdentifier(const char* start, const char* end, Token& out);
+    const char* _parseOperator(const char* start, const char* end, Token& out);
+    Token* _lastIdentifier();
+    CSymbolTable::Id _intern(std::string_view name);
+
+    static const size_t NoIdentifier = size_t(-1);
+    TokenList* m_tokens;
+    size_t m_lastIdentifier;	//Index into m_tokens, pointers would dangle as it grows.
+
+    // Recently interned names, so repeated identifiers don't have to lock the shared symbol table
+    struct SymbolCacheSlot
+    {
+        std::string_view name;	//Points into the symbol table
+        CSymbolTable::Id id;
+    };
+    static constexpr size_t SymbolCacheSize = 256;
+    SymbolCacheSlot m_symbolCache[SymbolCacheSize];
 };
 
 #endif // CLEXER_HPP
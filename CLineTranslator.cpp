@@ -1,18 +1,42 @@
 #include "CLineTranslator.hpp"
+#include <algorithm>
 
+static const std::string NoFileName;
 
-CLineTranslator::Table::Entry& CLineTranslator::Table::search(unsigned int line)
+const CLineTranslator::Table::Entry* CLineTranslator::Table::search(unsigned int line) const
 {
-    for (size_t i = 1; i < lines.size(); ++i)
+    if (lines.empty())
+        return nullptr;
+
+    // First range starting after line, the one before it holds line
+    auto iter = std::upper_bound(lines.begin(), lines.end(), line, [](unsigned int line, const Entry& entry)
     {
-        if (line < lines[i].startLine)
-            return lines[i-1];
-    }
+        return line < entry.startLine;
+    });
+
+    if (iter == lines.begin())
+        return &lines.front();
+    return &*(iter - 1);
+}
+
+unsigned int CLineTranslator::Table::fileId(const std::string& file)
+{
+    auto iter = m_fileIds.find(file);
+    if (iter != m_fileIds.end())
+        return iter->second;
 
-    return lines[lines.size() - 1];
+    unsigned int id = (unsigned int)files.size();
+    files.push_back(file);
+    m_fileIds.emplace(file, id);
+    return id;
 }
 
 void CLineTranslator::Table::addLineRange(const std::string& file, unsigned int startLine, unsigned int offset)
+{
+    addLineRange(fileId(file), startLine, offset);
+}
+
+void CLineTranslator::Table::addLineRange(unsigned int file, unsigned int startLine, unsigned int offset)
 {
     Entry e;
     e.file = file;
@@ -21,22 +45,60 @@ void CLineTranslator::Table::addLineRange(const std::string& file, unsigned int
     lines.push_back(e);
 }
 
+void CLineTranslator::Table::clear()
+{
+    files.clear();
+    lines.clear();
+    m_fileIds.clear();
+}
+
 
 CLineTranslator::CLineTranslator()
 {
 }
 
-std::string CLineTranslator::resolveOriginalFile(unsigned int lineNumber)
+const std::string& CLineTranslator::resolveOriginalFile(unsigned int lineNumber) const
+{
+    const Table::Entry* entry = m_table.search(lineNumber);
+    return entry ? m_table.files[entry->file] : NoFileName;
+}
+
+unsigned int CLineTranslator::resolveOriginalLine(unsigned int lineNumber) const
 {
-    return m_table.search(lineNumber).file;
+    const Table::Entry* entry = m_table.search(lineNumber);
+    return entry ? lineNumber - entry->offset : lineNumber;
+}
+
+void CLineTranslator::resolve(const unsigned int* lineNumbers, size_t count, Location* out) const
+{
+    const std::vector<Table::Entry>& lines = m_table.lines;
+    size_t range = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned int line = lineNumbers[i];
+        if (lines.empty())
+        {
+            out[i].file = NoFile;
+            out[i].line = line;
+            continue;
+        }
+
+        if (i != 0 && line < lineNumbers[i - 1])
+            range = m_table.search(line) - lines.data();
+        while (range + 1 < lines.size() && lines[range + 1].startLine <= line)
+            range++;
+
+        out[i].file = lines[range].file;
+        out[i].line = line - lines[range].offset;
+    }
 }
 
-unsigned int CLineTranslator::resolveOriginalLine(unsigned int lineNumber)
+const std::string& CLineTranslator::fileName(unsigned int file) const
 {
-    return lineNumber - m_table.search(lineNumber).offset;
+    return file < m_table.files.size() ? m_table.files[file] : NoFileName;
 }
 
 void CLineTranslator::reset()
 {
-    m_table.lines.clear();
+    m_table.clear();
 }
@@ -2,6 +2,7 @@
 #define CLINENUMBERTRANSLATOR_HPP
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class CLineTranslator
@@ -11,23 +12,45 @@ public:
     {
         struct Entry
         {
-            std::string file;
+            unsigned int file;	//Index into files
             unsigned int startLine;
             unsigned int offset;
         };
 
-        std::vector<Entry> lines;
+        std::vector<std::string> files;	//Each file name once
+        std::vector<Entry> lines;	//Sorted by startLine
 
-        Entry& search(unsigned int line);
+        // The range line falls in, found by binary search. Lines before the first range belong
+        // to it. nullptr if the table is empty.
+        const Entry* search(unsigned int line) const;
 
+        unsigned int fileId(const std::string& file);
+        // startLine can't be lower than that of the range added before
         void addLineRange(const std::string& file, unsigned int startLine, unsigned int offset);
+        void addLineRange(unsigned int file, unsigned int startLine, unsigned int offset);
+        void clear();
+    private:
+        std::unordered_map<std::string, unsigned int> m_fileIds;
     };
 
+    struct Location
+    {
+        unsigned int file;	//Index into Table::files, NoFile if the table is empty
+        unsigned int line;
+    };
+    static const unsigned int NoFile = ~0u;
+
     CLineTranslator();
-    std::string resolveOriginalFile(unsigned int lineNumber);
-    unsigned int resolveOriginalLine(unsigned int lineNumber);
-    inline void setTable(Table table) { m_table = table; }
+    const std::string& resolveOriginalFile(unsigned int lineNumber) const;
+    unsigned int resolveOriginalLine(unsigned int lineNumber) const;
+    // Resolves count output lines in a single pass over the table when they're sorted, lines
+    // that go backwards are looked up on their own
+    void resolve(const unsigned int* lineNumbers, size_t count, Location* out) const;
+    const std::string& fileName(unsigned int file) const;
+
+    inline void setTable(Table table) { m_table = std::move(table); }
     inline Table& table() { return m_table; }
+    inline const Table& table() const { return m_table; }
     void reset();
 private:
     Table m_table;
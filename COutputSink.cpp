@@ -0,0 +1,170 @@
+#include "COutputSink.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#endif
+
+COutputSink::~COutputSink()
+{
+}
+
+void COutputSink::write(const CLexer::Token* tokens, size_t count)
+{
+    forEachSpan(tokens, count, [this](std::string_view text) { writeText(text); });
+}
+
+void COutputSink::beginFile(std::string_view, size_t)
+{
+}
+
+void COutputSink::endFile()
+{
+}
+
+CStringSink::CStringSink(std::string& out, size_t reserve)
+    : m_out(out)
+{
+    m_out.reserve(reserve);
+}
+
+void CStringSink::writeText(std::string_view text)
+{
+    m_out += text;
+}
+
+void CStringSink::beginFile(std::string_view, size_t size)
+{
+    // Grow geometrically so many small includes don't reallocate one by one
+    size_t needed = m_out.size() + size;
+    if (needed > m_out.capacity())
+        m_out.reserve(std::max(needed, m_out.capacity() * 2));
+}
+
+CCallbackSink::CCallbackSink(std::function<void(std::string_view)> callback)
+    : m_callback(std::move(callback))
+{
+}
+
+void CCallbackSink::writeText(std::string_view text)
+{
+    if (m_callback)
+        m_callback(text);
+}
+
+CFileSink::CFileSink(FILE* file)
+    : m_file(file),
+      m_failed(false)
+{
+}
+
+void CFileSink::writeText(std::string_view text)
+{
+    if (fwrite(text.data(), 1, text.size(), m_file) != text.size())
+        m_failed = true;
+}
+
+CFdSink::CFdSink(int fd)
+    : m_fd(fd),
+      m_failed(false)
+{
+}
+
+void CFdSink::write(const CLexer::Token* tokens, size_t count)
+{
+    // The tokens point into source buffers that outlive this call, so the spans can be handed
+    // to the kernel directly instead of being copied together first
+    forEachSpan(tokens, count, [this](std::string_view text) { m_pending.push_back(text); });
+    _flush();
+}
+
+void CFdSink::writeText(std::string_view text)
+{
+    m_pending.push_back(text);
+    _flush();
+}
+
+void CFdSink::_flush()
+{
+#ifdef _WIN32
+    for (std::string_view text : m_pending)
+    {
+        while (!text.empty() && !m_failed)
+        {
+            int written = _write(m_fd, text.data(), unsigned(std::min<size_t>(text.size(), INT_MAX)));
+            if (written < 0)
+                m_failed = true;
+            else
+                text.remove_prefix(written);
+        }
+    }
+#else
+    std::vector<iovec> vectors(m_pending.size());
+    for (size_t i = 0; i < m_pending.size(); i++)
+    {
+        vectors[i].iov_base = const_cast<char*>(m_pending[i].data());
+        vectors[i].iov_len = m_pending[i].size();
+    }
+
+    size_t first = 0;
+    while (first < vectors.size() && !m_failed)
+    {
+        int batch = int(std::min<size_t>(vectors.size() - first, IOV_MAX));
+        ssize_t written = writev(m_fd, &vectors[first], batch);
+        if (written < 0)
+        {
+            if (errno != EINTR)
+                m_failed = true;
+            continue;
+        }
+
+        // Step over everything that was written, a partial write leaves the rest of a span
+        while (first < vectors.size() && size_t(written) >= vectors[first].iov_len)
+            written -= vectors[first++].iov_len;
+        if (first < vectors.size())
+        {
+            vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + written;
+            vectors[first].iov_len -= written;
+        }
+    }
+#endif
+    m_pending.clear();
+}
+
+void CSectionSink::writeText(std::string_view text)
+{
+    if (m_sections.empty())
+        m_sections.push_back({std::string(), 0, std::string()});
+    m_sections.back().text += text;
+}
+
+void CSectionSink::beginFile(std::string_view filename, size_t size)
+{
+    m_sections.push_back({std::string(filename), unsigned(m_files.size()), std::string()});
+    m_sections.back().text.reserve(size);
+    m_files.push_back(std::string(filename));
+}
+
+void CSectionSink::endFile()
+{
+    if (m_files.empty())
+        return;
+
+    m_files.pop_back();
+    if (!m_files.empty())
+        m_sections.push_back({m_files.back(), unsigned(m_files.size() - 1), std::string()});
+}
+
+void CSectionSink::clear()
+{
+    m_sections.clear();
+    m_files.clear();
+}
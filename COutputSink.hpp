@@ -0,0 +1,122 @@
+#ifndef COUTPUTSINK_HPP
+#define COUTPUTSINK_HPP
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdio.h>
+#include "CLexer.hpp"
+
+// Receives the preprocessed output while a run is still going, a few thousand tokens at a time,
+// so the expanded program never has to exist in memory as a whole. Token values are only valid
+// for the duration of the write call.
+class COutputSink
+{
+public:
+    virtual ~COutputSink();
+
+    // By default splits the tokens into runs that are adjacent in memory, which mostly means
+    // whole stretches of a source file, and passes each of them to writeText.
+    virtual void write(const CLexer::Token* tokens, size_t count);
+    virtual void writeText(std::string_view text) = 0;
+
+    // A file starts or stops contributing output. The root file begins first, each include
+    // begins when it's entered and ends before the including file continues. size is the
+    // file's size in bytes, a hint for sinks that reserve memory.
+    virtual void beginFile(std::string_view filename, size_t size);
+    virtual void endFile();
+
+    // Calls span for every run of tokens that are adjacent in memory
+    template <typename SpanFunc>
+    static void forEachSpan(const CLexer::Token* tokens, size_t count, SpanFunc span)
+    {
+        size_t i = 0;
+        while (i < count)
+        {
+            const char* start = tokens[i].value.data();
+            size_t length = tokens[i].value.size();
+            for (++i; i < count && tokens[i].value.data() == start + length; ++i)
+                length += tokens[i].value.size();
+            if (length != 0)
+                span(std::string_view(start, length));
+        }
+    }
+};
+
+// Appends to a string, growing it ahead of time by the size of every file that is entered
+class CStringSink : public COutputSink
+{
+public:
+    explicit CStringSink(std::string& out, size_t reserve = 0);
+
+    void writeText(std::string_view text) override;
+    void beginFile(std::string_view filename, size_t size) override;
+private:
+    std::string& m_out;
+};
+
+class CCallbackSink : public COutputSink
+{
+public:
+    explicit CCallbackSink(std::function<void(std::string_view)> callback);
+
+    void writeText(std::string_view text) override;
+private:
+    std::function<void(std::string_view)> m_callback;
+};
+
+class CFileSink : public COutputSink
+{
+public:
+    explicit CFileSink(FILE* file);
+
+    void writeText(std::string_view text) override;
+    inline bool failed() const { return m_failed; }
+private:
+    FILE* m_file;
+    bool  m_failed;
+};
+
+// Writes straight to a file descriptor, gathering the spans of each batch into writev calls
+class CFdSink : public COutputSink
+{
+public:
+    explicit CFdSink(int fd);
+
+    void write(const CLexer::Token* tokens, size_t count) override;
+    void writeText(std::string_view text) override;
+    inline bool failed() const { return m_failed; }
+private:
+    void _flush();
+
+    int  m_fd;
+    bool m_failed;
+    std::vector<std::string_view> m_pending;
+};
+
+// Keeps the output of each file separately. An include splits the including file's output
+// into a section before and a section after it.
+class CSectionSink : public COutputSink
+{
+public:
+    struct Section
+    {
+        std::string filename;
+        unsigned int depth;	//Include depth, 0 for the root file
+        std::string text;
+    };
+    typedef std::vector<Section> SectionList;
+
+    void writeText(std::string_view text) override;
+    void beginFile(std::string_view filename, size_t size) override;
+    void endFile() override;
+
+    inline const SectionList& sections() const { return m_sections; }
+    void clear();
+private:
+    SectionList m_sections;
+    std::vector<std::string> m_files;	//Files currently open, innermost last
+};
+
+#endif // COUTPUTSINK_HPP
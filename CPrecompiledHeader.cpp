@@ -0,0 +1,560 @@
+#include "CPrecompiledHeader.hpp"
+#include "CIncludeCache.hpp"
+#include <stdio.h>
+#include <string.h>
+
+// File layout: a FileHeader, then the records of every section in Section order, then one blob
+// holding all text. Records refer to text by offset into the blob and to each other by index.
+// Everything is stored in the byte order of the machine that wrote it, files from the other
+// order are rejected rather than converted.
+
+static const char Magic[8] = { 'A', 'S', 'P', 'P', 'P', 'C', 'H', '\0' };
+static const uint32_t ByteOrderMark = 0x01020304;
+
+enum Section
+{
+    SECTION_FILES,
+    SECTION_OUTPUT,	//Output tokens
+    SECTION_POOL,	//Tokens of defines and macros
+    SECTION_DEFINES,
+    SECTION_ARGS,	//Define arguments
+    SECTION_MACROS,
+    SECTION_LINES,
+    SECTION_INCLUDES,
+    SECTION_CONSULTED,
+    SECTION_COUNT
+};
+
+struct StringRef
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SectionRef
+{
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct FileHeader
+{
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  byteOrder;
+    uint64_t  applicationHash;
+    uint32_t  lineCount;
+    uint32_t  counter;
+    StringRef header;
+    StringRef guard;
+    uint32_t  once;
+    uint32_t  reserved;
+    SectionRef strings;	//count is in bytes
+    SectionRef sections[SECTION_COUNT];
+};
+
+struct FileRecord
+{
+    StringRef path;
+    uint32_t  reserved;
+    uint64_t  size;
+    uint64_t  hash;
+};
+
+struct TokenRecord
+{
+    StringRef text;
+    uint16_t  type;
+    uint16_t  degenerate;
+    uint32_t  numberType;
+    int64_t   number;	//The integer, or the bits of the real
+};
+
+struct DefineRecord
+{
+    StringRef name;
+    uint32_t  undefined;
+    uint32_t  firstToken;
+    uint32_t  tokenCount;
+    uint32_t  firstArg;
+    uint32_t  argCount;
+};
+
+struct ArgRecord
+{
+    StringRef name;
+    int32_t   index;
+};
+
+struct MacroRecord
+{
+    StringRef name;
+    uint32_t  firstArg;	//Into the token pool, like the code
+    uint32_t  argCount;
+    uint32_t  firstCode;
+    uint32_t  codeCount;
+};
+
+struct LineRecord
+{
+    StringRef file;
+    uint32_t  startLine;
+    uint32_t  offset;
+};
+
+struct IncludeRecord
+{
+    StringRef name;
+    StringRef guard;
+    uint32_t  once;
+};
+
+static const size_t RecordSizes[SECTION_COUNT] =
+{
+    sizeof(FileRecord),
+    sizeof(TokenRecord),
+    sizeof(TokenRecord),
+    sizeof(DefineRecord),
+    sizeof(ArgRecord),
+    sizeof(MacroRecord),
+    sizeof(LineRecord),
+    sizeof(IncludeRecord),
+    sizeof(StringRef)
+};
+
+struct Writer
+{
+    std::string strings;
+    std::string sections[SECTION_COUNT];
+
+    StringRef string(std::string_view text)
+    {
+        StringRef ref;
+        ref.offset = uint32_t(strings.size());
+        ref.length = uint32_t(text.size());
+        strings.append(text.data(), text.size());
+        return ref;
+    }
+
+    template <typename T>
+    void add(Section section, const T& record)
+    {
+        sections[section].append((const char*)&record, sizeof(T));
+    }
+
+    inline uint32_t count(Section section) const { return uint32_t(sections[section].size() / RecordSizes[section]); }
+
+    void token(Section section, const CLexer::Token& token)
+    {
+        TokenRecord record;
+        record.text = string(token.value);
+        record.type = uint16_t(token.type);
+        record.degenerate = token.degenerate;
+        record.numberType = token.numberType;
+        if (token.numberType == CLexer::NUMBER_REAL)
+            memcpy(&record.number, &token.real, sizeof(record.number));
+        else
+            record.number = token.numberType == CLexer::NUMBER_INTEGER ? token.integer : 0;
+        add(section, record);
+    }
+};
+
+struct Reader
+{
+    const char* data;
+    size_t size;
+    FileHeader header;
+
+    bool string(const StringRef& ref, std::string_view& out) const
+    {
+        if (ref.offset > header.strings.count || ref.length > header.strings.count - ref.offset)
+            return false;
+        out = std::string_view(data + header.strings.offset + ref.offset, ref.length);
+        return true;
+    }
+
+    bool string(const StringRef& ref, std::string& out) const
+    {
+        std::string_view view;
+        if (!string(ref, view))
+            return false;
+        out = std::string(view);
+        return true;
+    }
+
+    template <typename T>
+    bool record(Section section, uint64_t index, T& out) const
+    {
+        if (index >= header.sections[section].count)
+            return false;
+        // Records aren't necessarily aligned in the mapping
+        memcpy(&out, data + header.sections[section].offset + index * sizeof(T), sizeof(T));
+        return true;
+    }
+
+    // Identifiers of defines and macros are interned again, their ids are only valid in this process
+    bool token(Section section, uint64_t index, bool intern, CLexer::Token& out) const
+    {
+        TokenRecord tokenRecord;
+        if (!record(section, index, tokenRecord) || tokenRecord.type > CLexer::OPERATOR || tokenRecord.numberType > CLexer::NUMBER_REAL || !string(tokenRecord.text, out.value))
+            return false;
+        out.type = CLexer::TokenType(tokenRecord.type);
+        out.degenerate = tokenRecord.degenerate != 0;
+        out.numberType = CLexer::NumberType(tokenRecord.numberType);
+        if (out.numberType == CLexer::NUMBER_REAL)
+            memcpy(&out.real, &tokenRecord.number, sizeof(out.real));
+        else
+            out.integer = tokenRecord.number;
+        if (intern && (out.type == CLexer::IDENTIFIER || out.type == CLexer::PREPROCESSOR || out.type == CLexer::MACRO))
+            out.symbol = CSymbolTable::global().intern(out.value);
+        if (out.type == CLexer::PREPROCESSOR || out.type == CLexer::MACRO)
+            out.directive = CLexer::directiveType(out.value);
+        return true;
+    }
+
+    bool tokens(uint64_t first, uint64_t count, CLexer::TokenList& out) const
+    {
+        if (first > header.sections[SECTION_POOL].count || count > header.sections[SECTION_POOL].count - first)
+            return false;
+        out.resize(count);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (!token(SECTION_POOL, first + i, true, out[i]))
+                return false;
+        }
+        return true;
+    }
+};
+
+CPrecompiledHeader::CPrecompiledHeader()
+    : once(false),
+      applicationHash(0),
+      lineCount(0),
+      counter(0)
+{
+}
+
+bool CPrecompiledHeader::save(const std::string& path) const
+{
+    Writer writer;
+    FileHeader fileHeader;
+    memset(&fileHeader, 0, sizeof(fileHeader));
+    memcpy(fileHeader.magic, Magic, sizeof(Magic));
+    fileHeader.version = Version;
+    fileHeader.byteOrder = ByteOrderMark;
+    fileHeader.applicationHash = applicationHash;
+    fileHeader.lineCount = lineCount;
+    fileHeader.counter = counter;
+    fileHeader.header = writer.string(header);
+    fileHeader.guard = writer.string(guard);
+    fileHeader.once = once;
+
+    // Output first, so its text is contiguous in the blob and reaches sinks in few large spans
+    for (const CLexer::Token& token : tokens)
+        writer.token(SECTION_OUTPUT, token);
+
+    for (const File& file : files)
+    {
+        FileRecord record;
+        memset(&record, 0, sizeof(record));
+        record.path = writer.string(file.path);
+        record.size = file.size;
+        record.hash = file.hash;
+        writer.add(SECTION_FILES, record);
+    }
+
+    for (const Define& define : defines)
+    {
+        DefineRecord record;
+        memset(&record, 0, sizeof(record));
+        record.name = writer.string(CSymbolTable::global().name(define.id));
+        record.undefined = !define.entry;
+        record.firstToken = writer.count(SECTION_POOL);
+        record.firstArg = writer.count(SECTION_ARGS);
+        if (define.entry)
+        {
+            for (const CLexer::Token& token : define.entry->tokens)
+                writer.token(SECTION_POOL, token);
+            for (const auto& arg : define.entry->arguments)
+            {
+                ArgRecord argRecord;
+                argRecord.name = writer.string(arg.first);
+                argRecord.index = arg.second;
+                writer.add(SECTION_ARGS, argRecord);
+            }
+            record.tokenCount = uint32_t(define.entry->tokens.size());
+            record.argCount = uint32_t(define.entry->arguments.size());
+        }
+        writer.add(SECTION_DEFINES, record);
+    }
+
+    for (const Macro& macro : macros)
+    {
+        MacroRecord record;
+        record.name = writer.string(macro.name);
+        record.firstArg = writer.count(SECTION_POOL);
+        record.argCount = uint32_t(macro.args.size());
+        for (const CLexer::Token& token : macro.args)
+            writer.token(SECTION_POOL, token);
+        record.firstCode = writer.count(SECTION_POOL);
+        record.codeCount = uint32_t(macro.code.size());
+        for (const CLexer::Token& token : macro.code)
+            writer.token(SECTION_POOL, token);
+        writer.add(SECTION_MACROS, record);
+    }
+
+    for (const CLineTranslator::Table::Entry& line : lines.lines)
+    {
+        LineRecord record;
+        record.file = writer.string(lines.files[line.file]);
+        record.startLine = line.startLine;
+        record.offset = line.offset;
+        writer.add(SECTION_LINES, record);
+    }
+
+    for (const IncludeState& include : includes)
+    {
+        IncludeRecord record;
+        record.name = writer.string(include.name);
+        record.guard = writer.string(include.guard);
+        record.once = include.once;
+        writer.add(SECTION_INCLUDES, record);
+    }
+
+    for (CSymbolTable::Id id : consulted)
+        writer.add(SECTION_CONSULTED, writer.string(CSymbolTable::global().name(id)));
+
+    if (writer.strings.size() > UINT32_MAX)
+        return false;
+
+    uint64_t offset = sizeof(FileHeader);
+    for (int i = 0; i < SECTION_COUNT; i++)
+    {
+        fileHeader.sections[i].offset = offset;
+        fileHeader.sections[i].count = writer.count(Section(i));
+        offset += writer.sections[i].size();
+    }
+    fileHeader.strings.offset = offset;
+    fileHeader.strings.count = writer.strings.size();
+
+    // Written next to the destination and moved over it, so a header that is mapped somewhere
+    // else is never seen half written
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return false;
+
+    bool success = fwrite(&fileHeader, sizeof(fileHeader), 1, file) == 1;
+    for (int i = 0; i < SECTION_COUNT && success; i++)
+        success = writer.sections[i].empty() || fwrite(writer.sections[i].data(), writer.sections[i].size(), 1, file) == 1;
+    if (success && !writer.strings.empty())
+        success = fwrite(writer.strings.data(), writer.strings.size(), 1, file) == 1;
+    success = fclose(file) == 0 && success;
+
+#ifdef _WIN32
+    if (success)
+        remove(path.c_str());
+#endif
+    if (!success || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+CPrecompiledHeader::Ptr CPrecompiledHeader::load(const std::string& path, std::string& error)
+{
+    std::shared_ptr<CPrecompiledHeader> pch = std::make_shared<CPrecompiledHeader>();
+    pch->m_source = CSourceBuffer::fromFile(path);
+    if (!pch->m_source)
+    {
+        error = "can't be read";
+        return Ptr();
+    }
+
+    Reader reader;
+    reader.data = pch->m_source->begin();
+    reader.size = pch->m_source->size();
+    if (reader.size < sizeof(FileHeader))
+    {
+        error = "not a precompiled header";
+        return Ptr();
+    }
+    memcpy(&reader.header, reader.data, sizeof(FileHeader));
+    const FileHeader& fileHeader = reader.header;
+    if (memcmp(fileHeader.magic, Magic, sizeof(Magic)) != 0)
+    {
+        error = "not a precompiled header";
+        return Ptr();
+    }
+    if (fileHeader.version != Version || fileHeader.byteOrder != ByteOrderMark)
+    {
+        error = "written by another version or on another platform";
+        return Ptr();
+    }
+
+    bool valid = fileHeader.strings.offset <= reader.size && fileHeader.strings.count <= reader.size - fileHeader.strings.offset;
+    for (int i = 0; i < SECTION_COUNT && valid; i++)
+    {
+        const SectionRef& section = fileHeader.sections[i];
+        valid = section.offset <= reader.size && section.count <= (reader.size - section.offset) / RecordSizes[i];
+    }
+
+    pch->applicationHash = fileHeader.applicationHash;
+    pch->lineCount = fileHeader.lineCount;
+    pch->counter = fileHeader.counter;
+    pch->once = fileHeader.once != 0;
+    valid = valid && reader.string(fileHeader.header, pch->header) && reader.string(fileHeader.guard, pch->guard);
+
+    pch->tokens.resize(valid ? fileHeader.sections[SECTION_OUTPUT].count : 0);
+    for (uint64_t i = 0; i < pch->tokens.size() && valid; i++)
+        valid = reader.token(SECTION_OUTPUT, i, false, pch->tokens[i]);
+
+    pch->files.resize(valid ? fileHeader.sections[SECTION_FILES].count : 0);
+    for (uint64_t i = 0; i < pch->files.size() && valid; i++)
+    {
+        FileRecord record;
+        File& file = pch->files[i];
+        valid = reader.record(SECTION_FILES, i, record) && reader.string(record.path, file.path);
+        file.size = record.size;
+        file.hash = record.hash;
+        file.mtime = 0;
+    }
+
+    pch->defines.resize(valid ? fileHeader.sections[SECTION_DEFINES].count : 0);
+    for (uint64_t i = 0; i < pch->defines.size() && valid; i++)
+    {
+        DefineRecord record;
+        std::string_view name;
+        Define& define = pch->defines[i];
+        valid = reader.record(SECTION_DEFINES, i, record) && reader.string(record.name, name);
+        if (!valid)
+            break;
+        define.id = CSymbolTable::global().intern(name);
+        if (record.undefined)
+            continue;
+
+        define.entry.emplace();
+        valid = reader.tokens(record.firstToken, record.tokenCount, define.entry->tokens);
+        for (uint32_t arg = 0; arg < record.argCount && valid; arg++)
+        {
+            ArgRecord argRecord;
+            std::string argName;
+            valid = reader.record(SECTION_ARGS, uint64_t(record.firstArg) + arg, argRecord) && reader.string(argRecord.name, argName);
+            define.entry->arguments[argName] = argRecord.index;
+        }
+    }
+
+    pch->macros.resize(valid ? fileHeader.sections[SECTION_MACROS].count : 0);
+    for (uint64_t i = 0; i < pch->macros.size() && valid; i++)
+    {
+        MacroRecord record;
+        Macro& macro = pch->macros[i];
+        valid = reader.record(SECTION_MACROS, i, record) && reader.string(record.name, macro.name) &&
+                reader.tokens(record.firstArg, record.argCount, macro.args) &&
+                reader.tokens(record.firstCode, record.codeCount, macro.code);
+        if (valid)
+            macro.id = CSymbolTable::global().intern(macro.name);
+    }
+
+    for (uint64_t i = 0; valid && i < fileHeader.sections[SECTION_LINES].count; i++)
+    {
+        LineRecord record;
+        std::string file;
+        valid = reader.record(SECTION_LINES, i, record) && reader.string(record.file, file);
+        pch->lines.addLineRange(file, record.startLine, record.offset);
+    }
+
+    pch->includes.resize(valid ? fileHeader.sections[SECTION_INCLUDES].count : 0);
+    for (uint64_t i = 0; i < pch->includes.size() && valid; i++)
+    {
+        IncludeRecord record;
+        IncludeState& include = pch->includes[i];
+        valid = reader.record(SECTION_INCLUDES, i, record) && reader.string(record.name, include.name) &&
+                reader.string(record.guard, include.guard);
+        include.once = record.once != 0;
+    }
+
+    pch->consulted.resize(valid ? fileHeader.sections[SECTION_CONSULTED].count : 0);
+    for (uint64_t i = 0; i < pch->consulted.size() && valid; i++)
+    {
+        StringRef ref;
+        std::string_view name;
+        valid = reader.record(SECTION_CONSULTED, i, ref) && reader.string(ref, name);
+        if (valid)
+            pch->consulted[i] = CSymbolTable::global().intern(name);
+    }
+
+    if (!valid)
+    {
+        error = "damaged";
+        return Ptr();
+    }
+
+    for (File& file : pch->files)
+    {
+        uint64_t size;
+        CSourceBuffer::Ptr contents;
+        if (!CIncludeCache::statFile(file.path, size, file.mtime) || size != file.size ||
+            !(contents = CSourceBuffer::fromFile(file.path)) ||
+            CIncludeCache::hashContents(contents->begin(), contents->size()) != file.hash)
+        {
+            error = "out of date, " + file.path + " changed";
+            return Ptr();
+        }
+    }
+
+    return pch;
+}
+
+bool CPrecompiledHeader::upToDate() const
+{
+    for (const File& file : files)
+    {
+        uint64_t size;
+        int64_t mtime;
+        if (!CIncludeCache::statFile(file.path, size, mtime) || size != file.size)
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(m_mtimeMutex);
+            if (mtime == file.mtime)
+                continue;
+        }
+
+        // Touched since it was validated, only a change of contents counts. The new time is kept
+        // so the file isn't hashed again on every run.
+        CSourceBuffer::Ptr contents = CSourceBuffer::fromFile(file.path);
+        if (!contents || CIncludeCache::hashContents(contents->begin(), contents->size()) != file.hash)
+            return false;
+        std::lock_guard<std::mutex> lock(m_mtimeMutex);
+        file.mtime = mtime;
+    }
+    return true;
+}
+
+uint64_t CPrecompiledHeader::hashDefines(const CDefineTable::Snapshot& defines)
+{
+    if (!defines)
+        return 0;
+
+    // Summing the hashes of the entries makes the result independent of the table's layout
+    uint64_t sum = 0;
+    for (size_t i = 0; i < defines->keys.size(); i++)
+    {
+        if (defines->keys[i] == CSymbolTable::None || !defines->values[i])
+            continue;
+
+        const CDefineTable::Entry& entry = *defines->values[i];
+        std::string text(CSymbolTable::global().name(defines->keys[i]));
+        for (const auto& arg : entry.arguments)
+            text.append("\n").append(arg.first).append("=").append(std::to_string(arg.second));
+        text.append("\n");
+        for (const CLexer::Token& token : entry.tokens)
+            text.append(token.value.data(), token.value.size()).append("\x01");
+
+        uint64_t hash = CIncludeCache::hashContents(text.data(), text.size());
+        sum += hash ^ (hash >> 29);
+    }
+    return sum;
+}
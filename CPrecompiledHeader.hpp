@@ -0,0 +1,88 @@
+#ifndef CPRECOMPILEDHEADER_HPP
+#define CPRECOMPILEDHEADER_HPP
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "CDefineTable.hpp"
+#include "CLexer.hpp"
+#include "CLineTranslator.hpp"
+#include "CSourceBuffer.hpp"
+#include "CSymbolTable.hpp"
+
+// Everything a header left behind after being preprocessed on its own: its output tokens, the
+// defines and macros it made, its line ranges and the include state of the files it read. Saved
+// in a versioned binary file that is memory mapped when loaded, token text points straight into
+// the mapping. A loaded header is only good while every file it read still hashes the same.
+class CPrecompiledHeader
+{
+public:
+    static const uint32_t Version = 2;
+    typedef std::shared_ptr<const CPrecompiledHeader> Ptr;
+
+    struct File
+    {
+        std::string path;	//Canonical path
+        uint64_t size;
+        uint64_t hash;	//CIncludeCache::hashContents of the whole file
+        mutable int64_t mtime;	//When it was last validated, not saved. Guarded by m_mtimeMutex
+    };
+
+    struct Define
+    {
+        CSymbolTable::Id id;
+        std::optional<CDefineTable::Entry> entry;	//Empty for an #undef
+    };
+
+    struct Macro
+    {
+        CSymbolTable::Id id;
+        std::string name;
+        CLexer::TokenList args;
+        CLexer::TokenList code;
+    };
+
+    struct IncludeState
+    {
+        std::string name;	//As written in the #include
+        std::string guard;
+        bool once;
+    };
+
+    CPrecompiledHeader();
+
+    std::string header;	//Canonical path of the header
+    std::string guard;	//Include guard of the header itself
+    bool once;	//The header itself contained #pragma once
+    uint64_t applicationHash;	//hashDefines of the application defines it was built with
+    unsigned int lineCount;
+    unsigned int counter;	//__COUNTER__ after the header
+    std::vector<File> files;
+    CLexer::TokenList tokens;
+    std::vector<Define> defines;
+    std::vector<Macro> macros;
+    CLineTranslator::Table lines;
+    std::vector<IncludeState> includes;
+    std::vector<CSymbolTable::Id> consulted;	//Every name the header looked up
+
+    bool save(const std::string& path) const;
+    // Maps and checks the file, then checks the hash of every file the header read. Returns null
+    // with the reason in error if the file is damaged, from another version or out of date.
+    static Ptr load(const std::string& path, std::string& error);
+    // Cheap check for use before every run, only files whose size or time changed since they were
+    // last validated are hashed again. Safe to call from several threads.
+    bool upToDate() const;
+
+    inline const CSourceBuffer::Ptr& source() const { return m_source; }
+
+    // Order independent hash of a define table's contents
+    static uint64_t hashDefines(const CDefineTable::Snapshot& defines);
+private:
+    CSourceBuffer::Ptr m_source;	//The mapped file, token text points into it
+    mutable std::mutex m_mtimeMutex;	//Loaded headers are shared between runs
+};
+
+#endif // CPRECOMPILEDHEADER_HPP
@@ -1,48 +1,118 @@
 #include "CPreprocessor.hpp"
-#include <stdio.h>
-#include <sstream>
-#include <iostream>
 #include <algorithm>
+#include <stdio.h>
 
-static std::string removeQuotes(const std::string& in)
+static std::string_view removeQuotes(std::string_view in)
 {
     return in.substr(1,in.size()-2);
 }
 
-static std::string addPaths(const std::string& first, const std::string& second)
+static std::string_view addPaths(std::string_view first, std::string_view second, std::pmr::memory_resource* memory)
 {
-    std::string result;
     size_t slash_pos = first.find_last_of('/');
     if (slash_pos == 0 || slash_pos >= first.size()) return second;
-    result = first.substr(0,slash_pos+1);
-    result += second;
-    return result;
+    char* result = (char*)memory->allocate(slash_pos + 1 + second.size(), 1);
+    std::copy(first.begin(), first.begin() + slash_pos + 1, result);
+    std::copy(second.begin(), second.end(), result + slash_pos + 1);
+    return std::string_view(result, slash_pos + 1 + second.size());
 }
 
-static void setLineMacro(CPreprocessor::DefineTable& defineTable, unsigned int line)
+// Tokens with text of their own, kept in memory
+static CLexer::Token makeNumber(unsigned int value, std::pmr::memory_resource* memory)
 {
-    CPreprocessor::DefineEntry def;
+    char buffer[16];
+    int length = snprintf(buffer, sizeof(buffer), "%u", value);
     CLexer::Token token;
     token.type = CLexer::NUMBER;
-    std::stringstream sstr;
-    sstr << (line+1);
-    sstr >> token.value;
-    def.tokens.push_back(token);
-    defineTable["__LINE__"] = def;
+    token.numberType = CLexer::NUMBER_INTEGER;
+    token.integer = value;
+    token.assign(std::pmr::string(buffer, length, memory));
+    return token;
 }
 
-static void setFileMacro(CPreprocessor::DefineTable& defineTable, const std::string& file)
+static CLexer::Token makeString(std::string_view text, std::pmr::memory_resource* memory)
 {
-    CPreprocessor::DefineEntry def;
+    std::pmr::string quoted(memory);
+    quoted.reserve(text.size() + 2);
+    quoted += '"';
+    quoted += text;
+    quoted += '"';
     CLexer::Token token;
     token.type = CLexer::STRING;
-    token.value = std::string("\"")+file+"\"";
-    def.tokens.push_back(token);
-    defineTable["__FILE__"] = def;
+    token.assign(std::move(quoted));
+    return token;
+}
+
+enum BuiltinMacro
+{
+    BUILTIN_NONE,
+    BUILTIN_LINE,
+    BUILTIN_FILE,
+    BUILTIN_COUNTER,
+    BUILTIN_INCLUDE_LEVEL
+};
+
+static BuiltinMacro builtinMacro(CSymbolTable::Id id)
+{
+    static const CSymbolTable::Id lineId = CSymbolTable::global().intern("__LINE__");
+    static const CSymbolTable::Id fileId = CSymbolTable::global().intern("__FILE__");
+    static const CSymbolTable::Id counterId = CSymbolTable::global().intern("__COUNTER__");
+    static const CSymbolTable::Id includeLevelId = CSymbolTable::global().intern("__INCLUDE_LEVEL__");
+    if (id == lineId)
+        return BUILTIN_LINE;
+    if (id == fileId)
+        return BUILTIN_FILE;
+    if (id == counterId)
+        return BUILTIN_COUNTER;
+    if (id == includeLevelId)
+        return BUILTIN_INCLUDE_LEVEL;
+    return BUILTIN_NONE;
+}
+
+// First token in [begin, end) that starts at or after pos. The few tokens that don't point into
+// the buffer (line continuations, character escapes) are stepped over, the rest are in order.
+static CLexer::ConstTokenIterator tokenAt(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, const CSourceBuffer& code, const char* pos)
+{
+    auto inBuffer = [&code](const CLexer::Token& token) -> bool
+    {
+        return token.value.data() >= code.begin() && token.value.data() < code.end();
+    };
+
+    size_t low = 0;
+    size_t high = end - begin;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        size_t probe = mid;
+        while (probe < high && !inBuffer(begin[probe]))
+            ++probe;
+
+        if (probe < high && begin[probe].value.data() < pos)
+            low = probe + 1;
+        else
+            high = mid;
+    }
+    return begin + low;
+}
+
+static CSymbolTable::Id internToken(const CLexer::Token& token)
+{
+    return token.symbol != CSymbolTable::None ? token.symbol : CSymbolTable::global().intern(token.value);
 }
 
-CPreprocessor::CPreprocessor()
-    : m_errorCount(0)
+static bool isDefined(const CPreprocessor::DefineTable& defineTable, const CLexer::Token& name)
+{
+    return defineTable.find(name) || builtinMacro(internToken(name)) != BUILTIN_NONE;
+}
+
+CPreprocessor::CPreprocessor(std::pmr::memory_resource* upstream)
+    : m_upstream(upstream),
+      m_arena(upstream),
+      m_sourceMapEnabled(false),
+      m_tracingEnabled(false),
+      m_traceEvents(false),
+      m_diagnosticLimit(0),
+      m_diagnosticsSilent(false)
 {
 }
 
@@ -51,13 +121,17 @@ void CPreprocessor::define(const std::string& def)
     if (def.empty())
         return;
 
-    std::string data = "#define ";
-    data += def + "\n";
+    SourceBuffer data = CSourceBuffer::fromString("#define " + def + "\n");
+    m_applicationSources.push_back(data);
     CLexer::TokenList tokens;
     CLexer lexer;
-    lexer.lex(&data.front(), &data.back(), tokens);
+    lexer.lex(data->begin(), data->contentEnd(), tokens);
 
-    _parseDefine(m_applicationDefined, tokens);
+    // The application defines outlive any run, so this one is made on the heap
+    Context ctx;
+    _startDiagnostics(ctx.diagnostics);
+    _parseDefine(ctx, m_applicationDefined, DirectiveCursor(tokens.begin(), tokens.end()));
+    _finishDiagnostics(ctx.diagnostics);
 }
 
 void CPreprocessor::undefine(const std::string& def)
@@ -86,279 +160,994 @@ void CPreprocessor::registerHook(const std::string& name, std::function<void (CL
     m_registeredHooks[pre] = cb;
 }
 
+void CPreprocessor::registerDirective(const std::string& name, DirectiveHook hook)
+{
+    // Interned as the lexer interns directives
+    m_directiveHooks[CSymbolTable::global().intern("#" + name)] = std::move(hook);
+}
+
+void CPreprocessor::registerPragmaDirective(const std::string& name, DirectiveHook hook)
+{
+    m_pragmaDirectives[CSymbolTable::global().intern(name)] = std::move(hook);
+}
+
 std::string CPreprocessor::finalizedSource()
 {
-    std::string ret;
-    for (const CLexer::Token& token : m_tokens)
-        ret += token.value;
+    CTrace::Scope scope(m_tracingEnabled ? &m_trace : nullptr, CTrace::FINALIZE, "finalizedSource");
+    return m_output;
+}
+
+void CPreprocessor::setTracingEnabled(bool enabled, bool events)
+{
+    m_tracingEnabled = enabled;
+    m_traceEvents = events;
+}
 
-    return ret;
+CTrace* CPreprocessor::_startTrace(CTrace& trace)
+{
+    if (!m_tracingEnabled)
+        return nullptr;
+    trace.reset(m_traceEvents);
+    return &trace;
+}
+
+std::unique_ptr<CArena> CPreprocessor::_acquireArena()
+{
+    std::lock_guard<std::mutex> lock(m_arenaMutex);
+    if (m_arenas.empty())
+    {
+        std::unique_ptr<CArena> arena(new CArena(m_upstream));
+        arena->setRetainLimit(m_arena.retainLimit());
+        return arena;
+    }
+
+    std::unique_ptr<CArena> arena = std::move(m_arenas.back());
+    m_arenas.pop_back();
+    return arena;
+}
+
+void CPreprocessor::_releaseArena(std::unique_ptr<CArena> arena)
+{
+    arena->reset();
+    std::lock_guard<std::mutex> lock(m_arenaMutex);
+    m_arenas.push_back(std::move(arena));
+}
+
+void CPreprocessor::setArenaRetainLimit(size_t bytes)
+{
+    // The last run's memory may still be in use, its arena is trimmed when the next run starts
+    m_arena.setRetainLimit(bytes);
+    std::lock_guard<std::mutex> lock(m_arenaMutex);
+    for (std::unique_ptr<CArena>& arena : m_arenas)
+    {
+        arena->setRetainLimit(bytes);
+        arena->reset();
+    }
+}
+
+std::string_view CPreprocessor::_keep(Context& ctx, std::string_view text)
+{
+    char* copy = (char*)ctx.memory->allocate(text.size(), 1);
+    std::copy(text.begin(), text.end(), copy);
+    return std::string_view(copy, text.size());
+}
+
+CPreprocessor::IncludeState& CPreprocessor::_includeState(Context& ctx, std::string_view name)
+{
+    auto iter = ctx.includeStates.find(name);
+    if (iter == ctx.includeStates.end())
+        iter = ctx.includeStates.emplace(_keep(ctx, name), IncludeState()).first;
+    return iter->second;
 }
 
 bool CPreprocessor::preprocessFile(const std::string& filename)
 {
-    std::string code = _loadSource(filename);
-    if (code == std::string())
+    m_output.clear();
+    CStringSink sink(m_output);
+    return preprocessFile(filename, sink);
+}
+
+bool CPreprocessor::preprocessCode(const std::string& filename, const std::string& code)
+{
+    m_output.clear();
+    CStringSink sink(m_output);
+    return preprocessCode(filename, code, sink);
+}
+
+bool CPreprocessor::preprocessFile(const std::string& filename, COutputSink& sink)
+{
+    m_arena.reset();	//Nothing of the last run is used anymore
+    Context ctx(&m_arena);
+    ctx.recordDependencies = true;
+    ctx.trace = _startTrace(m_trace);
+    _startDiagnostics(ctx.diagnostics);
+    bool success = false;
+    SourceBuffer code = _loadSource(ctx, filename);
+    if (!code)
+        _reportFile(ctx, CDiagnostics::ERROR, CDiagnostics::EMPTY_SOURCE, filename, "Empty source file specified");
+    else
+        success = _preprocess(ctx, filename, code, sink, m_sourceMapEnabled ? &m_sourceMap : nullptr);
+
+    _finishDiagnostics(ctx.diagnostics);
+    m_diagnostics = std::move(ctx.diagnostics);
+    return success;
+}
+
+bool CPreprocessor::preprocessCode(const std::string& filename, const std::string& code, COutputSink& sink)
+{
+    m_arena.reset();
+    Context ctx(&m_arena);
+    ctx.recordDependencies = false;
+    ctx.trace = _startTrace(m_trace);
+    _startDiagnostics(ctx.diagnostics);
+    // code is only read while the run lasts, so it isn't copied
+    bool success = _preprocess(ctx, filename, CSourceBuffer::borrow(code, &m_arena), sink, m_sourceMapEnabled ? &m_sourceMap : nullptr);
+    _finishDiagnostics(ctx.diagnostics);
+    m_diagnostics = std::move(ctx.diagnostics);
+    return success;
+}
+
+void CPreprocessor::enablePrefetch(unsigned int threadCount, bool lexAhead)
+{
+    m_prefetcher.reset();
+    m_prefetcher.reset(new CIncludePrefetcher(m_includeCache, threadCount, lexAhead));
+}
+
+void CPreprocessor::disablePrefetch()
+{
+    m_prefetcher.reset();
+}
+
+CPreprocessor::ResultList CPreprocessor::preprocessFiles(const std::vector<std::string>& filenames, unsigned int threadCount)
+{
+    ResultList results(filenames.size());
+    m_applicationDefined.snapshot();	//Build the shared layer once, before the workers read it
+    std::lock_guard<std::mutex> poolLock(m_poolMutex);
+    if (!m_pool || m_pool->threadCount() != CThreadPool::resolveThreadCount(threadCount))
     {
-        printErrorMessage(std::string("Empty source file specified: ") + filename);
+        m_pool.reset();
+        m_pool.reset(new CThreadPool(threadCount));
+    }
+    m_pool->run(filenames.size(), [this, &filenames, &results](size_t index)
+    {
+        Result& result = results[index];
+        result.filename = filenames[index];
+        result.success = false;
+
+        // Workers take turns with a few arenas, which are reused by the next files
+        std::unique_ptr<CArena> arena = _acquireArena();
+        {
+            Context ctx(arena.get());
+            ctx.recordDependencies = true;
+            ctx.trace = _startTrace(result.trace);
+            _startDiagnostics(ctx.diagnostics);
+            SourceBuffer code = _loadSource(ctx, result.filename);
+            if (!code)
+                _reportFile(ctx, CDiagnostics::ERROR, CDiagnostics::EMPTY_SOURCE, result.filename, "Empty source file specified");
+            else
+            {
+                CStringSink sink(result.source);
+                result.success = _preprocess(ctx, result.filename, code, sink, m_sourceMapEnabled ? &result.sourceMap : nullptr);
+            }
+
+            _finishDiagnostics(ctx.diagnostics);
+            result.errorCount = ctx.diagnostics.errorCount();
+            result.diagnostics = std::move(ctx.diagnostics);
+            result.lineTranslator = std::move(ctx.lineTranslator);
+        }
+        _releaseArena(std::move(arena));
+    });
+
+    return results;
+}
+
+bool CPreprocessor::_preprocess(Context& ctx, const std::string& filename, const SourceBuffer& code, COutputSink& sink, CSourceMap* sourceMap)
+{
+    CTrace::Scope scope(ctx.trace, CTrace::RUN, filename);
+    ctx.tokens.clear();
+    ctx.sink = &sink;
+    ctx.currentLine = 0;
+    ctx.includeLevel = 0;
+    ctx.counter = 0;
+    ctx.locationExpanded = false;
+    ctx.rootFile = filename;
+    ctx.currentInclude = filename;
+    ctx.includeStates.clear();
+    ctx.macros.clear();
+    CDefineTable::Snapshot application = m_applicationDefined.snapshot();
+    ctx.defines.rebase(application);	//The context is new, there's nothing on top yet
+    ctx.lineTranslator.reset();
+    ctx.files.clear();
+    ctx.consulted.assign(ctx.consulted.size(), false);
+    if (ctx.recordDependencies)
+    {
+        ctx.files.push_back(CIncludeCache::canonicalPath(filename));
+        ctx.defines.recordLookups(&ctx.consulted);
+    }
+
+    // Tokens of a precompiled header point into the saved file, not into the sources a map refers to
+    ctx.precompiled.reset();
+    if (m_precompiled && m_precompiled->application == application && !sourceMap)
+        ctx.precompiled = m_precompiled;
+
+    std::unique_ptr<CSourceMapBuilder> sourceMapBuilder;
+    if (sourceMap)
+        sourceMapBuilder.reset(new CSourceMapBuilder(*sourceMap));
+    ctx.sourceMap = sourceMapBuilder.get();
+
+    if (m_prefetcher)
+    {
+        ctx.prefetch = m_prefetcher->beginSession();
+        m_prefetcher->prefetchIncludes(ctx.prefetch, *code);
+    }
+
+    // The root file isn't cached, it's lexed piece by piece as it's preprocessed
+    bool success = preprocessRecursive(ctx, filename, code, nullptr, ctx.defines);
+    ctx.prefetch.reset();
+    ctx.precompiled.reset();
+    ctx.sourceMap = nullptr;
+    ctx.sink = nullptr;
+    ctx.trace = nullptr;
+    if (ctx.recordDependencies)
+        _storeDependencies(ctx, application);
+    return success;
+}
+
+void CPreprocessor::_storeDependencies(Context& ctx, const CDefineTable::Snapshot& application)
+{
+    Dependencies dependencies;
+    dependencies.rootFile = std::string(ctx.rootFile);
+    dependencies.files = ctx.files;
+    std::sort(dependencies.files.begin(), dependencies.files.end());
+    dependencies.files.erase(std::unique(dependencies.files.begin(), dependencies.files.end()), dependencies.files.end());
+
+    for (size_t id = 0; id < ctx.consulted.size(); id++)
+    {
+        if (!ctx.consulted[id])
+            continue;
+        dependencies.defines.push_back(CSymbolTable::Id(id));
+        if (application && application->find(CSymbolTable::Id(id)))
+            dependencies.applicationDefines.push_back(CSymbolTable::Id(id));
+    }
+
+    std::lock_guard<std::mutex> lock(m_dependencyMutex);
+    m_dependencies[std::string(ctx.rootFile)] = std::move(dependencies);
+}
+
+// Both sorted
+template <typename T>
+static bool intersects(const std::vector<T>& a, const std::vector<T>& b)
+{
+    typename std::vector<T>::const_iterator i = a.begin();
+    typename std::vector<T>::const_iterator j = b.begin();
+    while (i != a.end() && j != b.end())
+    {
+        if (*i < *j)
+            ++i;
+        else if (*j < *i)
+            ++j;
+        else
+            return true;
+    }
+    return false;
+}
+
+bool CPreprocessor::dependencies(const std::string& rootFile, Dependencies& out) const
+{
+    std::lock_guard<std::mutex> lock(m_dependencyMutex);
+    auto iter = m_dependencies.find(rootFile);
+    if (iter == m_dependencies.end())
         return false;
+
+    out = iter->second;
+    return true;
+}
+
+void CPreprocessor::clearDependencies()
+{
+    std::lock_guard<std::mutex> lock(m_dependencyMutex);
+    m_dependencies.clear();
+}
+
+std::vector<std::string> CPreprocessor::invalidatedRoots(const std::vector<std::string>& changedFiles, const std::vector<std::string>& changedDefines) const
+{
+    std::vector<std::string> paths;
+    for (const std::string& file : changedFiles)
+        paths.push_back(CIncludeCache::canonicalPath(file));
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<CSymbolTable::Id> defines;
+    for (const std::string& define : changedDefines)
+        defines.push_back(CSymbolTable::global().intern(define));
+    std::sort(defines.begin(), defines.end());
+
+    std::vector<std::string> roots;
+    std::lock_guard<std::mutex> lock(m_dependencyMutex);
+    for (const auto& dependencies : m_dependencies)
+    {
+        if (intersects(dependencies.second.files, paths) || intersects(dependencies.second.defines, defines))
+            roots.push_back(dependencies.first);
     }
+    return roots;
+}
+
+CPreprocessor::ResultList CPreprocessor::reprocess(const std::vector<std::string>& changedFiles, const std::vector<std::string>& changedDefines, unsigned int threadCount)
+{
+    for (const std::string& file : changedFiles)
+        m_includeCache.invalidate(file);
 
-    return preprocessCode(filename, code);;
+    return preprocessFiles(invalidatedRoots(changedFiles, changedDefines), threadCount);
 }
 
-bool CPreprocessor::preprocessCode(const std::string& filename, const std::string& code)
+// Keeps the output tokens of a run. Their text stays valid as long as the run's context does.
+class CTokenCollector : public COutputSink
 {
-    m_currentLine = 0;
-    m_errorCount = 0;
-    m_rootFile = filename;
-    DefineTable defineTable = m_applicationDefined;
-    m_lineTranslator.reset();
-    m_tokens.clear();
+public:
+    explicit CTokenCollector(CLexer::TokenList& tokens)
+        : m_tokens(tokens)
+    {
+    }
+
+    void write(const CLexer::Token* tokens, size_t count) override
+    {
+        m_tokens.insert(m_tokens.end(), tokens, tokens + count);
+    }
 
-    return preprocessRecursive(filename, code, m_tokens, defineTable);;
+    void writeText(std::string_view) override
+    {
+    }
+private:
+    CLexer::TokenList& m_tokens;
+};
+
+bool CPreprocessor::writePrecompiledHeader(const std::string& header, const std::string& path)
+{
+    CArena arena(m_upstream);	//Whatever is saved is copied out before it goes
+    Context ctx(&arena);
+    ctx.recordDependencies = true;
+    _startDiagnostics(ctx.diagnostics);
+    bool success = _writePrecompiledHeader(ctx, header, path);
+    _finishDiagnostics(ctx.diagnostics);
+    return success;
 }
 
-std::string CPreprocessor::_loadSource(const std::string& filename)
+bool CPreprocessor::_writePrecompiledHeader(Context& ctx, const std::string& header, const std::string& path)
 {
-    std::string code;
-    FILE* file = fopen(filename.c_str(), "rb");
-    if (file)
+    SourceBuffer code = _loadSource(ctx, header);
+    if (!code)
+    {
+        _reportFile(ctx, CDiagnostics::ERROR, CDiagnostics::EMPTY_SOURCE, header, "Empty source file specified");
+        return false;
+    }
+
+    CPrecompiledHeader pch;
+    CTokenCollector sink(pch.tokens);
+    if (!_preprocess(ctx, header, code, sink, nullptr))
+        return false;
+    // The header was preprocessed as the root file, but it's used in place of an #include
+    if (ctx.locationExpanded)
+    {
+        _reportFile(ctx, CDiagnostics::ERROR, CDiagnostics::PRECOMPILED_HEADER, header, "Unable to precompile a header expanding __FILE__ or __INCLUDE_LEVEL__");
+        return false;
+    }
+
+    pch.header = CIncludeCache::canonicalPath(header);
+    pch.applicationHash = CPrecompiledHeader::hashDefines(m_applicationDefined.snapshot());
+    pch.lineCount = ctx.currentLine;
+    pch.counter = ctx.counter;
+    pch.lines = ctx.lineTranslator.table();
+
+    std::sort(ctx.files.begin(), ctx.files.end());
+    ctx.files.erase(std::unique(ctx.files.begin(), ctx.files.end()), ctx.files.end());
+    for (const std::string& filename : ctx.files)
+    {
+        CPrecompiledHeader::File file;
+        SourceBuffer contents = CSourceBuffer::fromFile(filename);
+        if (!contents || !CIncludeCache::statFile(filename, file.size, file.mtime))
+            return false;
+        file.path = filename;
+        file.hash = CIncludeCache::hashContents(contents->begin(), contents->size());
+        pch.files.push_back(file);
+    }
+
+    ctx.defines.forEachChange([&pch](CSymbolTable::Id id, const DefineEntry* entry)
     {
-        fseek(file, 0, SEEK_END);
-        size_t length = ftell(file);
-        rewind(file);
-        code.resize(length);
-        fread(&code.front(), 1, length, file);
-        fclose(file);
+        CPrecompiledHeader::Define define;
+        define.id = id;
+        if (entry)
+            define.entry = *entry;
+        pch.defines.push_back(std::move(define));
+    });
+
+    for (const auto& macro : ctx.macros)
+    {
+        CPrecompiledHeader::Macro saved;
+        saved.id = macro.first;
+        saved.name = std::string(std::string_view(macro.second.name));
+        saved.args = macro.second.args;
+        saved.code = macro.second.code;
+        pch.macros.push_back(std::move(saved));
+    }
 
-        if (code != std::string() && code.back() != '\n')
+    CIncludeCache::EntryPtr self = m_includeCache.load(header);
+    if (self)
+        pch.guard = self->includeGuard;
+    for (const auto& state : ctx.includeStates)
+    {
+        if (state.first == header)
         {
-            printWarningMessage(std::string("No new line at end of file: ") + filename);
-            code += '\n';
+            pch.once = state.second.once;
+            continue;
         }
+        CPrecompiledHeader::IncludeState include;
+        include.name = std::string(state.first);
+        include.guard = std::string(state.second.guard);
+        include.once = state.second.once;
+        pch.includes.push_back(include);
+    }
+
+    for (size_t id = 0; id < ctx.consulted.size(); id++)
+    {
+        if (ctx.consulted[id])
+            pch.consulted.push_back(CSymbolTable::Id(id));
+    }
+
+    if (!pch.save(path))
+    {
+        _reportFile(ctx, CDiagnostics::ERROR, CDiagnostics::PRECOMPILED_HEADER, path, "Unable to write precompiled header");
+        return false;
+    }
+    return true;
+}
+
+bool CPreprocessor::usePrecompiledHeader(const std::string& path)
+{
+    std::string error;
+    CPrecompiledHeader::Ptr header = CPrecompiledHeader::load(path, error);
+    if (!header)
+    {
+        CDiagnostics diagnostics;
+        _startDiagnostics(diagnostics);
+        diagnostics.report(CDiagnostics::WARNING, CDiagnostics::PRECOMPILED_HEADER, diagnostics.fileId(path), 0, 0, {"Precompiled header not used, ", error});
+        _finishDiagnostics(diagnostics);
+        return false;
+    }
+
+    std::shared_ptr<Precompiled> precompiled = std::make_shared<Precompiled>();
+    precompiled->header = header;
+    precompiled->application = m_applicationDefined.snapshot();
+    if (header->applicationHash != CPrecompiledHeader::hashDefines(precompiled->application))
+    {
+        CDiagnostics diagnostics;
+        _startDiagnostics(diagnostics);
+        diagnostics.report(CDiagnostics::WARNING, CDiagnostics::PRECOMPILED_HEADER, diagnostics.fileId(path), 0, 0, {"Precompiled header not used, it was built with other application defines"});
+        _finishDiagnostics(diagnostics);
+        return false;
+    }
+
+    // Flattened once here, so each run only has to swap its base
+    DefineTable defines(precompiled->application);
+    for (const CPrecompiledHeader::Define& define : header->defines)
+    {
+        if (define.entry)
+            defines.set(define.id, *define.entry);
+        else
+            defines.erase(define.id);
+    }
+    precompiled->defines = defines.snapshot();
+
+    m_precompiled = precompiled;
+    return true;
+}
+
+void CPreprocessor::clearPrecompiledHeader()
+{
+    m_precompiled.reset();
+}
+
+bool CPreprocessor::_usePrecompiled(Context& ctx, std::string_view includeFilename, DefineTable& defineTable)
+{
+    // The stored results only hold if the header is reached in the state it was built in
+    const CPrecompiledHeader& header = *ctx.precompiled->header;
+    if (ctx.includeLevel != 0 || !ctx.includeStates.empty() || !ctx.macros.empty() || ctx.counter != 0 ||
+        defineTable.hasChanges() || CIncludeCache::canonicalPath(std::string(includeFilename)) != header.header ||
+        !header.upToDate())
+        return false;
+
+    CTrace::Scope scope(ctx.trace, CTrace::INCLUDE, includeFilename);
+    if (ctx.trace)
+        ctx.trace->stats.includesLoaded++;
+
+    defineTable.rebase(ctx.precompiled->defines);
+    for (const CPrecompiledHeader::Macro& saved : header.macros)
+    {
+        Macro macro(ctx.memory);
+        macro.name = saved.name;
+        macro.args = saved.args;
+        macro.code = saved.code;
+        macro.source = header.source();
+        ctx.macros.emplace(saved.id, std::move(macro));
+    }
+
+    for (const CPrecompiledHeader::IncludeState& include : header.includes)
+    {
+        IncludeState& state = _includeState(ctx, include.name);
+        state.guard = _keep(ctx, include.guard);
+        state.once = include.once;
     }
+    IncludeState& self = _includeState(ctx, includeFilename);
+    self.guard = _keep(ctx, header.guard);
+    self.once = header.once;
+
+    // Line ranges were recorded with the header starting on line 0
+    CLineTranslator::Table& table = ctx.lineTranslator.table();
+    std::pmr::vector<unsigned int> files(header.lines.files.size(), ctx.memory);
+    for (size_t i = 0; i < files.size(); i++)
+        files[i] = table.fileId(header.lines.files[i]);
+    for (const CLineTranslator::Table::Entry& line : header.lines.lines)
+        table.addLineRange(files[line.file], line.startLine + ctx.currentLine, line.offset + ctx.currentLine);
+    ctx.currentLine += header.lineCount;
+    ctx.counter = header.counter;
+
+    if (ctx.recordDependencies)
+    {
+        for (const CPrecompiledHeader::File& file : header.files)
+            ctx.files.push_back(file.path);
+        for (CSymbolTable::Id id : header.consulted)
+            defineTable.find(id);	//Marks it consulted
+    }
+
+    ctx.sources.push_back(header.source());
+    _flushOutput(ctx);
+    ctx.sink->beginFile(includeFilename, header.source()->size());
+    if (ctx.trace)
+    {
+        for (const CLexer::Token& token : header.tokens)
+            ctx.trace->stats.bytesCopied += token.value.size();
+    }
+    ctx.sink->write(header.tokens.data(), header.tokens.size());
+    ctx.sink->endFile();
+    return true;
+}
+
+CPreprocessor::SourceBuffer CPreprocessor::_loadSource(Context& ctx, const std::string& filename)
+{
+    CTrace::Scope scope(ctx.trace, CTrace::LOAD, filename);
+    SourceBuffer code = CSourceBuffer::fromFile(filename);
+    if (!code || code->empty())
+        return SourceBuffer();
+
+    _checkTrailingNewline(ctx, filename, *code);
     return code;
 }
 
-void CPreprocessor::advanceList(CLexer::TokenList& tokens)
+CIncludeCache::EntryPtr CPreprocessor::_loadInclude(Context& ctx, const std::string& filename)
 {
-    tokens.pop_front();
-    while(true)
+    CTrace::Scope scope(ctx.trace, CTrace::LOAD, filename);
+    CIncludeCache::EntryPtr entry;
+    if (!ctx.prefetch || !m_prefetcher->wait(ctx.prefetch, filename, entry))
     {
-        if (tokens.front().type != CLexer::WHITESPACE)
-            break;
-        tokens.pop_front();
+        entry = m_includeCache.load(filename);
+        if (entry && ctx.prefetch)
+            m_prefetcher->prefetchIncludes(ctx.prefetch, *entry->source);
     }
+
+    if (!entry || entry->source->empty())
+        return CIncludeCache::EntryPtr();
+
+    _checkTrailingNewline(ctx, filename, *entry->source);
+    return entry;
 }
 
-void CPreprocessor::printErrorMessage(const std::string& errMsg)
+void CPreprocessor::_checkTrailingNewline(Context& ctx, const std::string& filename, const CSourceBuffer& code)
 {
-    std::cout << errMsg << std::endl;
-    m_errorCount++;
+    // The buffer stays read-only, the lexer simply stops before a trailing new line if there is one
+    if (*(code.end() - 1) != '\n')
+        _reportFile(ctx, CDiagnostics::WARNING, CDiagnostics::MISSING_NEWLINE, filename, "No new line at end of file");
 }
 
-void CPreprocessor::printWarningMessage(const std::string& warnMesg)
+void CPreprocessor::advanceList(CLexer::TokenList& tokens)
 {
-    std::cout << warnMesg << std::endl;
+    if (tokens.empty())
+        return;
+    CLexer::TokenIterator iter = tokens.begin() + 1;
+    while (iter != tokens.end() && iter->type == CLexer::WHITESPACE)
+        ++iter;
+    tokens.erase(tokens.begin(), iter);
 }
 
-CLexer::TokenIterator CPreprocessor::_parseIdentifier(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, DefineTable& defineTable)
+void CPreprocessor::_startDiagnostics(CDiagnostics& diagnostics)
 {
-    std::string macroName = begin->value;
-    MacroIterator iter = std::find_if(m_macros.begin(), m_macros.end(), [&macroName](const Macro& m) -> bool { return m.name == macroName; });
-    if (iter != m_macros.end())
+    diagnostics.setLimit(m_diagnosticLimit);
+    diagnostics.setSilent(m_diagnosticsSilent);
+}
+
+void CPreprocessor::_finishDiagnostics(const CDiagnostics& diagnostics)
+{
+    if (diagnostics.silent() || diagnostics.records().empty())
+        return;
+    if (m_diagnosticCallback)
     {
-        _expandMacro(begin, end, tokens, *iter);
-        --begin;
+        m_diagnosticCallback(diagnostics);
+        return;
     }
-    else
-        begin = _expandDefine(begin, end, tokens, defineTable);
 
-    return begin;
+    // A single write, so the batches of concurrent runs don't interleave
+    std::string text = diagnostics.format();
+    fwrite(text.data(), 1, text.size(), stdout);
 }
 
-bool CPreprocessor::preprocessRecursive(const std::string& filename, const std::string& code, CLexer::TokenList& tokens, DefineTable& defineTable)
+void CPreprocessor::_report(Context& ctx, CDiagnostics::Severity severity, CDiagnostics::Code code, const char* at, std::initializer_list<std::string_view> message)
 {
-    unsigned int startLine = m_currentLine;
-    m_currentFile = filename;
-    m_currentFileLines = 0;
-    setFileMacro(defineTable, m_currentFile);
-    setLineMacro(defineTable, m_currentFileLines);
+    if (ctx.currentFile.empty())
+    {
+        ctx.diagnostics.report(severity, code, CDiagnostics::NoFile, 0, 0, message);
+        return;
+    }
 
-    CLexer lexer;
-    lexer.lex((char*)&code.front(), (char*)&code.back(), tokens);
+    unsigned int column = 0;
+    const CSourceBuffer* source = ctx.currentSource;
+    if (at && source && at >= source->begin() && at < source->end())
+    {
+        const char* lineStart = at;
+        while (lineStart > source->begin() && lineStart[-1] != '\n')
+            --lineStart;
+        column = (unsigned int)(at - lineStart) + 1;
+    }
+    ctx.diagnostics.report(severity, code, ctx.diagnostics.fileId(ctx.currentFile), ctx.currentFileLines + 1, column, message);
+}
 
-    CLexer::TokenIterator begin = tokens.begin();
-    CLexer::TokenIterator end   = tokens.end();
+void CPreprocessor::_reportFile(Context& ctx, CDiagnostics::Severity severity, CDiagnostics::Code code, std::string_view filename, std::string_view message)
+{
+    ctx.diagnostics.report(severity, code, ctx.diagnostics.fileId(filename), 0, 0, {message});
+}
 
-    while (begin != end)
+CLexer::ConstTokenIterator CPreprocessor::_parseIdentifier(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& tokens, DefineTable& defineTable)
+{
+    if (!ctx.macros.empty() && begin->symbol != CSymbolTable::None)
     {
-        while (begin->type == CLexer::WHITESPACE)
-            ++begin;
+        MacroIterator iter = ctx.macros.find(begin->symbol);
+        if (iter != ctx.macros.end())
+            return _expandMacro(ctx, begin, end, tokens, iter->second);
+    }
+
+    return _expandDefine(ctx, begin, end, tokens, defineTable);
+}
+
+bool CPreprocessor::preprocessRecursive(Context& ctx, std::string_view filename, const SourceBuffer& code, const CLexer::TokenList* input, DefineTable& defineTable)
+{
+    unsigned int startLine = ctx.currentLine;
+    unsigned int fileId = CLineTranslator::NoFile;	//Looked up on the first include
+    ctx.currentFile = filename;
+    ctx.currentSource = code.get();
+    ctx.currentFileLines = 0;
+
+    _flushOutput(ctx);
+    ctx.sink->beginFile(filename, code->size());
+
+    ctx.sources.push_back(code);
+    if (ctx.sourceMap)
+        ctx.sourceMap->addSource(filename, code);
+    // A lexed file is only read from, it may be shared through the include cache. Without one
+    // the file is lexed a chunk at a time, each chunk ending after a conditional directive, so
+    // blocks that get skipped are never tokenized. Everything that survives preprocessing is
+    // appended to tokens, which is handed to the sink every few thousand tokens.
+    CLexer::TokenList& tokens = ctx.tokens;
+    CLexer lexer;
+    CLexer::TokenList chunk(ctx.memory);
+    const char* next = input ? code->contentEnd() : code->begin();	//Next byte to lex
+    CLexer::ConstTokenIterator begin = input ? input->begin() : chunk.begin();
+    CLexer::ConstTokenIterator end   = input ? input->end() : chunk.end();
+    std::pmr::vector<bool> conditionals(ctx.memory);	//Open #if blocks of this file, true once one of their branches was taken
+
+    while (true)
+    {
+        if (begin == end)
+        {
+            if (next == code->contentEnd())
+                break;
+
+            bool atLineStart = next == code->begin() || next[-1] == '\n';
+            const char* chunkEnd = CLexer::findConditional(next, code->contentEnd(), atLineStart);
+            if (size_t(chunkEnd - next) > MaxChunkBytes)
+                chunkEnd = CLexer::findStatementBreak(next, chunkEnd, next + MaxChunkBytes, atLineStart);
+            chunk.clear();
+            // Storage outgrown in the arena isn't reused, so the chunk gets room for about a token
+            // per two bytes up front instead of doubling its way there. That's the ratio measured
+            // on the benchmark corpus, whitespace between tokens is a token of its own.
+            chunk.reserve((chunkEnd - next) / 2);
+            {
+                CTrace::Scope scope(ctx.trace, CTrace::LEX);
+                lexer.lex(next, chunkEnd, chunk);
+            }
+            if (ctx.trace)
+                ctx.trace->stats.tokensLexed += chunk.size();
+            next = chunkEnd;
+            begin = chunk.begin();
+            end = chunk.end();
+            continue;
+        }
 
-        if (begin->type == CLexer::NEWLINE)
+        if (begin->type == CLexer::WHITESPACE)
         {
-            m_currentLine++;
-            m_currentFileLines++;
+            tokens.push_back(*begin);
             ++begin;
-            setLineMacro(defineTable, m_currentFileLines);
+        }
+        else if (begin->type == CLexer::NEWLINE)
+        {
+            ctx.currentLine++;
+            ctx.currentFileLines++;
+            tokens.push_back(*begin);
+            ++begin;
+            if (tokens.size() >= OutputBatchSize)
+                _flushOutput(ctx);
         }
         else if (begin->type == CLexer::MACRO)
         {
-            CLexer::TokenIterator lineStart = begin;
-            CLexer::TokenIterator lineEnd = _findToken(begin, end, CLexer::NEWLINE);
-            CLexer::TokenList directive(lineStart, lineEnd);
-            begin = tokens.erase(lineStart, lineEnd);
-            advanceList(directive);
-            Macro macro;
-            macro.name = directive.begin()->value;
-            while (directive.begin()->type != CLexer::CLOSE && directive.begin()->value != ")")
+            CTrace::Scope scope(ctx.trace, CTrace::DIRECTIVE);
+            DirectiveCursor directive(begin, _findToken(begin, end, CLexer::NEWLINE));
+            begin = directive.end;
+            directive.advance();
+            if (directive.empty())
+                continue;
+            CSymbolTable::Id macroId = internToken(directive.front());
+            if (ctx.macros.find(macroId) != ctx.macros.end())
+                continue;	//The first definition wins
+
+            Macro macro(ctx.memory);
+            macro.name = directive.front().value;
+            macro.source = code;
+            while (!directive.empty() && directive.front().type != CLexer::CLOSE && directive.front().value != ")")
             {
-                advanceList(directive);
+                directive.advance();
                 if (directive.empty())
                     break;
 
-                if (directive.begin()->type == CLexer::IDENTIFIER || directive.begin()->type == CLexer::PREPROCESSOR)
-                   macro.args.push_back(*directive.begin());
+                if (directive.front().type == CLexer::IDENTIFIER || directive.front().type == CLexer::PREPROCESSOR)
+                   macro.args.push_back(directive.front());
             }
 
-            advanceList(directive);
-            while(directive.begin()->value != "\n")
+            directive.advance();
+            for (CLexer::ConstTokenIterator token = directive.pos; token != directive.end; ++token)
             {
-                if (directive.empty())
+                if (token->value == "\n")
                     break;
-                if(directive.begin()->value != "\\")
-                    macro.code.push_back(*directive.begin());
-
-                directive.pop_front();
+                if (token->value != "\\")
+                    macro.code.push_back(*token);
             }
-            m_macros.push_back(macro);
+            ctx.macros.emplace(macroId, std::move(macro));
         }
         else if (begin->type == CLexer::PREPROCESSOR)
         {
-            CLexer::TokenIterator lineStart = begin;
-            CLexer::TokenIterator lineEnd = _findToken(begin, end, CLexer::NEWLINE);
-
-            CLexer::TokenList directive(lineStart, lineEnd);
-            begin = tokens.erase(lineStart, lineEnd);
+            CTrace::Scope scope(ctx.trace, CTrace::DIRECTIVE);
+            // The line is read where it is, begin moves on to the new line ending it
+            DirectiveCursor directive(begin, _findToken(begin, end, CLexer::NEWLINE));
+            begin = directive.end;
 
-            std::string value = directive.begin()->value;
-            if (value == "#define")
-                _parseDefine(defineTable, directive);
-            else if (value == "#undef")
+            const CLexer::Token& name = directive.front();
+            switch (name.directive)
             {
-                std::string defName;
-                _parseIf(directive, defName);
-                DefineIterator defineIter = defineTable.find(defName);
-                if (defineIter != defineTable.end())
-                    defineTable.erase(defName);
-            }
-            else if (value == "#ifdef")
-            {
-                std::string defName;
-                _parseIf(directive, defName);
-                DefineIterator defineIter = defineTable.find(defName);
-                if (defineIter == defineTable.end())
+            case CLexer::DIRECTIVE_DEFINE:
+                _parseDefine(ctx, defineTable, directive);
+                break;
+            case CLexer::DIRECTIVE_UNDEF:
+                if (const CLexer::Token* undefined = _parseIf(ctx, directive))
                 {
-                    CLexer::TokenIterator spliceTo = _parseIfDef(begin, end);
-                    begin = tokens.erase(begin, spliceTo);
+                    if (undefined->symbol != CSymbolTable::None)
+                        defineTable.erase(undefined->symbol);
+                    else
+                        defineTable.erase(undefined->value);
                 }
-            }
-            else if (value == "#ifndef")
+                break;
+            case CLexer::DIRECTIVE_IF:
+            case CLexer::DIRECTIVE_IFDEF:
+            case CLexer::DIRECTIVE_IFNDEF:
             {
-                std::string defName;
-                _parseIf(directive, defName);
-                DefineIterator defineIter = defineTable.find(defName);
-                if (defineIter != defineTable.end())
+                bool condition;
+                if (name.directive == CLexer::DIRECTIVE_IF)
+                    condition = _evaluateCondition(ctx, directive, defineTable);
+                else
                 {
-                    CLexer::TokenIterator spliceTo = _parseIfDef(begin, end);
-                    begin = tokens.erase(begin, spliceTo);
+                    const CLexer::Token* defName = _parseIf(ctx, directive);
+                    condition = (defName && isDefined(defineTable, *defName)) == (name.directive == CLexer::DIRECTIVE_IFDEF);
                 }
+
+                conditionals.push_back(condition);
+                if (!condition)
+                    begin = _skipConditional(ctx, *code, begin, end, next, input == nullptr, false);
+                break;
             }
-            else if (value == "#include")
+            case CLexer::DIRECTIVE_ELIF:
+            case CLexer::DIRECTIVE_ELSE:
+                if (conditionals.empty())
+                    _report(ctx, CDiagnostics::ERROR, CDiagnostics::UNMATCHED_CONDITIONAL, name.value.data(), {name.value, " without #if"});
+                else if (conditionals.back())
+                    begin = _skipConditional(ctx, *code, begin, end, next, input == nullptr, true);	//A branch was already taken
+                else if (name.directive == CLexer::DIRECTIVE_ELSE || _evaluateCondition(ctx, directive, defineTable))
+                    conditionals.back() = true;
+                else
+                    begin = _skipConditional(ctx, *code, begin, end, next, input == nullptr, false);
+                break;
+            case CLexer::DIRECTIVE_ENDIF:
+                if (conditionals.empty())
+                    _report(ctx, CDiagnostics::ERROR, CDiagnostics::UNMATCHED_CONDITIONAL, name.value.data(), {"#endif without #if"});
+                else
+                    conditionals.pop_back();
+                break;
+            case CLexer::DIRECTIVE_INCLUDE:
             {
-                m_lineTranslator.table().addLineRange(filename, startLine, m_currentLine - m_currentFileLines);
-                std::string includeFilename;
-                _parseIf(directive, includeFilename);
-                includeFilename = removeQuotes(includeFilename);
-                std::string newCode = _loadSource(includeFilename);
-                if (newCode != std::string())
+                const CLexer::Token* includeToken = _parseIf(ctx, directive);
+                if (!includeToken || includeToken->value.size() < 2)
+                    break;
+                std::string_view includeFilename = removeQuotes(includeToken->value);	//Points into the source buffer
+
+                // Files that can't contribute anything a second time aren't even loaded
+                auto state = ctx.includeStates.find(includeFilename);
+                if (state != ctx.includeStates.end())
                 {
-                    unsigned int oldCurrentFileLines = m_currentFileLines;
-                    CLexer::TokenList nextFile;
-                    preprocessRecursive(addPaths(filename, includeFilename), newCode, nextFile, defineTable);
-                    tokens.splice(begin, nextFile);
-                    startLine = m_currentLine;
-                    m_currentFileLines = oldCurrentFileLines;
-                    m_currentFile = filename;
-                    setFileMacro(defineTable, filename);
-                    setLineMacro(defineTable, m_currentFileLines);
+                    if (state->second.once)
+                        break;
+                    if (!state->second.guard.empty() && defineTable.contains(state->second.guard))
+                        break;
+                }
+
+                if (fileId == CLineTranslator::NoFile)
+                    fileId = ctx.lineTranslator.table().fileId(std::string(filename));
+                ctx.lineTranslator.table().addLineRange(fileId, startLine, ctx.currentLine - ctx.currentFileLines);
+                if (ctx.precompiled && _usePrecompiled(ctx, includeFilename, defineTable))
+                {
+                    startLine = ctx.currentLine;
+                    break;
                 }
-                else
-                    printErrorMessage(std::string("Unable to find include file ") + includeFilename);
 
+                CIncludeCache::EntryPtr include = _loadInclude(ctx, std::string(includeFilename));
+                if (ctx.recordDependencies)
+                    ctx.files.push_back(include ? include->path : CIncludeCache::canonicalPath(std::string(includeFilename)));
+                if (include)
+                {
+                    CTrace::Scope includeScope(ctx.trace, CTrace::INCLUDE, includeFilename);
+                    if (ctx.trace)
+                    {
+                        ctx.trace->stats.includesLoaded++;
+                        ctx.trace->stats.tokensLexed += include->tokens.size();
+                    }
+                    _includeState(ctx, includeFilename).guard = _keep(ctx, include->includeGuard);
+                    unsigned int oldCurrentFileLines = ctx.currentFileLines;
+                    std::string_view oldCurrentInclude = ctx.currentInclude;
+                    ctx.currentInclude = includeFilename;
+                    ctx.includeLevel++;
+                    preprocessRecursive(ctx, addPaths(filename, includeFilename, ctx.memory), include->source, &include->tokens, defineTable);
+                    ctx.includeLevel--;
+                    startLine = ctx.currentLine;
+                    ctx.currentFileLines = oldCurrentFileLines;
+                    ctx.currentInclude = oldCurrentInclude;
+                    ctx.currentFile = filename;
+                    ctx.currentSource = code.get();
+                }
+                else
+                    _report(ctx, CDiagnostics::ERROR, CDiagnostics::INCLUDE_NOT_FOUND, includeFilename.data(), {"Unable to find include file ", includeFilename});
+                break;
             }
-            else if (value == "#pragma")
-                _parsePragma(directive);
-            else if (value == "#warning")
-                _parseWarning(directive, defineTable);
-            else if (value == "#error")
-                _parseError(directive, defineTable);
-            else
+            case CLexer::DIRECTIVE_PRAGMA:
+                _parsePragma(ctx, directive, defineTable);
+                break;
+            case CLexer::DIRECTIVE_WARNING:
+                _parseWarning(ctx, directive, defineTable);
+                break;
+            case CLexer::DIRECTIVE_ERROR:
+                _parseError(ctx, directive, defineTable);
+                break;
+            default:
             {
-                HookIterator iter = m_registeredHooks.find(value);
-                if (iter != m_registeredHooks.end() && m_registeredHooks[value])
+                DirectiveHookMap::const_iterator hook = m_directiveHooks.empty() ? m_directiveHooks.end() : m_directiveHooks.find(name.symbol);
+                if (hook != m_directiveHooks.end())
                 {
+                    directive.advance();
+                    _callDirective(ctx, hook->second, hook->first, name.value.data(), directive.first(), directive.last(), defineTable);
+                    break;
+                }
+
+                HookIterator iter = m_registeredHooks.find(name.value);
+                if (iter != m_registeredHooks.end() && iter->second)
+                {
+                    CTrace::Scope hookScope(ctx.trace, CTrace::HOOK, name.value);
                     PreprocessorState state;
-                    state.currentFile = m_currentFile;
-                    state.rootFile = m_rootFile;
-                    state.currentLine = m_currentFileLines;
-                    state.globalLine = m_currentLine;
-                    m_registeredHooks[value](directive, defineTable, state);
+                    state.currentFile = std::string(ctx.currentFile);
+                    state.rootFile = std::string(ctx.rootFile);
+                    state.currentLine = ctx.currentFileLines;
+                    state.globalLine = ctx.currentLine;
+                    // These hooks may change their tokens, so they get a copy of their own
+                    CLexer::TokenList copy(directive.pos, directive.end, ctx.memory);
+                    iter->second(copy, defineTable, state);
                 }
+                break;
+            }
             }
         }
         else if (begin->type == CLexer::IDENTIFIER)
-            begin = _parseIdentifier(begin, end, tokens, defineTable);
+        {
+            CTrace::Scope scope(ctx.trace, CTrace::EXPANSION);
+            size_t first = tokens.size();
+            std::string_view identifier = begin->value;
+            begin = _parseIdentifier(ctx, begin, end, tokens, defineTable);
+            if (ctx.sourceMap)
+                ctx.sourceMap->addExpansion(first, tokens, identifier, identifier.data());
+        }
         else if (begin->degenerate)
         {
             switch(begin->type)
             {
                 case CLexer::COMMENT:
-                {
-                    std::stringstream ss;
-                    ss << m_currentFile << ": Degenerate comment on line " << m_currentFileLines << std::endl;
-                    printErrorMessage(ss.str());
+                    _report(ctx, CDiagnostics::ERROR, CDiagnostics::DEGENERATE_TOKEN, begin->value.data(), {"Degenerate comment"});
                     break;
-                }
                 default:
-                    printErrorMessage(m_currentFile + ": Degenerate token: " + begin->value);
+                    _report(ctx, CDiagnostics::ERROR, CDiagnostics::DEGENERATE_TOKEN, begin->value.data(), {"Degenerate token: ", begin->value});
             }
 
+            tokens.push_back(*begin);
             ++begin;
         }
         else
+        {
+            tokens.push_back(*begin);
             ++begin;
+        }
     }
 
-    return !(m_errorCount > 0);
+    _flushOutput(ctx);
+    ctx.sink->endFile();
+    return ctx.diagnostics.errorCount() == 0;
+}
+
+void CPreprocessor::_flushOutput(Context& ctx)
+{
+    if (ctx.tokens.empty())
+        return;
+
+    if (ctx.sourceMap)
+        ctx.sourceMap->write(ctx.tokens.data(), ctx.tokens.size());
+    if (ctx.trace)
+    {
+        for (const CLexer::Token& token : ctx.tokens)
+            ctx.trace->stats.bytesCopied += token.value.size();
+    }
+    ctx.sink->write(ctx.tokens.data(), ctx.tokens.size());
+    ctx.tokens.clear();
 }
 
-void CPreprocessor::callPragma(const std::string& name, const PragmaInstance& parms)
+void CPreprocessor::callPragma(Context& ctx, std::string_view name, const PragmaInstance& parms)
 {
     PragmaIterator iter = m_registeredPragmas.find(name);
     if (iter == m_registeredPragmas.end())
     {
-        printErrorMessage("Unknown pragma command.");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::UNKNOWN_PRAGMA, name.data(), {"Unknown pragma command: ", name});
         return;
     }
 
     if (iter->second)
+    {
+        CTrace::Scope scope(ctx.trace, CTrace::HOOK, name);
         iter->second(parms);
+    }
+}
+
+void CPreprocessor::_callDirective(Context& ctx, const DirectiveHook& hook, CSymbolTable::Id id, const char* site, const CLexer::Token* begin, const CLexer::Token* end, DefineTable& defineTable)
+{
+    std::string_view name = CSymbolTable::global().name(id);
+    CTrace::Scope scope(ctx.trace, CTrace::HOOK, name);
+    Directive directive(id, begin, end, ctx.tokens);
+    directive.m_location.currentFile = ctx.currentFile;
+    directive.m_location.rootFile = ctx.rootFile;
+    directive.m_location.currentLine = ctx.currentFileLines;
+    directive.m_location.globalLine = ctx.currentLine;
+    size_t first = ctx.tokens.size();
+    if (hook)
+        hook(directive, defineTable);
+    if (ctx.sourceMap)
+        ctx.sourceMap->addExpansion(first, ctx.tokens, name, site);
 }
 
-CLexer::TokenIterator CPreprocessor::_findToken(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenType type)
+CLexer::ConstTokenIterator CPreprocessor::_findToken(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenType type)
 {
     while (begin != end && begin->type != type)
         ++begin;
@@ -366,7 +1155,7 @@ CLexer::TokenIterator CPreprocessor::_findToken(CLexer::TokenIterator begin, CLe
     return begin;
 }
 
-CLexer::TokenIterator CPreprocessor::_parseStatement(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& dest)
+CLexer::ConstTokenIterator CPreprocessor::_parseStatement(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& dest)
 {
     int depth = 0;
     while (begin != end)
@@ -383,7 +1172,7 @@ CLexer::TokenIterator CPreprocessor::_parseStatement(CLexer::TokenIterator begin
         if (begin->type == CLexer::CLOSE)
         {
             if (depth == 0)
-                printErrorMessage("Mismatched braces while parsing statement.");
+                _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_EXPANSION, begin->value.data(), {"Mismatched braces while parsing statement."});
             depth--;
         }
         ++begin;
@@ -392,26 +1181,24 @@ CLexer::TokenIterator CPreprocessor::_parseStatement(CLexer::TokenIterator begin
     return begin;
 }
 
-CLexer::TokenIterator CPreprocessor::_parseDefineArguments(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, std::vector<CLexer::TokenList>& args)
+CLexer::ConstTokenIterator CPreprocessor::_parseDefineArguments(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, std::pmr::vector<CLexer::TokenList>& args)
 {
-    if (begin == end || begin->value == "(")
+    if (begin == end || begin->value != "(")
     {
-        printErrorMessage("Expected argument list.");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_EXPANSION, begin != end ? begin->value.data() : nullptr, {"Expected argument list."});
         return begin;
     }
 
-    CLexer::TokenIterator beginErase = begin;
     ++begin;
 
     while (begin != end)
     {
-        CLexer::TokenList argument;
-        begin = _parseStatement(begin, end, argument);
-        args.push_back(argument);
+        args.emplace_back();	//Takes the resource of args
+        begin = _parseStatement(ctx, begin, end, args.back());
 
         if (begin == end)
         {
-            printErrorMessage("Unexpected end of file");
+            _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_EXPANSION, nullptr, {"Unexpected end of file"});
             return begin;
         }
 
@@ -420,7 +1207,7 @@ CLexer::TokenIterator CPreprocessor::_parseDefineArguments(CLexer::TokenIterator
             ++begin;
             if (begin == end)
             {
-                printErrorMessage("Unexpected end of file.");
+                _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_EXPANSION, nullptr, {"Unexpected end of file."});
                 return begin;
             }
             continue;
@@ -433,64 +1220,87 @@ CLexer::TokenIterator CPreprocessor::_parseDefineArguments(CLexer::TokenIterator
         }
     }
 
-    return tokens.erase(beginErase, begin);
+    return begin;
 }
 
-CLexer::TokenIterator CPreprocessor::_expandDefine(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, CPreprocessor::DefineTable& defineTable)
+CLexer::ConstTokenIterator CPreprocessor::_expandDefine(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& tokens, CPreprocessor::DefineTable& defineTable)
 {
-    DefineIterator defineEntry = defineTable.find(begin->value);
-    if (defineEntry == defineTable.end())
+    const DefineEntry* defineEntry = defineTable.find(*begin);
+    if (!defineEntry)
+    {
+        // Only identifiers can name a built-in, anything else isn't worth interning
+        if (begin->type != CLexer::IDENTIFIER || !_expandBuiltin(ctx, internToken(*begin), tokens))
+            tokens.push_back(*begin);
+        else if (ctx.trace)
+            ctx.trace->stats.expansions++;
         return ++begin;
-    begin = tokens.erase(begin);
+    }
+    ++begin;
+    if (ctx.trace)
+        ctx.trace->stats.expansions++;
 
-    if (defineEntry->second.arguments.size() == 0)
+    if (defineEntry->arguments.size() == 0)
     {
-        tokens.insert(begin, defineEntry->second.tokens.begin(), defineEntry->second.tokens.end());
+        tokens.insert(tokens.end(), defineEntry->tokens.begin(), defineEntry->tokens.end());
         return begin;
     }
 
     // We have arguments
-    std::vector<CLexer::TokenList> arguments;
-    begin = _parseDefineArguments(begin, end, tokens, arguments);
+    std::pmr::vector<CLexer::TokenList> arguments(ctx.memory);
+    begin = _parseDefineArguments(ctx, begin, end, arguments);
 
-    if (defineEntry->second.arguments.size() != arguments.size())
+    if (defineEntry->arguments.size() != arguments.size())
     {
-        printErrorMessage("Didn't supply right number of arguments to define");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_EXPANSION, nullptr, {"Didn't supply right number of arguments to define"});
         return begin;
     }
 
-    CLexer::TokenList tmpList(defineEntry->second.tokens.begin(), defineEntry->second.tokens.end());
-
-    CLexer::TokenIterator tmpIter = tmpList.begin();
-    while (tmpIter != tmpList.end())
+    for (const CLexer::Token& token : defineEntry->tokens)
     {
-        ArgSet::iterator arg = defineEntry->second.arguments.find(tmpIter->value);
-        if (arg == defineEntry->second.arguments.end())
-        {
-            ++tmpIter;
-            continue;
-        }
-
-        tmpIter = tmpList.erase(tmpIter);
-        tmpList.insert(begin, arguments[arg->second].begin(), arguments[arg->second].end());
+        ArgSet::const_iterator arg = defineEntry->arguments.find(token.value);
+        if (arg == defineEntry->arguments.end())
+            tokens.push_back(token);
+        else
+            tokens.insert(tokens.end(), arguments[arg->second].begin(), arguments[arg->second].end());
     }
 
-    tokens.insert(begin, tmpList.begin(), tmpList.end());
-
     return begin;
 }
 
-void CPreprocessor::_expandMacro(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, const CPreprocessor::Macro& macro)
+bool CPreprocessor::_expandBuiltin(Context& ctx, CSymbolTable::Id id, CLexer::TokenList& tokens)
+{
+    // Built-ins are evaluated from the current location when used instead of being kept up to
+    // date in the define table, so they cost nothing unless a script refers to them
+    switch (builtinMacro(id))
+    {
+    case BUILTIN_LINE:
+        tokens.push_back(makeNumber(ctx.currentFileLines + 1, ctx.memory));
+        return true;
+    case BUILTIN_FILE:
+        tokens.push_back(makeString(ctx.currentFile, ctx.memory));
+        ctx.locationExpanded = true;
+        return true;
+    case BUILTIN_COUNTER:
+        tokens.push_back(makeNumber(ctx.counter++, ctx.memory));
+        return true;
+    case BUILTIN_INCLUDE_LEVEL:
+        tokens.push_back(makeNumber(ctx.includeLevel, ctx.memory));
+        ctx.locationExpanded = true;
+        return true;
+    default:
+        return false;
+    }
+}
+
+CLexer::ConstTokenIterator CPreprocessor::_expandMacro(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& tokens, const CPreprocessor::Macro& macro)
 {
-    std::vector<CLexer::Token>  macroArgs = macro.args;
-    std::vector<CLexer::Token>  args;
-    std::vector<CLexer::Token>  code = macro.code;
-    std::vector<CLexer::Token>::iterator codeIter = code.begin();
+    const CLexer::TokenList& macroArgs = macro.args;
+    CLexer::TokenList args(ctx.memory);
 
     int depth = 0;
     while (true)
     {
-        begin = tokens.erase(begin);
+        ++begin;
         if (begin == end)
             break;
         if (begin->type == CLexer::OPEN && begin->value == "(")
@@ -504,7 +1314,7 @@ void CPreprocessor::_expandMacro(CLexer::TokenIterator begin, CLexer::TokenItera
             depth--;
             if (depth == 0)
             {
-                begin = tokens.erase(begin);
+                ++begin;
                 break;
             }
         }
@@ -517,248 +1327,321 @@ void CPreprocessor::_expandMacro(CLexer::TokenIterator begin, CLexer::TokenItera
 
     if (args.empty())
     {
-        printErrorMessage("Expected args");
-        return;
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_EXPANSION, nullptr, {"Expected args"});
+        return begin;
     }
 
     if (args.size() != macroArgs.size())
     {
-        printErrorMessage("Argument count mismatch");
-        return;
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_EXPANSION, nullptr, {"Argument count mismatch"});
+        return begin;
     }
 
-    while (codeIter != code.end())
+    if (ctx.trace)
+        ctx.trace->stats.expansions++;
+
+    for (const CLexer::Token& token : macro.code)
     {
-        std::string value = codeIter->value;
-        bool stringify = (value[0] == '#');
+        std::string_view value = token.value;
+        bool stringify = (!value.empty() && value[0] == '#');
         if (stringify)
-            value.erase(value.begin());
+            value.remove_prefix(1);
 
         auto it = std::find_if(macroArgs.begin(), macroArgs.end(), [&value](const CLexer::Token& t) -> bool { return t.value == value; });
-        if (it != macroArgs.end())
+        if (it == macroArgs.end())
         {
-            int index = it - macroArgs.begin();
-            code.erase(codeIter);
-            code.insert(codeIter, *(args.begin() + index));
-            if (stringify)
-            {
-                codeIter->type = CLexer::STRING;
-                codeIter->value = "\"" + codeIter->value + "\"";
-            }
+            tokens.push_back(token);
+            continue;
         }
-        ++codeIter;
+
+        if (stringify)
+            tokens.push_back(makeString(args[it - macroArgs.begin()].value, ctx.memory));
+        else
+            tokens.push_back(args[it - macroArgs.begin()]);
     }
 
-    CLexer::TokenList newCode;
-    std::copy(code.begin(), code.end(), std::back_inserter(newCode));
-    tokens.splice(begin, newCode);
+    return begin;
 }
 
-void CPreprocessor::_parseDefine(CPreprocessor::DefineTable& defineTable, CLexer::TokenList& tokens)
+void CPreprocessor::_parseDefine(Context& ctx, CPreprocessor::DefineTable& defineTable, DirectiveCursor tokens)
 {
-    advanceList(tokens);
+    tokens.advance();
     if (tokens.empty())
     {
-        printErrorMessage("Define directive without arguments");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DEFINE, nullptr, {"Define directive without arguments"});
         return;
     }
 
-    CLexer::Token name = *tokens.begin();
+    const CLexer::Token& name = tokens.front();
     if (name.type != CLexer::IDENTIFIER)
     {
-        printErrorMessage("Defines's name was not an identifier.");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DEFINE, name.value.data(), {"Defines's name was not an identifier."});
         return;
     }
-    if (defineTable.find(name.value) != defineTable.end())
+    CSymbolTable::Id nameId = internToken(name);
+    if (defineTable.find(nameId) || builtinMacro(nameId) != BUILTIN_NONE)
     {
-        printErrorMessage(name.value + " already defined.");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DEFINE, name.value.data(), {name.value, " already defined."});
         return;
     }
-    advanceList(tokens);
+    tokens.advance();
 
-    DefineEntry def;
+    DefineEntry def(ctx.memory);
 
     if (!tokens.empty())
     {
-        if (tokens.begin()->type == CLexer::PREPROCESSOR || tokens.begin()->type == CLexer::MACRO)
+        if (tokens.front().type == CLexer::PREPROCESSOR || tokens.front().type == CLexer::MACRO)
         {
             // macro has arguments
-            advanceList(tokens);
+            tokens.advance();
 
-            if (tokens.empty() || tokens.begin()->value != "(")
+            if (tokens.empty() || tokens.front().value != "(")
             {
-                printErrorMessage("Expected arguments");
+                _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DEFINE, tokens.empty() ? nullptr : tokens.front().value.data(), {"Expected arguments"});
                 return;
             }
-            advanceList(tokens);
+            tokens.advance();
 
             int argCount = 0;
-            while (!tokens.empty() && tokens.begin()->value != ")")
+            while (!tokens.empty() && tokens.front().value != ")")
             {
-                if (tokens.begin()->type != CLexer::IDENTIFIER)
+                if (tokens.front().type != CLexer::IDENTIFIER)
                 {
-                    printErrorMessage("Expected identifier");
+                    _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DEFINE, tokens.front().value.data(), {"Expected identifier"});
                     return;
                 }
 
-                def.arguments[tokens.begin()->value] = argCount;
-                advanceList(tokens);
-                if (!tokens.empty() && tokens.begin()->value == ",")
-                    advanceList(tokens);
+                def.arguments[std::string(tokens.front().value)] = argCount;
+                tokens.advance();
+                if (!tokens.empty() && tokens.front().value == ",")
+                    tokens.advance();
                 argCount++;
             }
 
             if (!tokens.empty())
             {
-                if (tokens.begin()->value != ")")
+                if (tokens.front().value != ")")
                 {
-                    printErrorMessage("Expected closing parentheses");
+                    _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DEFINE, tokens.front().value.data(), {"Expected closing parentheses"});
                     return;
                 }
-                advanceList(tokens);
+                tokens.advance();
             }
             else
             {
-                printErrorMessage("Unexpected end of file");
+                _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DEFINE, nullptr, {"Unexpected end of file"});
             }
         }
 
-        CLexer::TokenIterator iter = tokens.begin();
-        while (iter != tokens.end())
-            iter = _expandDefine(iter, tokens.end(), tokens, defineTable);
+        CLexer::ConstTokenIterator iter = tokens.pos;
+        while (iter != tokens.end)
+            iter = _expandDefine(ctx, iter, tokens.end, def.tokens, defineTable);
     }
 
-    def.tokens = tokens;
-    defineTable[name.value] = def;
+    defineTable.set(nameId, std::move(def));
 }
 
-CLexer::TokenIterator CPreprocessor::_parseIfDef(CLexer::TokenIterator begin, CLexer::TokenIterator end)
+bool CPreprocessor::_evaluateCondition(Context& ctx, DirectiveCursor directive, DefineTable& defineTable)
 {
-    int depth = 0;
-    bool foundEnd = false;
-    while (begin != end)
+    directive.advance();
+    std::string error;
+    int64_t result = 0;
+    CCondition::Ptr condition = m_conditionCache.get(directive.pos, directive.end, error);
+    if (!condition || !_evaluate(ctx, *condition, defineTable, 0, result, error))
+    {
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_CONDITION, directive.empty() ? nullptr : directive.front().value.data(), {error});
+        return false;
+    }
+    return result != 0;
+}
+
+bool CPreprocessor::_evaluate(Context& ctx, const CCondition& condition, DefineTable& defineTable, unsigned int depth, int64_t& result, std::string& error)
+{
+    auto defined = [&defineTable](CSymbolTable::Id id) -> bool
+    {
+        return defineTable.find(id) || builtinMacro(id) != BUILTIN_NONE;
+    };
+
+    // Names are replaced by their define's body, which is compiled as a condition of its own.
+    // What the callback needs is reached through one pointer, so std::function can keep it
+    // without allocating.
+    struct Frame
     {
-        CLexer::Token token = *begin;
-        if (token.type == CLexer::PREPROCESSOR)
+        CPreprocessor* self;
+        Context& ctx;
+        DefineTable& defineTable;
+        unsigned int depth;
+    } frame = {this, ctx, defineTable, depth};
+    auto value = [&frame](CSymbolTable::Id id, int64_t& out, std::string& err) -> bool
+    {
+        Context& ctx = frame.ctx;
+        DefineTable& defineTable = frame.defineTable;
+        std::string_view name = CSymbolTable::global().name(id);
+        CCondition::Ptr body;
+        if (const DefineEntry* entry = defineTable.find(id))
         {
-            if (token.value == "#endif" && depth == 0)
+            if (!entry->arguments.empty())
             {
-                ++begin;
-                foundEnd = true;
-                break;
+                err = std::string(name) + " takes arguments and can't be used in a condition";
+                return false;
             }
-            if (token.value == "#ifdef" || token.value == "#ifndef")
-                depth++;
-            if (token.value == "#endif" && depth > 0)
-                depth--;
+            if (frame.depth >= MaxConditionDepth)
+            {
+                err = std::string(name) + " nests too deeply to be used in a condition";
+                return false;
+            }
+            body = frame.self->m_conditionCache.get(entry->tokens.begin(), entry->tokens.end(), err);
         }
-        ++begin;
-    }
+        else if (builtinMacro(id) != BUILTIN_NONE)
+        {
+            CLexer::TokenList tokens(ctx.memory);
+            frame.self->_expandBuiltin(ctx, id, tokens);
+            body = CCondition::compile(tokens.begin(), tokens.end(), err);
+        }
+        else
+        {
+            out = 0;
+            return true;
+        }
+        return body && frame.self->_evaluate(ctx, *body, defineTable, frame.depth + 1, out, err);
+    };
+
+    return condition.evaluate(defined, value, result, error);
+}
 
-    if (begin == end && !foundEnd)
+CLexer::ConstTokenIterator CPreprocessor::_skipConditional(Context& ctx, const CSourceBuffer& code, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, const char*& next, bool chunked, bool toEndif)
+{
+    // begin is the new line ending the directive, the raw bytes after it are scanned for the
+    // directive ending the block instead of going through tokens. That directive is processed
+    // as usual once lexing or the cursor resumes at its line.
+    const char* blockStart = (begin != end) ? begin->value.data() + 1 : next;
+    const char* blockEnd = CLexer::skipConditional(blockStart, code.contentEnd(), toEndif);
+    if (!blockEnd)
     {
-        printErrorMessage("Unexpected end of file");
-        return begin;
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::UNMATCHED_CONDITIONAL, nullptr, {"Unexpected end of file"});
+        blockEnd = code.contentEnd();
     }
 
-    return begin;
+    if (chunked)
+    {
+        // Whatever is left of the chunk was skipped
+        next = blockEnd;
+        return end;
+    }
+    return tokenAt(begin, end, code, blockEnd);
 }
 
-void CPreprocessor::_parseIf(CLexer::TokenList& directive, std::string& nameOut)
+const CLexer::Token* CPreprocessor::_parseIf(Context& ctx, DirectiveCursor directive)
 {
-    advanceList(directive);
+    directive.advance();
     if (directive.empty())
     {
-        printErrorMessage("Expected argument.");
-        return;
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DIRECTIVE, nullptr, {"Expected argument."});
+        return nullptr;
     }
 
-    nameOut = directive.begin()->value;
-    advanceList(directive);
+    const CLexer::Token& name = directive.front();
+    directive.advance();
     if (!directive.empty())
-        printErrorMessage((m_lineTranslator.resolveOriginalFile(m_currentLine) + ": Too many arguments."));
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DIRECTIVE, directive.front().value.data(), {"Too many arguments."});
+    return &name;
 }
 
-void CPreprocessor::_parsePragma(CLexer::TokenList& args)
+void CPreprocessor::_parsePragma(Context& ctx, DirectiveCursor args, DefineTable& defineTable)
 {
-    advanceList(args);
+    args.advance();
     if (args.empty())
     {
-        printErrorMessage("Pragmas need arguments.");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DIRECTIVE, nullptr, {"Pragmas need arguments."});
         return;
     }
-    std::string pragmaName = args.begin()->value;
+    std::string_view pragmaName = args.front().value;
 
-    advanceList(args);
+    args.advance();
+    if (pragmaName == "once" && args.empty())
+    {
+        _includeState(ctx, ctx.currentInclude).once = true;
+        return;
+    }
+
+    if (!m_pragmaDirectives.empty())
+    {
+        // Pragma names that are keywords aren't interned by the lexer
+        CSymbolTable::Id id = CSymbolTable::global().find(pragmaName);
+        DirectiveHookMap::const_iterator hook = m_pragmaDirectives.find(id);
+        if (hook != m_pragmaDirectives.end())
+        {
+            _callDirective(ctx, hook->second, id, pragmaName.data(), args.first(), args.last(), defineTable);
+            return;
+        }
+    }
 
     std::string pragmaArgs;
     if (!args.empty())
     {
-        if (args.begin()->type != CLexer::STRING)
-            printErrorMessage("Pragma parameter should be a string literal");
-        pragmaArgs = removeQuotes(args.begin()->value);
-        advanceList(args);
+        if (args.front().type != CLexer::STRING)
+            _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DIRECTIVE, args.front().value.data(), {"Pragma parameter should be a string literal"});
+        pragmaArgs = std::string(removeQuotes(args.front().value));
+        args.advance();
     }
     if (!args.empty())
-        printErrorMessage((m_lineTranslator.resolveOriginalFile(m_currentLine) +  ": Too many paremeters for pragma."));
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DIRECTIVE, args.front().value.data(), {"Too many paremeters for pragma."});
 
     PragmaInstance pi;
-    pi.name = pragmaName;
+    pi.name = std::string(pragmaName);
     pi.text = pragmaArgs;
-    pi.state.currentFile = m_currentFile;
-    pi.state.currentLine = m_currentFileLines;
-    pi.state.rootFile    = m_rootFile;
-    pi.state.globalLine  = m_currentLine;
-    callPragma(pragmaName, pi);
+    pi.state.currentFile = std::string(ctx.currentFile);
+    pi.state.currentLine = ctx.currentFileLines;
+    pi.state.rootFile    = std::string(ctx.rootFile);
+    pi.state.globalLine  = ctx.currentLine;
+    callPragma(ctx, pragmaName, pi);
 }
 
-std::string CPreprocessor::_expandMessage(DefineTable& defineTable, CLexer::TokenList& args)
+std::string CPreprocessor::_expandMessage(Context& ctx, DefineTable& defineTable, DirectiveCursor args)
 {
     std::string msg;
-    while (!args.empty())
+    CLexer::TokenList builtin(ctx.memory);
+    for (CLexer::ConstTokenIterator arg = args.pos; arg != args.end; ++arg)
     {
-        DefineIterator defineEntry = defineTable.find(args.begin()->value);
-        if (defineEntry != defineTable.end())
+        const DefineEntry* defineEntry = defineTable.find(*arg);
+        if (defineEntry)
         {
-            CLexer::TokenList tmpList(defineEntry->second.tokens.begin(), defineEntry->second.tokens.end());
-            CLexer::TokenIterator tmpIter = tmpList.begin();
-
-            while (tmpIter != tmpList.end())
-            {
-                msg += tmpIter->value;
-                tmpIter = tmpList.erase(tmpIter);
-            }
+            for (const CLexer::Token& token : defineEntry->tokens)
+                msg += token.value;
         }
-        else if (args.begin()->type != CLexer::IGNORE)
-            msg += args.begin()->value;
-        args.pop_front();
+        else if (arg->type == CLexer::IDENTIFIER && _expandBuiltin(ctx, internToken(*arg), builtin))
+        {
+            msg += builtin.back().value;
+            builtin.clear();
+        }
+        else if (arg->type != CLexer::IGNORE)
+            msg += arg->value;
     }
 
     return msg;
 }
 
-void CPreprocessor::_parseWarning(CLexer::TokenList& args, DefineTable& defineTable)
+void CPreprocessor::_parseWarning(Context& ctx, DirectiveCursor args, DefineTable& defineTable)
 {
-    advanceList(args);
+    args.advance();
     if (args.empty())
     {
-        printErrorMessage("Warnings need messages.");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DIRECTIVE, nullptr, {"Warnings need messages."});
         return;
     }
 
-    std::string msg = _expandMessage(defineTable, args);
-    printWarningMessage((m_lineTranslator.resolveOriginalFile(m_currentLine) + ": Warning ") + msg);
+    std::string msg = _expandMessage(ctx, defineTable, args);
+    _report(ctx, CDiagnostics::WARNING, CDiagnostics::USER_WARNING, args.front().value.data(), {msg});
 }
 
-void CPreprocessor::_parseError(CLexer::TokenList& args, CPreprocessor::DefineTable& defineTable)
+void CPreprocessor::_parseError(Context& ctx, DirectiveCursor args, CPreprocessor::DefineTable& defineTable)
 {
-    advanceList(args);
+    args.advance();
     if (args.empty())
     {
-        printErrorMessage("Errors need messages.");
+        _report(ctx, CDiagnostics::ERROR, CDiagnostics::BAD_DIRECTIVE, nullptr, {"Errors need messages."});
         return;
     }
-    std::string msg = _expandMessage(defineTable, args);
-    printErrorMessage(msg);
+    std::string msg = _expandMessage(ctx, defineTable, args);
+    _report(ctx, CDiagnostics::ERROR, CDiagnostics::USER_ERROR, args.front().value.data(), {msg});
 }
-
@@ -2,19 +2,46 @@
 #define CPREPROCESSOR_HPP
 
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <functional>
+#include "CArena.hpp"
 #include "CLexer.hpp"
+#include "CCondition.hpp"
+#include "CDefineTable.hpp"
+#include "CDiagnostics.hpp"
+#include "CIncludeCache.hpp"
+#include "CIncludePrefetcher.hpp"
 #include "CLineTranslator.hpp"
+#include "COutputSink.hpp"
+#include "CPrecompiledHeader.hpp"
+#include "CSourceMap.hpp"
+#include "CSourceBuffer.hpp"
+#include "CThreadPool.hpp"
+#include "CTrace.hpp"
 
 class CPreprocessor
 {
 public:
+    typedef CSourceBuffer::Ptr SourceBuffer;
+
     struct Macro
     {
-        std::string name;
-        std::vector<CLexer::Token> args;
-        std::vector<CLexer::Token> code;
+        explicit Macro(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+            : name(resource),
+              args(resource),
+              code(resource)
+        {
+        }
+
+        std::pmr::string name;
+        CLexer::TokenList args;
+        CLexer::TokenList code;
+        SourceBuffer source;	//Keeps the buffer args and code point into alive.
     };
 
     struct PreprocessorState
@@ -32,67 +59,368 @@ public:
         PreprocessorState state;
     };
 
-    CPreprocessor();
-    typedef std::map<std::string, int> ArgSet;
-    struct DefineEntry
+    // PreprocessorState without the copies, the views are only valid during the call
+    struct Location
+    {
+        std::string_view currentFile;
+        std::string_view rootFile;
+        unsigned int currentLine;	//In currentFile, from 0
+        unsigned int globalLine;
+    };
+
+    // What hooks registered with registerDirective and registerPragmaDirective are given: a view
+    // of the arguments among the run's own tokens, with NUMBER tokens already decoded, and where
+    // they are. Tokens emitted go straight to the output in place of the directive, they have to
+    // own their text or point into the run's sources.
+    class Directive
     {
-        CLexer::TokenList tokens;
-        ArgSet arguments;
+    public:
+        // Interned name of the directive with its #, or of the pragma
+        inline CSymbolTable::Id id() const { return m_id; }
+        inline const Location& location() const { return m_location; }
+
+        // Every argument token, whitespace included
+        inline const CLexer::Token* begin() const { return m_begin; }
+        inline const CLexer::Token* end() const { return m_end; }
+        // Arguments without the whitespace around them, first and then next until end comes up
+        inline const CLexer::Token* first() const { return _skipWhitespace(m_begin); }
+        inline const CLexer::Token* next(const CLexer::Token* token) const { return _skipWhitespace(token + 1); }
+
+        inline void emit(const CLexer::Token& token) { m_output->push_back(token); }
+        inline void emit(const CLexer::Token* tokens, size_t count) { m_output->insert(m_output->end(), tokens, tokens + count); }
+    private:
+        friend class CPreprocessor;
+        Directive(CSymbolTable::Id id, const CLexer::Token* begin, const CLexer::Token* end, CLexer::TokenList& output)
+            : m_id(id),
+              m_begin(begin),
+              m_end(end),
+              m_output(&output)
+        {
+        }
+
+        const CLexer::Token* _skipWhitespace(const CLexer::Token* token) const
+        {
+            while (token != m_end && token->type == CLexer::WHITESPACE)
+                ++token;
+            return token;
+        }
+
+        CSymbolTable::Id m_id;
+        const CLexer::Token* m_begin;
+        const CLexer::Token* m_end;
+        CLexer::TokenList* m_output;
+        Location m_location;
     };
 
-    typedef std::map<std::string, DefineEntry> DefineTable;
-    typedef DefineTable::iterator DefineIterator;
-    typedef std::map<std::string, std::function<void(PragmaInstance)> > PragmaMap;
+    // Memory that only lives as long as a run comes out of arenas, which take their blocks from
+    // upstream. The arena of preprocessFile and preprocessCode is reset when the next of them
+    // starts, so once it has grown to fit, a run doesn't go to upstream at all.
+    explicit CPreprocessor(std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+    typedef CDefineTable::ArgSet ArgSet;
+    typedef CDefineTable::Entry DefineEntry;
+    typedef CDefineTable DefineTable;
+    typedef std::map<std::string, std::function<void(PragmaInstance)>, std::less<> > PragmaMap;
     typedef PragmaMap::iterator PragmaIterator;
-    typedef std::map<std::string, std::function<void(CLexer::TokenList&, DefineTable&, PreprocessorState)> > HookMap;
+    typedef std::map<std::string, std::function<void(CLexer::TokenList&, DefineTable&, PreprocessorState)>, std::less<> > HookMap;
     typedef HookMap::iterator HookIterator;
-    typedef std::vector<Macro> MacroList;
-    typedef MacroList::iterator MacroIterator;
+    typedef std::function<void(Directive&, DefineTable&)> DirectiveHook;
+    typedef std::unordered_map<CSymbolTable::Id, DirectiveHook> DirectiveHookMap;	//By interned name
+    typedef std::pmr::unordered_map<CSymbolTable::Id, Macro> MacroTable;
+    typedef MacroTable::iterator MacroIterator;
 
     void define(const std::string& def);
     void undefine(const std::string& def);
     void registerPragma(const std::string& name, std::function<void(PragmaInstance)>  cb);
+    // The tokens and define table a hook is given belong to the run, they can't be kept beyond it
     void registerHook(const std::string& name, std::function<void(CLexer::TokenList&, DefineTable&, PreprocessorState)> cb);
+    // The same without copying anything per call. These come before hooks and pragmas of the
+    // same name registered the other way.
+    void registerDirective(const std::string& name, DirectiveHook hook);
+    void registerPragmaDirective(const std::string& name, DirectiveHook hook);
 
     std::string finalizedSource();
     bool preprocessFile(const std::string& filename);
     bool preprocessCode(const std::string& filename, const std::string& code);
+    // Stream the output into sink as it's produced, finalizedSource isn't touched
+    bool preprocessFile(const std::string& filename, COutputSink& sink);
+    bool preprocessCode(const std::string& filename, const std::string& code, COutputSink& sink);
+
+    // Also map every output line and column back to where it came from, at some cost. Precompiled
+    // headers aren't used while this is on.
+    inline void setSourceMapEnabled(bool enabled) { m_sourceMapEnabled = enabled; }
+    inline bool sourceMapEnabled() const { return m_sourceMapEnabled; }
+    // Source map of the last preprocessFile or preprocessCode made with source maps enabled
+    inline const CSourceMap& sourceMap() const { return m_sourceMap; }
+
+    // Times the phases of every run and counts what they did, at a small cost. With events the
+    // runs also keep their loads, includes and hooks as spans for CTrace::chromeTrace.
+    void setTracingEnabled(bool enabled, bool events = false);
+    inline bool tracingEnabled() const { return m_tracingEnabled; }
+    // Trace of the last preprocessFile or preprocessCode made with tracing enabled, and of the
+    // finalizedSource calls after it
+    inline const CTrace& trace() const { return m_trace; }
+
+    // Memory a run's arena keeps for the runs after it at most, see CArena. The arenas of
+    // preprocessFiles workers are limited the same way.
+    void setArenaRetainLimit(size_t bytes);
+    inline size_t arenaRetainLimit() const { return m_arena.retainLimit(); }
+
+    // Diagnostics are kept for each run and handed to the callback in one batch when it ends, by
+    // the thread that ran it, so preprocessFiles may call it concurrently. Runs without any
+    // aren't passed on. Without a callback each batch is written to stdout at once.
+    typedef std::function<void(const CDiagnostics&)> DiagnosticCallback;
+    inline void setDiagnosticCallback(DiagnosticCallback callback) { m_diagnosticCallback = std::move(callback); }
+    // Diagnostics kept per run, the rest are only counted. 0 keeps all of them.
+    inline void setDiagnosticLimit(size_t limit) { m_diagnosticLimit = limit; }
+    // Only count diagnostics, nothing is kept or passed on
+    inline void setDiagnosticsSilent(bool silent) { m_diagnosticsSilent = silent; }
+    // Diagnostics of the last preprocessFile or preprocessCode
+    inline const CDiagnostics& diagnostics() const { return m_diagnostics; }
 
     static void advanceList(CLexer::TokenList& tokens);
+
+    struct Result
+    {
+        std::string filename;
+        bool success;
+        unsigned int errorCount;
+        CDiagnostics diagnostics;
+        std::string source;	//Finalized source
+        CLineTranslator lineTranslator;
+        CSourceMap sourceMap;	//Empty unless source maps are enabled
+        CTrace trace;	//Empty unless tracing is enabled
+    };
+    typedef std::vector<Result> ResultList;
+
+    // Preprocesses every root file on a work-stealing pool of threadCount workers (0 picks the
+    // hardware concurrency). Application defines, hooks and pragmas are shared between workers
+    // and must not be changed while this runs; registered callbacks may be called concurrently.
+    // The worker threads are kept for later calls asking for the same number of them.
+    ResultList preprocessFiles(const std::vector<std::string>& filenames, unsigned int threadCount = 0);
+
+    // What the last run of a root file depended on. Only runs of files are recorded, code passed
+    // to preprocessCode can't be loaded again.
+    struct Dependencies
+    {
+        std::string rootFile;
+        std::vector<std::string> files;	//Canonical paths of the root file and every file it included, sorted
+        std::vector<CSymbolTable::Id> defines;	//Every name looked up in the define table, sorted
+        std::vector<CSymbolTable::Id> applicationDefines;	//The defines among them that came from define()
+    };
+
+    bool dependencies(const std::string& rootFile, Dependencies& out) const;
+    void clearDependencies();
+    // Root files whose output may change because of the changed files or define names
+    std::vector<std::string> invalidatedRoots(const std::vector<std::string>& changedFiles, const std::vector<std::string>& changedDefines) const;
+    // Preprocesses the invalidated roots again, after dropping the changed files from the include
+    // cache. Call define/undefine for changed defines before this.
+    ResultList reprocess(const std::vector<std::string>& changedFiles, const std::vector<std::string>& changedDefines, unsigned int threadCount = 0);
+
+    // Loaded and lexed includes, shared by every run of this preprocessor
+    inline CIncludeCache& includeCache() { return m_includeCache; }
+    // Compiled #if and #elif expressions, shared by every run of this preprocessor
+    inline CConditionCache& conditionCache() { return m_conditionCache; }
+
+    // Reads includes on threadCount background threads ahead of the main pass. With lexAhead they
+    // are lexed into the include cache as well, otherwise they're only read into the OS file cache.
+    void enablePrefetch(unsigned int threadCount = 2, bool lexAhead = true);
+    void disablePrefetch();
+
+    // Preprocesses header on its own and saves its output, defines and macros to path. Fails
+    // without writing anything if the header has errors, or if it expands __FILE__ or
+    // __INCLUDE_LEVEL__, which depend on where it's included from.
+    bool writePrecompiledHeader(const std::string& header, const std::string& path);
+    // Loads a header saved by writePrecompiledHeader. Runs whose first include is that header,
+    // with nothing defined or counted before it, take its results from the file instead of
+    // preprocessing it. Only used while the application defines are the ones it was loaded
+    // with, so call this after define and undefine. Returns false if the file is damaged, out
+    // of date or was built with other application defines.
+    bool usePrecompiledHeader(const std::string& path);
+    void clearPrecompiledHeader();
 private:
-    std::string _loadSource(const std::string& filename);
-    void printErrorMessage(const std::string& errMsg);
-    void printWarningMessage(const std::string& warnMesg);
-
-    bool preprocessRecursive(const std::string& filename, const std::string& code, CLexer::TokenList& tokens, DefineTable& defineTable);
-
-    void callPragma(const std::string& name, const PragmaInstance& parms);
-    CLexer::TokenIterator _findToken(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenType type);
-    CLexer::TokenIterator _parseStatement(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& dest);
-    CLexer::TokenIterator _parseDefineArguments(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, std::vector<CLexer::TokenList>& args);
-    CLexer::TokenIterator _expandDefine(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, DefineTable& defineTable);
-    void _expandMacro(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, const Macro& macro);
-    void _parseDefine(DefineTable& defineTable, CLexer::TokenList& tokens);
-    CLexer::TokenIterator _parseIfDef(CLexer::TokenIterator begin, CLexer::TokenIterator end);
-    void _parseIf(CLexer::TokenList& directive, std::string& nameOut);
-    void _parsePragma(CLexer::TokenList& args);
-    std::string _expandMessage(DefineTable& defineTable, CLexer::TokenList& args);
-    void _parseWarning(CLexer::TokenList& args, DefineTable& defineTable);
-    void _parseError(CLexer::TokenList& args, DefineTable& defineTable);
-    CLexer::TokenIterator _parseIdentifier(CLexer::TokenIterator begin, CLexer::TokenIterator end, CLexer::TokenList& tokens, DefineTable& defineTable);
+    // Output is handed to the sink once this many tokens are waiting, at the end of a line
+    static const size_t OutputBatchSize = 4096;
+
+    // Root files are lexed in chunks of about this many bytes at most, where a statement ends.
+    // The chunk's tokens take some 24 times the bytes they were lexed from and their storage is
+    // reused for the next chunk, so this bounds what a root file of any size costs to lex.
+    static const size_t MaxChunkBytes = 64 * 1024;
+
+    // Defines referring to defines in a condition are only followed this deep
+    static const unsigned int MaxConditionDepth = 64;
+
+    // What is known about each file included during a run, keyed by the include name
+    struct IncludeState
+    {
+        IncludeState() : once(false) {}
+
+        std::string_view guard;	//Detected include guard macro, kept in the run's memory
+        bool once;		//File contained #pragma once
+    };
+
+    // Reads a directive line where it is instead of a copy. Like advanceList, advance steps over
+    // the current token and the whitespace after it.
+    struct DirectiveCursor
+    {
+        DirectiveCursor(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end)
+            : pos(begin),
+              end(end)
+        {
+        }
+
+        inline bool empty() const { return pos == end; }
+        inline const CLexer::Token& front() const { return *pos; }
+        void advance()
+        {
+            if (pos == end)
+                return;
+            ++pos;
+            while (pos != end && pos->type == CLexer::WHITESPACE)
+                ++pos;
+        }
+
+        // What is left of the line, as a Directive takes it
+        inline const CLexer::Token* first() const { return empty() ? nullptr : &*pos; }
+        inline const CLexer::Token* last() const { return first() + (end - pos); }
+
+        CLexer::ConstTokenIterator pos;
+        CLexer::ConstTokenIterator end;
+    };
+
+    // A loaded precompiled header with the application defines it's valid for
+    struct Precompiled
+    {
+        CPrecompiledHeader::Ptr header;
+        CDefineTable::Snapshot application;
+        CDefineTable::Snapshot defines;	//The application defines with the header's on top
+    };
+
+    // Everything that belongs to a single run, so several runs can share one preprocessor. What
+    // the run keeps around is allocated from memory, an arena that has to outlive the context.
+    // Include names and guards are copied into it and never handed back on their own.
+    struct Context
+    {
+        explicit Context(std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+            : memory(memory),
+              tokens(memory),
+              sink(nullptr),
+              sources(memory),
+              defines(CDefineTable::Snapshot(), memory),
+              macros(memory),
+              includeStates(memory),
+              sourceMap(nullptr),
+              trace(nullptr),
+              recordDependencies(false),
+              consulted(memory),
+              currentLine(0),
+              currentFileLines(0),
+              includeLevel(0),
+              counter(0),
+              locationExpanded(false),
+              currentSource(nullptr)
+        {
+        }
+
+        std::pmr::memory_resource* memory;
+        CLexer::TokenList tokens;	//Output not handed to the sink yet
+        COutputSink* sink;
+        std::pmr::vector<SourceBuffer> sources;	//Buffers tokens point into
+        CLineTranslator lineTranslator;
+        DefineTable defines;
+        MacroTable macros;	//Function-like macros defined during the run
+        std::pmr::unordered_map<std::string_view, IncludeState> includeStates;	//Names are kept in memory
+        CIncludePrefetcher::SessionPtr prefetch;
+        std::shared_ptr<const Precompiled> precompiled;	//Null unless it can be used by this run
+        CSourceMapBuilder* sourceMap;	//Null unless a map is wanted
+        CTrace* trace;	//Null unless tracing is enabled
+        bool recordDependencies;
+        std::vector<std::string> files;	//Canonical paths of every file read
+        std::pmr::vector<bool> consulted;	//Indexed by symbol id
+
+        // Point into the run's memory, its source buffers or the arguments it was started with
+        std::string_view rootFile;
+        std::string_view currentFile;
+        std::string_view currentInclude;
+        unsigned int currentLine;
+        unsigned int currentFileLines;
+        unsigned int includeLevel;	//0 in the root file
+        unsigned int counter;	//Next value of __COUNTER__
+        bool locationExpanded;	//__FILE__ or __INCLUDE_LEVEL__ was expanded
+        const CSourceBuffer* currentSource;	//Of currentFile
+        CDiagnostics diagnostics;
+    };
+
+    CTrace* _startTrace(CTrace& trace);
+    std::unique_ptr<CArena> _acquireArena();
+    void _releaseArena(std::unique_ptr<CArena> arena);
+    std::string_view _keep(Context& ctx, std::string_view text);
+    IncludeState& _includeState(Context& ctx, std::string_view name);
+    SourceBuffer _loadSource(Context& ctx, const std::string& filename);
+    CIncludeCache::EntryPtr _loadInclude(Context& ctx, const std::string& filename);
+    bool _writePrecompiledHeader(Context& ctx, const std::string& header, const std::string& path);
+    void _checkTrailingNewline(Context& ctx, const std::string& filename, const CSourceBuffer& code);
+    void _startDiagnostics(CDiagnostics& diagnostics);
+    void _finishDiagnostics(const CDiagnostics& diagnostics);
+    // Reports at the current line, and at the column of at if it points into the current file
+    void _report(Context& ctx, CDiagnostics::Severity severity, CDiagnostics::Code code, const char* at, std::initializer_list<std::string_view> message);
+    void _reportFile(Context& ctx, CDiagnostics::Severity severity, CDiagnostics::Code code, std::string_view filename, std::string_view message);
+
+    bool _preprocess(Context& ctx, const std::string& filename, const SourceBuffer& code, COutputSink& sink, CSourceMap* sourceMap);
+    bool preprocessRecursive(Context& ctx, std::string_view filename, const SourceBuffer& code, const CLexer::TokenList* input, DefineTable& defineTable);
+    void _flushOutput(Context& ctx);
+    bool _usePrecompiled(Context& ctx, std::string_view includeFilename, DefineTable& defineTable);
+    void _storeDependencies(Context& ctx, const CDefineTable::Snapshot& application);
+
+    void callPragma(Context& ctx, std::string_view name, const PragmaInstance& parms);
+    CLexer::ConstTokenIterator _findToken(CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenType type);
+    CLexer::ConstTokenIterator _parseStatement(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& dest);
+    CLexer::ConstTokenIterator _parseDefineArguments(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, std::pmr::vector<CLexer::TokenList>& args);
+    CLexer::ConstTokenIterator _expandDefine(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& tokens, DefineTable& defineTable);
+    bool _expandBuiltin(Context& ctx, CSymbolTable::Id id, CLexer::TokenList& tokens);
+    CLexer::ConstTokenIterator _expandMacro(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& tokens, const Macro& macro);
+    void _parseDefine(Context& ctx, DefineTable& defineTable, DirectiveCursor tokens);
+    CLexer::ConstTokenIterator _skipConditional(Context& ctx, const CSourceBuffer& code, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, const char*& next, bool chunked, bool toEndif);
+    bool _evaluateCondition(Context& ctx, DirectiveCursor directive, DefineTable& defineTable);
+    bool _evaluate(Context& ctx, const CCondition& condition, DefineTable& defineTable, unsigned int depth, int64_t& result, std::string& error);
+    // The single argument of the directive, nullptr if it has none
+    const CLexer::Token* _parseIf(Context& ctx, DirectiveCursor directive);
+    void _parsePragma(Context& ctx, DirectiveCursor args, DefineTable& defineTable);
+    void _callDirective(Context& ctx, const DirectiveHook& hook, CSymbolTable::Id id, const char* site, const CLexer::Token* begin, const CLexer::Token* end, DefineTable& defineTable);
+    std::string _expandMessage(Context& ctx, DefineTable& defineTable, DirectiveCursor args);
+    void _parseWarning(Context& ctx, DirectiveCursor args, DefineTable& defineTable);
+    void _parseError(Context& ctx, DirectiveCursor args, DefineTable& defineTable);
+    CLexer::ConstTokenIterator _parseIdentifier(Context& ctx, CLexer::ConstTokenIterator begin, CLexer::ConstTokenIterator end, CLexer::TokenList& tokens, DefineTable& defineTable);
 
     DefineTable      m_applicationDefined;
     PragmaMap        m_registeredPragmas;
     HookMap          m_registeredHooks;
-    CLineTranslator  m_lineTranslator;
-    CLexer::TokenList m_tokens;
-
-    std::string  m_rootFile;
-    std::string  m_currentFile;
-    unsigned int m_currentLine;
-    unsigned int m_currentFileLines;
-    unsigned int m_errorCount;
-    MacroList    m_macros;
+    DirectiveHookMap m_directiveHooks;
+    DirectiveHookMap m_pragmaDirectives;
+    CIncludeCache    m_includeCache;
+    CConditionCache  m_conditionCache;	//Compiled #if and #elif expressions
+    std::unique_ptr<CIncludePrefetcher> m_prefetcher;
+    std::mutex       m_poolMutex;	//Held while preprocessFiles uses the pool
+    std::unique_ptr<CThreadPool> m_pool;	//Kept between preprocessFiles calls asking for as many threads
+    std::shared_ptr<const Precompiled> m_precompiled;
+    std::vector<SourceBuffer> m_applicationSources;  // Buffers m_applicationDefined points into
+
+    mutable std::mutex m_dependencyMutex;
+    std::map<std::string, Dependencies> m_dependencies;	//By root file
+
+    std::pmr::memory_resource* m_upstream;	//Of every arena
+    CArena           m_arena;	//Used by preprocessFile and preprocessCode
+    std::mutex       m_arenaMutex;
+    std::vector<std::unique_ptr<CArena> > m_arenas;	//Spare arenas for preprocessFiles
+    std::string      m_output;	//Returned by finalizedSource
+    bool             m_sourceMapEnabled;
+    CSourceMap       m_sourceMap;	//Returned by sourceMap
+    bool             m_tracingEnabled;
+    bool             m_traceEvents;
+    CTrace           m_trace;	//Returned by trace
+    DiagnosticCallback m_diagnosticCallback;
+    size_t           m_diagnosticLimit;
+    bool             m_diagnosticsSilent;
+    CDiagnostics     m_diagnostics;	//Returned by diagnostics
 };
 
 #endif // CPREPROCESSOR_HPP
@@ -0,0 +1,96 @@
+#include "CSourceBuffer.hpp"
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CSourceBuffer::CSourceBuffer()
+    : m_data(nullptr),
+      m_size(0),
+      m_mapped(false)
+{
+}
+
+CSourceBuffer::~CSourceBuffer()
+{
+#ifndef _WIN32
+    if (m_mapped)
+        munmap((void*)m_data, m_size);
+#endif
+}
+
+CSourceBuffer::Ptr CSourceBuffer::fromFile(const std::string& filename)
+{
+    std::shared_ptr<CSourceBuffer> buffer(new CSourceBuffer);
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return Ptr();
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            buffer->m_data = (const char*)data;
+            buffer->m_size = st.st_size;
+            buffer->m_mapped = true;
+        }
+    }
+    close(fd);
+
+    if (buffer->m_mapped)
+        return buffer;
+#endif
+
+    // Not mappable, fall back to reading it
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return Ptr();
+
+    fseek(file, 0, SEEK_END);
+    size_t length = ftell(file);
+    rewind(file);
+    buffer->m_owned.resize(length);
+    if (length)
+        buffer->m_owned.resize(fread(&buffer->m_owned.front(), 1, length, file));
+    fclose(file);
+
+    buffer->m_data = buffer->m_owned.data();
+    buffer->m_size = buffer->m_owned.size();
+    return buffer;
+}
+
+CSourceBuffer::Ptr CSourceBuffer::fromString(std::string code)
+{
+    std::shared_ptr<CSourceBuffer> buffer(new CSourceBuffer);
+    buffer->m_owned = std::move(code);
+    buffer->m_data = buffer->m_owned.data();
+    buffer->m_size = buffer->m_owned.size();
+    return buffer;
+}
+
+CSourceBuffer::Ptr CSourceBuffer::borrow(std::string_view code, std::pmr::memory_resource* resource)
+{
+    std::pmr::polymorphic_allocator<CSourceBuffer> allocator(resource);
+    CSourceBuffer* buffer = new (allocator.allocate(1)) CSourceBuffer;
+    buffer->m_data = code.data();
+    buffer->m_size = code.size();
+    return Ptr(buffer, [resource](const CSourceBuffer* buffer)
+    {
+        buffer->~CSourceBuffer();
+        std::pmr::polymorphic_allocator<CSourceBuffer>(resource).deallocate(const_cast<CSourceBuffer*>(buffer), 1);
+    }, allocator);
+}
+
+const char* CSourceBuffer::contentEnd() const
+{
+    if (m_size != 0 && m_data[m_size - 1] == '\n')
+        return end() - 1;
+    return end();
+}
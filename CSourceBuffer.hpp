@@ -0,0 +1,43 @@
+#ifndef CSOURCEBUFFER_HPP
+#define CSOURCEBUFFER_HPP
+
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+
+// Immutable script source. Files are memory mapped read-only where the platform allows it,
+// so a buffer can be shared between any number of preprocessing runs without copying.
+class CSourceBuffer
+{
+public:
+    typedef std::shared_ptr<const CSourceBuffer> Ptr;
+
+    static Ptr fromFile(const std::string& filename);
+    static Ptr fromString(std::string code);
+    // Refers to code without copying it, so code has to outlive every use of the buffer. The
+    // little bookkeeping the buffer needs comes out of resource.
+    static Ptr borrow(std::string_view code, std::pmr::memory_resource* resource);
+
+    ~CSourceBuffer();
+    CSourceBuffer(const CSourceBuffer&) = delete;
+    CSourceBuffer& operator=(const CSourceBuffer&) = delete;
+
+    inline const char* begin() const { return m_data; }
+    inline const char* end() const { return m_data + m_size; }
+    inline size_t size() const { return m_size; }
+    inline bool empty() const { return m_size == 0; }
+    inline bool isMapped() const { return m_mapped; }
+
+    // End of the lexable contents, the trailing new line is left out
+    const char* contentEnd() const;
+private:
+    CSourceBuffer();
+
+    const char*  m_data;
+    size_t       m_size;
+    bool         m_mapped;
+    std::string  m_owned;
+};
+
+#endif // CSOURCEBUFFER_HPP
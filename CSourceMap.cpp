@@ -0,0 +1,665 @@
+#include "CSourceMap.hpp"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+
+static const char Base64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void encodeVlq(std::string& out, int64_t value)
+{
+    // Sign in the lowest bit, then five bits per digit with the sixth set while more follow
+    uint64_t vlq = value < 0 ? ((uint64_t(-value) << 1) | 1) : (uint64_t(value) << 1);
+    do
+    {
+        unsigned int digit = vlq & 31;
+        vlq >>= 5;
+        if (vlq)
+            digit |= 32;
+        out += Base64Digits[digit];
+    } while (vlq);
+}
+
+static int base64Value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+static bool decodeVlq(std::string_view text, size_t& pos, int64_t& value)
+{
+    uint64_t vlq = 0;
+    for (unsigned int shift = 0; pos < text.size() && shift < 60; shift += 5)
+    {
+        int digit = base64Value(text[pos++]);
+        if (digit < 0)
+            return false;
+        vlq |= uint64_t(digit & 31) << shift;
+        if (!(digit & 32))
+        {
+            value = (vlq & 1) ? -int64_t(vlq >> 1) : int64_t(vlq >> 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the comma separated fields of one segment, up to the next ',' or ';'
+static bool decodeFields(std::string_view text, size_t& pos, int64_t* fields, size_t maxFields, size_t& count)
+{
+    count = 0;
+    while (pos < text.size() && text[pos] != ',' && text[pos] != ';')
+    {
+        if (count == maxFields || !decodeVlq(text, pos, fields[count]))
+            return false;
+        count++;
+    }
+    return true;
+}
+
+static void appendString(std::string& json, std::string_view text)
+{
+    static const char HexDigits[] = "0123456789abcdef";
+    json += '"';
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            json += '\\';
+            json += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            json += "\\u00";
+            json += HexDigits[(c >> 4) & 15];
+            json += HexDigits[c & 15];
+        }
+        else
+            json += c;
+    }
+    json += '"';
+}
+
+static void appendArray(std::string& json, const std::vector<std::string>& strings)
+{
+    json += '[';
+    for (size_t i = 0; i < strings.size(); i++)
+    {
+        if (i != 0)
+            json += ',';
+        appendString(json, strings[i]);
+    }
+    json += ']';
+}
+
+// Just enough JSON to read back what serialize writes, unknown keys are skipped
+struct JsonReader
+{
+    std::string_view text;
+    size_t pos;
+
+    void skipSpace()
+    {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+            pos++;
+    }
+
+    bool accept(char c)
+    {
+        skipSpace();
+        if (pos >= text.size() || text[pos] != c)
+            return false;
+        pos++;
+        return true;
+    }
+
+    bool string(std::string& out)
+    {
+        if (!accept('"'))
+            return false;
+        out.clear();
+        while (pos < text.size() && text[pos] != '"')
+        {
+            char c = text[pos++];
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size())
+                return false;
+
+            c = text[pos++];
+            switch (c)
+            {
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u':
+                {
+                    unsigned int code = 0;
+                    for (int digit = 0; digit < 4; digit++, pos++)
+                    {
+                        if (pos >= text.size() || !isxdigit((unsigned char)text[pos]))
+                            return false;
+                        code = code * 16 + (isdigit((unsigned char)text[pos]) ? text[pos] - '0' : (tolower((unsigned char)text[pos]) - 'a' + 10));
+                    }
+                    // File names are expected to be UTF-8 already, only the escapes serialize writes are undone exactly
+                    if (code < 0x80)
+                        out += char(code);
+                    else if (code < 0x800)
+                    {
+                        out += char(0xC0 | (code >> 6));
+                        out += char(0x80 | (code & 0x3F));
+                    }
+                    else
+                    {
+                        out += char(0xE0 | (code >> 12));
+                        out += char(0x80 | ((code >> 6) & 0x3F));
+                        out += char(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: out += c;
+            }
+        }
+        return accept('"');
+    }
+
+    bool stringArray(std::vector<std::string>& out)
+    {
+        out.clear();
+        if (!accept('['))
+            return false;
+        if (accept(']'))
+            return true;
+        do
+        {
+            out.emplace_back();
+            if (!string(out.back()))
+                return false;
+        } while (accept(','));
+        return accept(']');
+    }
+
+    bool skipValue()
+    {
+        skipSpace();
+        if (pos >= text.size())
+            return false;
+
+        std::string ignored;
+        char c = text[pos];
+        if (c == '"')
+            return string(ignored);
+        if (c == '[' || c == '{')
+        {
+            char close = c == '[' ? ']' : '}';
+            pos++;
+            if (accept(close))
+                return true;
+            do
+            {
+                if (c == '{' && (!string(ignored) || !accept(':')))
+                    return false;
+                if (!skipValue())
+                    return false;
+            } while (accept(','));
+            return accept(close);
+        }
+
+        // Numbers and literals
+        size_t start = pos;
+        while (pos < text.size() && strchr("+-.0123456789eEtruefalsn", text[pos]))
+            pos++;
+        return pos != start;
+    }
+};
+
+CSourceMap::CSourceMap()
+{
+}
+
+void CSourceMap::addSegment(unsigned int line, const Segment& segment)
+{
+    while (m_lineStarts.size() <= line)
+        m_lineStarts.push_back(uint32_t(m_segments.size()));
+    m_segments.push_back(segment);
+}
+
+const CSourceMap::Segment* CSourceMap::lookup(unsigned int line, unsigned int column) const
+{
+    if (line >= m_lineStarts.size())
+        return nullptr;
+
+    std::vector<Segment>::const_iterator begin = m_segments.begin() + m_lineStarts[line];
+    std::vector<Segment>::const_iterator end = line + 1 < m_lineStarts.size() ? m_segments.begin() + m_lineStarts[line + 1] : m_segments.end();
+    std::vector<Segment>::const_iterator iter = std::upper_bound(begin, end, column, [](unsigned int column, const Segment& segment)
+    {
+        return column < segment.column;
+    });
+
+    if (iter == begin || (iter - 1)->original.file == None)
+        return nullptr;
+    return &*(iter - 1);
+}
+
+void CSourceMap::clear()
+{
+    files.clear();
+    names.clear();
+    expansions.clear();
+    m_segments.clear();
+    m_lineStarts.clear();
+}
+
+std::string CSourceMap::serialize(const std::string& outputFile) const
+{
+    std::string json = "{\"version\":" + std::to_string(Version) + ",\"file\":";
+    appendString(json, outputFile);
+    json += ",\"sources\":";
+    appendArray(json, files);
+    json += ",\"names\":";
+    appendArray(json, names);
+
+    // Every field is relative to the same field of the previous entry
+    json += ",\"x_expansions\":\"";
+    int64_t name = 0, file = 0, line = 0, column = 0;
+    for (size_t i = 0; i < expansions.size(); i++)
+    {
+        const Expansion& expansion = expansions[i];
+        if (i != 0)
+            json += ',';
+        encodeVlq(json, int64_t(expansion.name) - name);
+        name = expansion.name;
+        if (expansion.site.file == None)
+            continue;
+        encodeVlq(json, int64_t(expansion.site.file) - file);
+        encodeVlq(json, int64_t(expansion.site.line) - line);
+        encodeVlq(json, int64_t(expansion.site.column) - column);
+        file = expansion.site.file;
+        line = expansion.site.line;
+        column = expansion.site.column;
+    }
+
+    // The output column starts over on every line, the other fields carry on through the whole map
+    json += "\",\"mappings\":\"";
+    std::string mappingExpansions;
+    int64_t expansion = 0;
+    name = file = line = column = 0;
+    for (size_t outputLine = 0; outputLine < m_lineStarts.size(); outputLine++)
+    {
+        if (outputLine != 0)
+            json += ';';
+
+        size_t end = outputLine + 1 < m_lineStarts.size() ? m_lineStarts[outputLine + 1] : m_segments.size();
+        int64_t outputColumn = 0;
+        for (size_t i = m_lineStarts[outputLine]; i < end; i++)
+        {
+            const Segment& segment = m_segments[i];
+            if (i != m_lineStarts[outputLine])
+                json += ',';
+            encodeVlq(json, int64_t(segment.column) - outputColumn);
+            outputColumn = segment.column;
+            if (segment.original.file == None)
+                continue;
+
+            encodeVlq(json, int64_t(segment.original.file) - file);
+            encodeVlq(json, int64_t(segment.original.line) - line);
+            encodeVlq(json, int64_t(segment.original.column) - column);
+            file = segment.original.file;
+            line = segment.original.line;
+            column = segment.original.column;
+            if (segment.expansion != None)
+            {
+                unsigned int expansionName = expansions[segment.expansion].name;
+                encodeVlq(json, int64_t(expansionName) - name);
+                name = expansionName;
+                if (!mappingExpansions.empty())
+                    mappingExpansions += ',';
+                encodeVlq(mappingExpansions, int64_t(segment.expansion) - expansion);
+                expansion = segment.expansion;
+            }
+        }
+    }
+    json += "\",\"x_mappingExpansions\":\"";
+    json += mappingExpansions;
+    json += "\"}";
+    return json;
+}
+
+bool CSourceMap::parse(std::string_view json)
+{
+    clear();
+    JsonReader reader;
+    reader.text = json;
+    reader.pos = 0;
+
+    std::string key;
+    std::string expansionText;
+    std::string mappingText;
+    std::string mappingExpansionText;
+    if (!reader.accept('{'))
+        return false;
+    if (!reader.accept('}'))
+    {
+        do
+        {
+            if (!reader.string(key) || !reader.accept(':'))
+                return false;
+
+            bool read;
+            reader.skipSpace();
+            if (key == "version")
+            {
+                size_t start = reader.pos;
+                read = reader.skipValue() && json.substr(start, reader.pos - start) == std::to_string(Version);
+            }
+            else if (key == "sources")
+                read = reader.stringArray(files);
+            else if (key == "names")
+                read = reader.stringArray(names);
+            else if (key == "x_expansions")
+                read = reader.string(expansionText);
+            else if (key == "mappings")
+                read = reader.string(mappingText);
+            else if (key == "x_mappingExpansions")
+                read = reader.string(mappingExpansionText);
+            else
+                read = reader.skipValue();
+
+            if (!read)
+                return false;
+        } while (reader.accept(','));
+
+        if (!reader.accept('}'))
+            return false;
+    }
+
+    int64_t fields[5];
+    size_t count;
+    size_t pos = 0;
+    int64_t name = 0, file = 0, line = 0, column = 0;
+    while (pos < expansionText.size())
+    {
+        if (!decodeFields(expansionText, pos, fields, 4, count) || (count != 1 && count != 4))
+            return false;
+
+        Expansion expansion;
+        name += fields[0];
+        expansion.name = unsigned(name);
+        expansion.site.file = None;
+        expansion.site.line = expansion.site.column = 0;
+        if (count == 4)
+        {
+            file += fields[1];
+            line += fields[2];
+            column += fields[3];
+            if (file < 0 || size_t(file) >= files.size() || line < 0 || column < 0)
+                return false;
+            expansion.site.file = unsigned(file);
+            expansion.site.line = unsigned(line);
+            expansion.site.column = unsigned(column);
+        }
+        if (name < 0 || size_t(name) >= names.size())
+            return false;
+        expansions.push_back(expansion);
+
+        if (pos < expansionText.size() && expansionText[pos++] != ',')
+            return false;
+    }
+
+    if (mappingText.empty())
+        return true;
+
+    int64_t expansion = 0;
+    name = file = line = column = 0;
+    unsigned int outputLine = 0;
+    int64_t outputColumn = 0;
+    size_t expansionPos = 0;	//In mappingExpansionText
+    pos = 0;
+    m_lineStarts.push_back(0);
+    while (pos < mappingText.size())
+    {
+        if (mappingText[pos] == ';')
+        {
+            pos++;
+            outputLine++;
+            outputColumn = 0;
+            m_lineStarts.push_back(uint32_t(m_segments.size()));
+            continue;
+        }
+        if (mappingText[pos] == ',')
+        {
+            pos++;
+            continue;
+        }
+
+        if (!decodeFields(mappingText, pos, fields, 5, count) || (count != 1 && count != 4 && count != 5))
+            return false;
+
+        Segment segment;
+        outputColumn += fields[0];
+        if (outputColumn < 0)
+            return false;
+        segment.column = unsigned(outputColumn);
+        segment.original.file = None;
+        segment.original.line = segment.original.column = 0;
+        segment.expansion = None;
+        if (count >= 4)
+        {
+            file += fields[1];
+            line += fields[2];
+            column += fields[3];
+            if (file < 0 || size_t(file) >= files.size() || line < 0 || column < 0)
+                return false;
+            segment.original.file = unsigned(file);
+            segment.original.line = unsigned(line);
+            segment.original.column = unsigned(column);
+        }
+        if (count == 5)
+        {
+            // Maps from other tools name the text without saying which expansion it came from
+            name += fields[4];
+            if (name < 0 || size_t(name) >= names.size())
+                return false;
+            if (expansionPos < mappingExpansionText.size())
+            {
+                int64_t delta;
+                size_t deltaCount;
+                if (!decodeFields(mappingExpansionText, expansionPos, &delta, 1, deltaCount) || deltaCount != 1)
+                    return false;
+                if (expansionPos < mappingExpansionText.size() && mappingExpansionText[expansionPos++] != ',')
+                    return false;
+                expansion += delta;
+                if (expansion < 0 || size_t(expansion) >= expansions.size() || expansions[expansion].name != unsigned(name))
+                    return false;
+                segment.expansion = unsigned(expansion);
+            }
+        }
+        addSegment(outputLine, segment);
+    }
+    return expansionPos == mappingExpansionText.size();
+}
+
+
+CSourceMapBuilder::CSourceMapBuilder(CSourceMap& map)
+    : m_map(map),
+      m_lastSource(0),
+      m_written(0),
+      m_line(0),
+      m_column(0),
+      m_lineMapped(false),
+      m_next(nullptr)
+{
+    m_map.clear();
+}
+
+void CSourceMapBuilder::addSource(std::string_view filename, const CSourceBuffer::Ptr& buffer)
+{
+    if (!buffer || buffer->empty())
+        return;
+
+    // The same cached include can be entered several times
+    std::vector<Source>::iterator iter = std::lower_bound(m_sources.begin(), m_sources.end(), buffer->begin(), [](const Source& source, const char* begin)
+    {
+        return source.begin < begin;
+    });
+    if (iter != m_sources.end() && iter->begin == buffer->begin())
+        return;
+
+    Source source;
+    source.begin = buffer->begin();
+    source.end = buffer->end();
+    source.file = _intern(m_fileIds, m_map.files, filename);
+    m_lastSource = iter - m_sources.begin();
+    m_sources.insert(iter, std::move(source));
+}
+
+void CSourceMapBuilder::addExpansion(size_t first, const CLexer::TokenList& pending, std::string_view name, const char* site)
+{
+    // Expanded to nothing, or left as it was
+    if (pending.size() <= first || (pending.size() == first + 1 && pending[first].value.data() == site))
+        return;
+
+    CSourceMap::Expansion expansion;
+    expansion.name = _intern(m_nameIds, m_map.names, name);
+    if (!_locate(site, expansion.site))
+    {
+        expansion.site.file = CSourceMap::None;
+        expansion.site.line = expansion.site.column = 0;
+    }
+
+    PendingExpansion range;
+    range.first = m_written + first;
+    range.last = m_written + pending.size();
+    range.index = unsigned(m_map.expansions.size());
+    m_map.expansions.push_back(expansion);
+    m_expansions.push_back(range);
+}
+
+void CSourceMapBuilder::write(const CLexer::Token* tokens, size_t count)
+{
+    for (size_t i = 0; i < count; i++, m_written++)
+    {
+        std::string_view text = tokens[i].value;
+        if (text.empty())
+            continue;
+
+        while (!m_expansions.empty() && m_expansions.front().last <= m_written)
+            m_expansions.pop_front();
+        unsigned int expansion = CSourceMap::None;
+        if (!m_expansions.empty() && m_expansions.front().first <= m_written)
+            expansion = m_expansions.front().index;
+
+        // Most tokens simply continue where the one before them ended
+        CSourceMap::Location location;
+        bool located = true;
+        if (text.data() == m_next)
+            location = m_nextLocation;
+        else if (!_locate(text.data(), location))
+        {
+            located = false;
+            location.file = CSourceMap::None;
+            location.line = location.column = 0;
+            // Text made up by an expansion, like __LINE__, is put where the expansion happened
+            if (expansion != CSourceMap::None)
+                location = m_map.expansions[expansion].site;
+        }
+        if (location.file == CSourceMap::None)
+            expansion = CSourceMap::None;
+
+        // A line break takes up no column, it never needs a segment of its own
+        bool needed;
+        if (text[0] == '\n')
+            needed = false;
+        else if (!m_lineMapped)
+            needed = location.file != CSourceMap::None;
+        else if (location.file == CSourceMap::None)
+            needed = m_segment.original.file != CSourceMap::None;
+        else
+            needed = location.file != m_segment.original.file || location.line != m_segment.original.line ||
+                     expansion != m_segment.expansion ||
+                     location.column - m_segment.original.column != m_column - m_segment.column;
+
+        if (needed)
+        {
+            m_segment.column = m_column;
+            m_segment.original = location;
+            m_segment.expansion = expansion;
+            m_map.addSegment(m_line, m_segment);
+            m_lineMapped = true;
+        }
+
+        size_t newlines = std::count(text.begin(), text.end(), '\n');
+        if (newlines)
+        {
+            unsigned int tail = unsigned(text.size() - text.rfind('\n') - 1);
+            m_line += unsigned(newlines);
+            m_column = tail;
+            m_lineMapped = false;
+            location.line += unsigned(newlines);
+            location.column = tail;
+        }
+        else
+        {
+            m_column += unsigned(text.size());
+            location.column += unsigned(text.size());
+        }
+
+        m_next = located ? text.data() + text.size() : nullptr;
+        m_nextLocation = location;
+    }
+}
+
+bool CSourceMapBuilder::_locate(const char* pointer, CSourceMap::Location& out)
+{
+    if (m_lastSource >= m_sources.size() || pointer < m_sources[m_lastSource].begin || pointer >= m_sources[m_lastSource].end)
+    {
+        std::vector<Source>::iterator iter = std::upper_bound(m_sources.begin(), m_sources.end(), pointer, [](const char* pointer, const Source& source)
+        {
+            return pointer < source.begin;
+        });
+        if (iter == m_sources.begin() || pointer >= (iter - 1)->end)
+            return false;
+        m_lastSource = (iter - 1) - m_sources.begin();
+    }
+
+    Source& source = m_sources[m_lastSource];
+    if (source.lineStarts.empty())
+    {
+        source.lineStarts.push_back(0);
+        for (const char* p = source.begin; (p = (const char*)memchr(p, '\n', source.end - p)) != nullptr; ++p)
+            source.lineStarts.push_back(uint32_t(p + 1 - source.begin));
+    }
+
+    uint32_t offset = uint32_t(pointer - source.begin);
+    std::vector<uint32_t>::const_iterator line = std::upper_bound(source.lineStarts.begin(), source.lineStarts.end(), offset) - 1;
+    out.file = source.file;
+    out.line = unsigned(line - source.lineStarts.begin());
+    out.column = offset - *line;
+    return true;
+}
+
+unsigned int CSourceMapBuilder::_intern(std::unordered_map<std::string, unsigned int>& ids, std::vector<std::string>& names, std::string_view name)
+{
+    std::string key(name);
+    auto iter = ids.find(key);
+    if (iter != ids.end())
+        return iter->second;
+
+    unsigned int id = unsigned(names.size());
+    names.push_back(key);
+    ids.emplace(std::move(key), id);
+    return id;
+}
@@ -0,0 +1,120 @@
+#ifndef CSOURCEMAP_HPP
+#define CSOURCEMAP_HPP
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "CLexer.hpp"
+#include "CSourceBuffer.hpp"
+
+// Maps output line and column back to the file, line and column a token was written at, and
+// for tokens that came out of a define or macro, to the expansion that produced them. Lines and
+// columns count from 0, columns are byte offsets. Only the start of a stretch of output that was
+// copied from one place is stored, so a verbatim line costs a single segment.
+//
+// Serialized as a Source Map v3 file, readable by standard tools: segments of one (unmapped),
+// four or five fields, where the fifth field names the define or macro the text was expanded
+// from. What only this map knows goes in extension keys. x_expansions holds the expansions,
+// encoded like the mappings as name, file, line and column. x_mappingExpansions holds the
+// expansion index of every five field segment, in the order of the mappings.
+class CSourceMap
+{
+public:
+    static const unsigned int None = ~0u;
+    static const unsigned int Version = 3;	//Of the Source Map format
+
+    struct Location
+    {
+        unsigned int file;	//Index into files, None if the output isn't mapped
+        unsigned int line;
+        unsigned int column;
+    };
+
+    struct Segment
+    {
+        unsigned int column;	//Output column the segment starts at
+        Location original;
+        unsigned int expansion;	//Index into expansions, None if the text wasn't expanded
+    };
+
+    struct Expansion
+    {
+        unsigned int name;	//Index into names
+        Location site;	//Where the define or macro was used
+    };
+
+    CSourceMap();
+
+    std::vector<std::string> files;
+    std::vector<std::string> names;	//Names of expanded defines and macros
+    std::vector<Expansion> expansions;
+
+    // Segments have to be added line by line, and by column within a line
+    void addSegment(unsigned int line, const Segment& segment);
+    // The segment column falls in, nullptr if nothing is mapped there
+    const Segment* lookup(unsigned int line, unsigned int column) const;
+    inline size_t lineCount() const { return m_lineStarts.size(); }
+    inline size_t segmentCount() const { return m_segments.size(); }
+    void clear();
+
+    std::string serialize(const std::string& outputFile) const;
+    // Replaces the contents with a serialized map, false if it can't be read
+    bool parse(std::string_view json);
+private:
+    std::vector<Segment> m_segments;
+    std::vector<uint32_t> m_lineStarts;	//Index of the first segment of each line
+};
+
+// Builds a source map out of the tokens of a run as they're handed to the sink. Where a token
+// came from is worked out from the buffer its text points into, so nothing has to be tracked
+// per token while preprocessing. Tokens that continue where the previous one ended in the
+// same buffer are followed without a lookup.
+class CSourceMapBuilder
+{
+public:
+    explicit CSourceMapBuilder(CSourceMap& map);
+
+    void addSource(std::string_view filename, const CSourceBuffer::Ptr& buffer);
+    // pending[first, end) is what the identifier name at site expanded to. first is an index
+    // into the tokens that haven't been written yet.
+    void addExpansion(size_t first, const CLexer::TokenList& pending, std::string_view name, const char* site);
+    void write(const CLexer::Token* tokens, size_t count);
+private:
+    struct Source
+    {
+        const char* begin;
+        const char* end;
+        unsigned int file;
+        std::vector<uint32_t> lineStarts;	//Filled on the first lookup
+    };
+
+    struct PendingExpansion
+    {
+        size_t first;	//Output token indices
+        size_t last;
+        unsigned int index;
+    };
+
+    bool _locate(const char* pointer, CSourceMap::Location& out);
+    unsigned int _intern(std::unordered_map<std::string, unsigned int>& ids, std::vector<std::string>& names, std::string_view name);
+
+    CSourceMap& m_map;
+    std::vector<Source> m_sources;	//Sorted by begin
+    size_t m_lastSource;
+    std::unordered_map<std::string, unsigned int> m_fileIds;
+    std::unordered_map<std::string, unsigned int> m_nameIds;
+    std::deque<PendingExpansion> m_expansions;
+    size_t m_written;	//Tokens written so far
+
+    unsigned int m_line;	//Output position
+    unsigned int m_column;
+    bool m_lineMapped;	//The current line has a segment
+    CSourceMap::Segment m_segment;	//Last segment of the current line
+    const char* m_next;	//Where the last token ended in its source
+    CSourceMap::Location m_nextLocation;
+};
+
+#endif // CSOURCEMAP_HPP
@@ -0,0 +1,193 @@
+#include "CSymbolTable.hpp"
+#include <string.h>
+
+// An id holds the shard in its low bits and the index into the shard's entries above them, plus
+// one so None stays 0. Shards fill evenly, so ids stay close to dense.
+
+CSymbolTable& CSymbolTable::global()
+{
+    static CSymbolTable table;
+    return table;
+}
+
+CSymbolTable::Slots::Slots(size_t count)
+    : mask(count - 1),
+      ids(new std::atomic<Id>[count])
+{
+    for (size_t i = 0; i < count; i++)
+        ids[i].store(None, std::memory_order_relaxed);
+}
+
+CSymbolTable::Shard::Shard()
+    : slots(nullptr),
+      count(0),
+      textPos(nullptr),
+      textLeft(0)
+{
+    tables.emplace_back(new Slots(256));
+    slots.store(tables.back().get(), std::memory_order_relaxed);
+    for (std::atomic<Entry*>& page : pages)
+        page.store(nullptr, std::memory_order_relaxed);
+}
+
+CSymbolTable::CSymbolTable()
+{
+}
+
+CSymbolTable::~CSymbolTable()
+{
+    for (Shard& shard : m_shards)
+    {
+        for (std::atomic<Entry*>& page : shard.pages)
+            delete[] page.load(std::memory_order_relaxed);
+    }
+}
+
+CSymbolTable::Id CSymbolTable::intern(std::string_view name, uint32_t hash)
+{
+    Shard& shard = _shard(hash);
+    size_t slot;
+    Id id = _probe(*shard.slots.load(std::memory_order_acquire), name, hash, slot);
+    if (id != None)
+        return id;
+
+    // Probed again under the lock, another thread may have added it or grown the table meanwhile
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Slots& slots = *shard.slots.load(std::memory_order_relaxed);
+    id = _probe(slots, name, hash, slot);
+    if (id != None)
+        return id;
+
+    uint32_t index = shard.count.load(std::memory_order_relaxed);
+    if (index / PageSize >= MaxPages)
+        return None;
+    Entry* page = shard.pages[index / PageSize].load(std::memory_order_relaxed);
+    if (!page)
+    {
+        page = new Entry[PageSize];
+        shard.pages[index / PageSize].store(page, std::memory_order_release);
+    }
+
+    Entry& entry = page[index % PageSize];
+    entry.name = _store(shard, name);
+    entry.size = uint32_t(name.size());
+    entry.hash = hash;
+    id = Id((index << ShardBits | (&shard - m_shards)) + 1);
+    // The entry is written before the id is published, readers acquire it through the slot
+    shard.count.store(index + 1, std::memory_order_release);
+    slots.ids[slot].store(id, std::memory_order_release);
+
+    // Keep the load factor under a half so probe sequences stay short
+    if (size_t(index + 1) * 2 > slots.mask + 1)
+        _grow(shard);
+    return id;
+}
+
+CSymbolTable::Id CSymbolTable::find(std::string_view name) const
+{
+    uint32_t nameHash = hash(name);
+    const Shard& shard = _shard(nameHash);
+    size_t slot;
+    Id id = _probe(*shard.slots.load(std::memory_order_acquire), name, nameHash, slot);
+    if (id != None)
+        return id;
+
+    // A miss is only certain under the lock, a table grown meanwhile may hold the name
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return _probe(*shard.slots.load(std::memory_order_relaxed), name, nameHash, slot);
+}
+
+std::string_view CSymbolTable::name(Id id) const
+{
+    const Entry* entry = _entry(id);
+    return entry ? std::string_view(entry->name, entry->size) : std::string_view();
+}
+
+size_t CSymbolTable::size() const
+{
+    size_t size = 0;
+    for (const Shard& shard : m_shards)
+        size += shard.count.load(std::memory_order_acquire);
+    return size;
+}
+
+uint32_t CSymbolTable::hash(std::string_view name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (char c : name)
+    {
+        hash ^= (unsigned char)c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+CSymbolTable::Id CSymbolTable::_probe(const Slots& slots, std::string_view name, uint32_t hash, size_t& slot) const
+{
+    for (slot = hash & slots.mask; ; slot = (slot + 1) & slots.mask)
+    {
+        Id id = slots.ids[slot].load(std::memory_order_acquire);
+        if (id == None)
+            return None;
+        const Entry* entry = _entry(id);
+        if (entry->hash == hash && std::string_view(entry->name, entry->size) == name)
+            return id;
+    }
+}
+
+const CSymbolTable::Entry* CSymbolTable::_entry(Id id) const
+{
+    if (id == None)
+        return nullptr;
+    const Shard& shard = m_shards[(id - 1) & (ShardCount - 1)];
+    uint32_t index = (id - 1) >> ShardBits;
+    if (index >= shard.count.load(std::memory_order_acquire))
+        return nullptr;
+    return &shard.pages[index / PageSize].load(std::memory_order_acquire)[index % PageSize];
+}
+
+const char* CSymbolTable::_store(Shard& shard, std::string_view name)
+{
+    if (name.empty())
+        return "";
+
+    // Long names get a block of their own rather than wasting the rest of the current one
+    if (name.size() > TextBlockSize / 4)
+    {
+        shard.text.emplace_back(new char[name.size()]);
+        memcpy(shard.text.back().get(), name.data(), name.size());
+        return shard.text.back().get();
+    }
+    if (name.size() > shard.textLeft)
+    {
+        shard.text.emplace_back(new char[TextBlockSize]);
+        shard.textPos = shard.text.back().get();
+        shard.textLeft = TextBlockSize;
+    }
+
+    char* text = shard.textPos;
+    memcpy(text, name.data(), name.size());
+    shard.textPos += name.size();
+    shard.textLeft -= name.size();
+    return text;
+}
+
+void CSymbolTable::_grow(Shard& shard)
+{
+    const Slots& old = *shard.slots.load(std::memory_order_relaxed);
+    std::unique_ptr<Slots> slots(new Slots((old.mask + 1) * 2));
+    uint32_t count = shard.count.load(std::memory_order_relaxed);
+    for (uint32_t index = 0; index < count; index++)
+    {
+        const Entry& entry = shard.pages[index / PageSize].load(std::memory_order_relaxed)[index % PageSize];
+        size_t slot = entry.hash & slots->mask;
+        while (slots->ids[slot].load(std::memory_order_relaxed) != None)
+            slot = (slot + 1) & slots->mask;
+        slots->ids[slot].store(Id((index << ShardBits | (&shard - m_shards)) + 1), std::memory_order_relaxed);
+    }
+
+    // Published only once filled, readers still on the old table fall back to the lock on a miss
+    shard.slots.store(slots.get(), std::memory_order_release);
+    shard.tables.push_back(std::move(slots));
+}
@@ -0,0 +1,89 @@
+#ifndef CSYMBOLTABLE_HPP
+#define CSYMBOLTABLE_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+// Interns identifier names into small dense ids, so names can be compared and looked up as
+// integers. Ids are never reused or released. The global table is shared by every lexer, which
+// lets tokens from cached includes and from different runs be compared directly.
+//
+// Names are spread over shards by hash. A shard's lock is only taken to add a name, names that
+// were interned before are found and read back without locking, so threads lexing the same
+// includes don't contend.
+class CSymbolTable
+{
+public:
+    typedef uint32_t Id;
+    static constexpr Id None = 0;
+
+    static CSymbolTable& global();
+
+    CSymbolTable();
+    ~CSymbolTable();
+    CSymbolTable(const CSymbolTable&) = delete;
+    CSymbolTable& operator=(const CSymbolTable&) = delete;
+
+    inline Id intern(std::string_view name) { return intern(name, hash(name)); }
+    // None if the table is full
+    Id intern(std::string_view name, uint32_t hash);
+    // None if name was never interned
+    Id find(std::string_view name) const;
+    // Stays valid for the lifetime of the table
+    std::string_view name(Id id) const;
+    size_t size() const;
+
+    static uint32_t hash(std::string_view name);
+private:
+    static const unsigned int ShardBits = 4;
+    static const unsigned int ShardCount = 1 << ShardBits;
+    static const size_t PageSize = 1024;	//Entries per page
+    static const size_t MaxPages = 1024;	//Per shard
+    static const size_t TextBlockSize = 16 * 1024;
+
+    struct Entry
+    {
+        const char* name;
+        uint32_t size;
+        uint32_t hash;
+    };
+
+    // Open addressing, power of two sized. Outgrown tables are kept, readers may still be probing them.
+    struct Slots
+    {
+        explicit Slots(size_t count);
+
+        size_t mask;
+        std::unique_ptr<std::atomic<Id>[]> ids;
+    };
+
+    struct Shard
+    {
+        Shard();
+
+        mutable std::mutex mutex;	//Taken to add a name
+        std::atomic<Slots*> slots;
+        std::vector<std::unique_ptr<Slots>> tables;	//Owns slots and the tables it replaced
+        std::atomic<Entry*> pages[MaxPages];	//Entries never move once published
+        std::atomic<uint32_t> count;
+        std::vector<std::unique_ptr<char[]>> text;	//Names are copied here
+        char*  textPos;
+        size_t textLeft;
+    };
+
+    Id _probe(const Slots& slots, std::string_view name, uint32_t hash, size_t& slot) const;
+    const Entry* _entry(Id id) const;
+    const char* _store(Shard& shard, std::string_view name);
+    void _grow(Shard& shard);
+
+    inline Shard& _shard(uint32_t hash) { return m_shards[hash >> (32 - ShardBits)]; }
+    inline const Shard& _shard(uint32_t hash) const { return m_shards[hash >> (32 - ShardBits)]; }
+
+    Shard m_shards[ShardCount];
+};
+
+#endif // CSYMBOLTABLE_HPP
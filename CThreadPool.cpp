@@ -0,0 +1,127 @@
+#include "CThreadPool.hpp"
+#include <algorithm>
+
+CThreadPool::CThreadPool(unsigned int threadCount)
+    : m_threadCount(resolveThreadCount(threadCount)),
+      m_task(nullptr),
+      m_batch(0),
+      m_active(0),
+      m_busy(0),
+      m_stopping(false)
+{
+    for (size_t i = 0; i < m_threadCount; ++i)
+        m_workers.emplace_back(new Worker);
+    for (size_t i = 1; i < m_threadCount; ++i)
+        m_threads.emplace_back(&CThreadPool::_thread, this, i);
+}
+
+CThreadPool::~CThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_start.notify_all();
+    for (std::thread& thread : m_threads)
+        thread.join();
+}
+
+unsigned int CThreadPool::resolveThreadCount(unsigned int threadCount)
+{
+    if (threadCount == 0)
+        threadCount = std::thread::hardware_concurrency();
+    return threadCount == 0 ? 1 : threadCount;
+}
+
+void CThreadPool::run(size_t taskCount, const std::function<void(size_t)>& task)
+{
+    if (taskCount == 0)
+        return;
+
+    std::lock_guard<std::mutex> runLock(m_runMutex);
+    size_t workerCount = std::min<size_t>(m_threadCount, taskCount);
+
+    // Deal the tasks out round robin, stealing evens out whatever imbalance is left
+    for (size_t i = 0; i < taskCount; ++i)
+    {
+        Worker& worker = *m_workers[i % workerCount];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(i);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = &task;
+        m_active = workerCount;
+        m_busy = workerCount - 1;
+        m_batch++;
+    }
+    if (workerCount > 1)
+        m_start.notify_all();
+
+    _work(0, task);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_busy == 0; });
+    m_task = nullptr;
+}
+
+bool CThreadPool::_pop(Worker& worker, size_t& task)
+{
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty())
+        return false;
+
+    task = worker.tasks.back();
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool CThreadPool::_steal(size_t thief, size_t& task)
+{
+    // m_active only changes between batches, while no worker is stealing
+    for (size_t i = 1; i < m_active; ++i)
+    {
+        Worker& victim = *m_workers[(thief + i) % m_active];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.tasks.empty())
+            continue;
+
+        task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
+    }
+
+    return false;
+}
+
+void CThreadPool::_work(size_t index, const std::function<void(size_t)>& task)
+{
+    // No new tasks appear during a batch, so once nothing is left to steal the worker is done
+    size_t current;
+    while (_pop(*m_workers[index], current) || _steal(index, current))
+        task(current);
+}
+
+void CThreadPool::_thread(size_t index)
+{
+    size_t batch = 0;	//Last batch this worker took part in
+    while (true)
+    {
+        const std::function<void(size_t)>* task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_start.wait(lock, [this, index, batch]() { return m_stopping || (m_batch != batch && index < m_active); });
+            if (m_stopping)
+                return;
+            batch = m_batch;
+            task = m_task;
+        }
+
+        _work(index, *task);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_busy == 0)
+            m_done.notify_one();
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef CTHREADPOOL_HPP
+#define CTHREADPOOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs batches of independent tasks on a set of workers. Each worker owns a deque of task
+// indices, takes work from its own back and steals from the front of the others once it runs dry.
+// The worker threads are started with the pool and wait for the next batch in between, so a
+// batch costs no thread creation.
+class CThreadPool
+{
+public:
+    explicit CThreadPool(unsigned int threadCount = 0);
+    ~CThreadPool();
+    CThreadPool(const CThreadPool&) = delete;
+    CThreadPool& operator=(const CThreadPool&) = delete;
+
+    inline unsigned int threadCount() const { return m_threadCount; }
+    // What a pool asked for threadCount threads ends up with, 0 picks the hardware concurrency
+    static unsigned int resolveThreadCount(unsigned int threadCount);
+
+    // Calls task(i) for every i in [0, taskCount) and returns once all of them have finished.
+    // The calling thread works on the batch as well. Batches from several threads run one
+    // after the other.
+    void run(size_t taskCount, const std::function<void(size_t)>& task);
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    bool _pop(Worker& worker, size_t& task);
+    bool _steal(size_t thief, size_t& task);
+    void _work(size_t index, const std::function<void(size_t)>& task);
+    void _thread(size_t index);
+
+    unsigned int m_threadCount;
+    std::vector<std::unique_ptr<Worker> > m_workers;	//The thread calling run is worker 0
+    std::vector<std::thread> m_threads;	//Workers 1 and up
+
+    std::mutex m_runMutex;	//Held for a whole batch
+    std::mutex m_mutex;	//Guards the batch state below
+    std::condition_variable m_start;	//Workers wait here for a batch
+    std::condition_variable m_done;	//run waits here for the workers to finish
+    const std::function<void(size_t)>* m_task;	//Of the current batch
+    size_t m_batch;	//Counts batches, so a worker knows it hasn't run the current one yet
+    size_t m_active;	//Workers taking part in the current batch
+    size_t m_busy;	//Of those, the threads not done with it yet
+    bool   m_stopping;
+};
+
+#endif // CTHREADPOOL_HPP
@@ -0,0 +1,222 @@
+#include "CTrace.hpp"
+#include <chrono>
+#include <stdio.h>
+
+static const size_t NoEvent = ~size_t(0);
+
+static int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Only these are frequent enough to be worth a span but rare enough to afford one
+static bool hasSpan(CTrace::Phase phase)
+{
+    return phase == CTrace::RUN || phase == CTrace::LOAD || phase == CTrace::INCLUDE ||
+           phase == CTrace::HOOK || phase == CTrace::FINALIZE;
+}
+
+static void appendString(std::string& json, std::string_view text)
+{
+    static const char HexDigits[] = "0123456789abcdef";
+    json += '"';
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            json += '\\';
+            json += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            json += "\\u00";
+            json += HexDigits[(c >> 4) & 15];
+            json += HexDigits[c & 15];
+        }
+        else
+            json += c;
+    }
+    json += '"';
+}
+
+// Chrome expects microseconds
+static void appendMicroseconds(std::string& json, int64_t nanoseconds)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.3f", nanoseconds / 1000.0);
+    json += buffer;
+}
+
+CTrace::Stats::Stats()
+{
+    clear();
+}
+
+void CTrace::Stats::clear()
+{
+    for (unsigned int i = 0; i < PHASE_COUNT; i++)
+    {
+        seconds[i] = 0.0;
+        calls[i] = 0;
+    }
+    totalSeconds = 0.0;
+    tokensLexed = 0;
+    expansions = 0;
+    bytesCopied = 0;
+    includesLoaded = 0;
+}
+
+void CTrace::Stats::merge(const Stats& other)
+{
+    for (unsigned int i = 0; i < PHASE_COUNT; i++)
+    {
+        seconds[i] += other.seconds[i];
+        calls[i] += other.calls[i];
+    }
+    totalSeconds += other.totalSeconds;
+    tokensLexed += other.tokensLexed;
+    expansions += other.expansions;
+    bytesCopied += other.bytesCopied;
+    includesLoaded += other.includesLoaded;
+}
+
+CTrace::CTrace(bool events)
+    : m_recordEvents(events)
+{
+}
+
+void CTrace::reset(bool events)
+{
+    stats.clear();
+    m_recordEvents = events;
+    m_open.clear();
+    m_events.clear();
+}
+
+const char* CTrace::phaseName(Phase phase)
+{
+    switch (phase)
+    {
+    case RUN: return "run";
+    case LOAD: return "load";
+    case LEX: return "lex";
+    case DIRECTIVE: return "directive";
+    case EXPANSION: return "expansion";
+    case HOOK: return "hook";
+    case INCLUDE: return "include";
+    case FINALIZE: return "finalize";
+    default: return "unknown";
+    }
+}
+
+void CTrace::_begin(Phase phase, std::string_view name)
+{
+    Open open;
+    open.phase = phase;
+    open.nested = 0;
+    open.event = NoEvent;
+    if (m_recordEvents && hasSpan(phase))
+    {
+        open.event = m_events.size();
+        Event event;
+        event.phase = phase;
+        event.name = std::string(name.empty() ? std::string_view(phaseName(phase)) : name);
+        event.start = 0;
+        event.duration = 0;
+        event.depth = 0;
+        for (const Open& outer : m_open)
+            event.depth += outer.event != NoEvent;
+        m_events.push_back(std::move(event));
+    }
+    // Taken last, so the bookkeeping above isn't counted
+    open.start = now();
+    m_open.push_back(open);
+}
+
+void CTrace::_end()
+{
+    int64_t end = now();
+    Open open = m_open.back();
+    m_open.pop_back();
+
+    int64_t elapsed = end - open.start;
+    stats.seconds[open.phase] += (elapsed - open.nested) * 1e-9;
+    stats.calls[open.phase]++;
+    if (m_open.empty())
+        stats.totalSeconds += elapsed * 1e-9;
+    else
+        m_open.back().nested += elapsed;
+
+    if (open.event != NoEvent)
+    {
+        m_events[open.event].start = open.start;
+        m_events[open.event].duration = elapsed;
+    }
+}
+
+std::string CTrace::chromeTrace() const
+{
+    return chromeTrace(std::vector<const CTrace*>(1, this));
+}
+
+std::string CTrace::chromeTrace(const std::vector<const CTrace*>& traces)
+{
+    std::string json = "{\"traceEvents\":[";
+    for (size_t i = 0; i < traces.size(); i++)
+        traces[i]->_appendEvents(json, i + 1);
+    if (json.back() == ',')
+        json.pop_back();
+    json += "],\"displayTimeUnit\":\"ms\"}\n";
+    return json;
+}
+
+void CTrace::_appendEvents(std::string& json, unsigned int thread) const
+{
+    std::string tid = std::to_string(thread);
+    std::string threadName = "run " + tid;
+    for (const Event& event : m_events)
+    {
+        if (event.phase == RUN)
+        {
+            threadName = event.name;
+            break;
+        }
+    }
+    json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + tid + ",\"args\":{\"name\":";
+    appendString(json, threadName);
+    json += "}},";
+
+    bool statsWritten = false;
+    for (const Event& event : m_events)
+    {
+        json += "{\"name\":";
+        appendString(json, event.name);
+        json += ",\"cat\":\"";
+        json += phaseName(event.phase);
+        json += "\",\"ph\":\"X\",\"ts\":";
+        appendMicroseconds(json, event.start);
+        json += ",\"dur\":";
+        appendMicroseconds(json, event.duration);
+        json += ",\"pid\":1,\"tid\":" + tid;
+
+        // The totals go with the first run, where they can be found by clicking on it
+        if (event.phase == RUN && !statsWritten)
+        {
+            statsWritten = true;
+            json += ",\"args\":{";
+            for (unsigned int phase = 0; phase < PHASE_COUNT; phase++)
+            {
+                json += "\"";
+                json += phaseName(Phase(phase));
+                json += " us\":";
+                appendMicroseconds(json, int64_t(stats.seconds[phase] * 1e9));
+                json += ",";
+            }
+            json += "\"tokens lexed\":" + std::to_string(stats.tokensLexed) +
+                    ",\"expansions\":" + std::to_string(stats.expansions) +
+                    ",\"bytes copied\":" + std::to_string(stats.bytesCopied) +
+                    ",\"includes loaded\":" + std::to_string(stats.includesLoaded) + "}";
+        }
+        json += "},";
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef CTRACE_HPP
+#define CTRACE_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+// Where the time of a run went and how much work it did. Phases nest, the time of a phase is
+// only what was spent in it outside of the phases nested in it, so the phases add up to the
+// whole run. With events enabled every run, file load, include, hook and finalizedSource call
+// is kept as a span as well and can be exported as Chrome trace events. Lexing, directives
+// and expansions happen far too often for spans of their own, they're only summed up.
+//
+// A run only records anything while it has a trace, without one a phase costs a null check.
+class CTrace
+{
+public:
+    enum Phase
+    {
+        RUN,	//Anything not covered by another phase, mostly passing tokens through
+        LOAD,	//_loadSource and loading includes
+        LEX,	//Lexing chunks of the root file
+        DIRECTIVE,
+        EXPANSION,	//Identifiers, defines and macros
+        HOOK,	//Registered hooks and pragmas
+        INCLUDE,	//Files included, besides what they load, lex, expand and so on
+        FINALIZE,	//finalizedSource
+        PHASE_COUNT
+    };
+
+    struct Stats
+    {
+        Stats();
+        void clear();
+        void merge(const Stats& other);
+
+        double   seconds[PHASE_COUNT];
+        uint64_t calls[PHASE_COUNT];
+        double   totalSeconds;
+        uint64_t tokensLexed;	//Lexed by the run or taken lexed from the include cache
+        uint64_t expansions;	//Defines, macros and built-ins expanded
+        uint64_t bytesCopied;	//Output text handed to the sink
+        uint64_t includesLoaded;
+    };
+
+    // Times a phase from construction to destruction, does nothing without a trace
+    class Scope
+    {
+    public:
+        inline Scope(CTrace* trace, Phase phase, std::string_view name = std::string_view())
+            : m_trace(trace)
+        {
+            if (m_trace)
+                m_trace->_begin(phase, name);
+        }
+
+        inline ~Scope()
+        {
+            if (m_trace)
+                m_trace->_end();
+        }
+    private:
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        CTrace* m_trace;
+    };
+
+    struct Event
+    {
+        Phase phase;
+        std::string name;
+        int64_t start;	//Nanoseconds on the steady clock
+        int64_t duration;
+        unsigned int depth;	//Spans open around this one
+    };
+
+    explicit CTrace(bool events = false);
+
+    Stats stats;
+
+    // Forgets everything recorded, must not be called while a phase is open
+    void reset(bool events);
+    inline bool recordsEvents() const { return m_recordEvents; }
+    inline const std::vector<Event>& events() const { return m_events; }
+
+    static const char* phaseName(Phase phase);
+    // Chrome trace event JSON, for chrome://tracing or Perfetto. Several traces are shown as
+    // threads of their own, named after the file they ran on.
+    std::string chromeTrace() const;
+    static std::string chromeTrace(const std::vector<const CTrace*>& traces);
+private:
+    struct Open
+    {
+        Phase phase;
+        int64_t start;
+        int64_t nested;	//Time spent in phases nested in this one
+        size_t event;	//Index into m_events, or m_events.size() if it has no span
+    };
+
+    void _begin(Phase phase, std::string_view name);
+    void _end();
+    void _appendEvents(std::string& json, unsigned int thread) const;
+
+    bool m_recordEvents;
+    std::vector<Open> m_open;
+    std::vector<Event> m_events;
+};
+
+#endif // CTRACE_HPP
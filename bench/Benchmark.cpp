@@ -0,0 +1,315 @@
+#include "CAllocationCounter.hpp"
+#include "CCorpusGenerator.hpp"
+#include "CIncludeCache.hpp"
+#include "CLexer.hpp"
+#include "CLineTranslator.hpp"
+#include "COutputSink.hpp"
+#include "CPreprocessor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#define chdir _chdir
+#define getcwd _getcwd
+#else
+#include <unistd.h>
+#endif
+
+// Preprocesses generated corpora of different shapes and times the hot parts of the
+// preprocessor on their own. Every result is the best of a number of iterations, allocations
+// are the average per iteration.
+//
+// Usage: Benchmark [--quick] [--iterations N] [--dir DIRECTORY] [FILTER...]
+// Only benchmarks whose name contains one of the filters are run.
+
+typedef std::chrono::steady_clock Clock;
+
+struct Settings
+{
+    unsigned int iterations;
+    unsigned int scale;	//Divides the size of every input
+    std::string directory;
+    std::vector<std::string> filters;
+};
+
+struct Measurement
+{
+    double seconds;	//Best iteration
+    double allocations;	//Per iteration
+    double bytesAllocated;	//Per iteration
+};
+
+static Measurement measure(unsigned int iterations, const std::function<void()>& run)
+{
+    run();	//Warms up caches, and the allocator
+
+    Measurement measurement;
+    measurement.seconds = 1e30;
+    CAllocationCounter::Counts start = CAllocationCounter::current();
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        Clock::time_point begin = Clock::now();
+        run();
+        measurement.seconds = std::min(measurement.seconds, std::chrono::duration<double>(Clock::now() - begin).count());
+    }
+    CAllocationCounter::Counts counts = CAllocationCounter::since(start);
+    measurement.allocations = double(counts.allocations) / iterations;
+    measurement.bytesAllocated = double(counts.bytes) / iterations;
+    return measurement;
+}
+
+static bool selected(const Settings& settings, const std::string& name)
+{
+    if (settings.filters.empty())
+        return true;
+    for (const std::string& filter : settings.filters)
+    {
+        if (name.find(filter) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+static void printHeader()
+{
+    std::cout << std::left << std::setw(28) << "benchmark" << std::right
+              << std::setw(12) << "input KB" << std::setw(12) << "MB/s"
+              << std::setw(14) << "ns/op" << std::setw(14) << "allocs/KB"
+              << std::setw(14) << "KB alloc/KB" << std::setw(12) << "peak RSS MB" << std::endl;
+}
+
+// operations is what ns/op divides by, 0 for either leaves their columns out
+static void printResult(const std::string& name, size_t inputBytes, size_t operations, const Measurement& measurement)
+{
+    double kilobytes = inputBytes / 1024.0;
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1);
+    if (inputBytes)
+        std::cout << std::setw(12) << kilobytes << std::setw(12) << (inputBytes / (1024.0 * 1024.0)) / measurement.seconds;
+    else
+        std::cout << std::setw(12) << "-" << std::setw(12) << "-";
+    if (operations)
+        std::cout << std::setw(14) << measurement.seconds * 1e9 / operations;
+    else
+        std::cout << std::setw(14) << "-";
+    std::cout << std::setprecision(2)
+              << std::setw(14) << (kilobytes ? measurement.allocations / kilobytes : 0.0)
+              << std::setw(14) << (kilobytes ? measurement.bytesAllocated / 1024.0 / kilobytes : 0.0)
+              << std::setprecision(1)
+              << std::setw(12) << CAllocationCounter::peakResidentSize() / (1024.0 * 1024.0) << std::endl;
+}
+
+static size_t fileSize(const std::string& path)
+{
+    uint64_t size = 0;
+    int64_t mtime;
+    CIncludeCache::statFile(path, size, mtime);
+    return size_t(size);
+}
+
+// Preprocesses every root of a generated corpus, input is every file each root read. Includes
+// are found relative to the working directory, so the corpus is processed from inside it.
+static void corpusBenchmark(const Settings& settings, const std::string& name, CCorpusGenerator::Options options)
+{
+    if (!selected(settings, name))
+        return;
+
+    options.linesPerFile = std::max(options.linesPerFile / settings.scale, 10u);
+    CCorpusGenerator generator(options);
+    CCorpusGenerator::Corpus corpus;
+    std::string directory = settings.directory + "/" + name.substr(name.find('/') + 1);
+    if (!CCorpusGenerator::makeDirectory(settings.directory) || !generator.write(directory, corpus))
+    {
+        std::cout << name << ": unable to write the corpus to " << settings.directory << std::endl;
+        return;
+    }
+
+    char workingDirectory[4096];
+    if (!getcwd(workingDirectory, sizeof(workingDirectory)) || chdir(directory.c_str()) != 0)
+    {
+        std::cout << name << ": unable to enter " << directory << std::endl;
+        return;
+    }
+
+    CPreprocessor preprocessor;
+    size_t failures = 0;
+    Measurement measurement = measure(settings.iterations, [&]()
+    {
+        CPreprocessor::ResultList results = preprocessor.preprocessFiles(corpus.roots, 1);
+        for (const CPreprocessor::Result& result : results)
+            failures += !result.success;
+    });
+
+    size_t inputBytes = 0;
+    for (const std::string& root : corpus.roots)
+    {
+        CPreprocessor::Dependencies dependencies;
+        preprocessor.dependencies(root, dependencies);
+        for (const std::string& file : dependencies.files)
+            inputBytes += fileSize(file);
+    }
+    if (chdir(workingDirectory) != 0)
+        std::cout << "unable to return to " << workingDirectory << std::endl;
+
+    printResult(name, inputBytes, corpus.roots.size(), measurement);
+    if (failures)
+        std::cout << "    " << failures << " runs failed" << std::endl;
+}
+
+static void lexBenchmark(const Settings& settings)
+{
+    if (!selected(settings, "lex"))
+        return;
+
+    CCorpusGenerator generator((CCorpusGenerator::Options()));
+    std::string code = generator.code(40000 / settings.scale);
+    CLexer lexer;
+    CLexer::TokenList tokens;
+    Measurement measurement = measure(settings.iterations, [&]()
+    {
+        tokens.clear();
+        lexer.lex(code.data(), code.data() + code.size(), tokens);
+    });
+    printResult("lex", code.size(), tokens.size(), measurement);
+}
+
+// Preprocesses code made of little but uses of a define or macro, ns/op is per use. The same
+// code with nothing defined is timed as well, as the cost of getting to the identifiers.
+static void expansionBenchmark(const Settings& settings, const std::string& benchmark, const std::string& definition, const std::string& line, unsigned int usesPerLine)
+{
+    if (!selected(settings, benchmark))
+        return;
+
+    unsigned int lines = 40000 / settings.scale;
+    std::string plain;
+    for (unsigned int i = 0; i < lines; i++)
+        plain += line;
+    std::string expanded = definition + plain;
+
+    CPreprocessor preprocessor;
+    CCallbackSink sink([](std::string_view) {});
+    Measurement with = measure(settings.iterations, [&]() { preprocessor.preprocessCode("expanded.as", expanded, sink); });
+    Measurement without = measure(settings.iterations, [&]() { preprocessor.preprocessCode("plain.as", plain, sink); });
+    printResult(benchmark, expanded.size(), size_t(lines) * usesPerLine, with);
+    printResult(benchmark + " (undefined)", plain.size(), size_t(lines) * usesPerLine, without);
+}
+
+static void lineSearchBenchmark(const Settings& settings)
+{
+    const unsigned int rangeCount = 50000;
+    const unsigned int lookupCount = 1000000 / settings.scale;
+    bool single = selected(settings, "Table::search");
+    bool batch = selected(settings, "CLineTranslator::resolve");
+    if (!single && !batch)
+        return;
+
+    std::mt19937 random(1234);
+    CLineTranslator translator;
+    unsigned int line = 0;
+    for (unsigned int i = 0; i < rangeCount; i++)
+    {
+        translator.table().addLineRange("include" + std::to_string(random() % 2000) + ".as", line, line - std::min<unsigned int>(line, random() % 100));
+        line += 1 + random() % 8;
+    }
+    std::vector<unsigned int> lookups(lookupCount);
+    for (unsigned int& lookup : lookups)
+        lookup = random() % line;
+
+    // There is no input to speak of, only the time per lookup matters
+    size_t checksum = 0;
+    if (single)
+    {
+        Measurement measurement = measure(settings.iterations, [&]()
+        {
+            for (unsigned int lookup : lookups)
+                checksum += translator.table().search(lookup)->offset;
+        });
+        printResult("Table::search", 0, lookups.size(), measurement);
+    }
+
+    if (batch)
+    {
+        std::sort(lookups.begin(), lookups.end());
+        std::vector<CLineTranslator::Location> locations(lookups.size());
+        Measurement measurement = measure(settings.iterations, [&]()
+        {
+            translator.resolve(lookups.data(), lookups.size(), locations.data());
+            checksum += locations.back().line;
+        });
+        printResult("CLineTranslator::resolve", 0, lookups.size(), measurement);
+    }
+
+    if (checksum == 1)
+        std::cout << std::endl;	//Keeps the lookups from being optimized out
+}
+
+int main(int argc, char** argv)
+{
+    Settings settings;
+    settings.iterations = 5;
+    settings.scale = 1;
+    settings.directory = "bench_corpus";
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--quick")
+        {
+            settings.iterations = 2;
+            settings.scale = 10;
+        }
+        else if (arg == "--iterations" && i + 1 < argc)
+            settings.iterations = std::max(std::stoi(argv[++i]), 1);
+        else if (arg == "--dir" && i + 1 < argc)
+            settings.directory = argv[++i];
+        else
+            settings.filters.push_back(arg);
+    }
+
+    printHeader();
+
+    CCorpusGenerator::Options options;
+    corpusBenchmark(settings, "corpus/default", options);
+
+    CCorpusGenerator::Options large = options;
+    large.rootCount = 2;
+    large.includeDepth = 1;
+    large.linesPerFile = 20000;
+    corpusBenchmark(settings, "corpus/large-files", large);
+
+    CCorpusGenerator::Options deep = options;
+    deep.includeDepth = 6;
+    deep.fanOut = 2;
+    corpusBenchmark(settings, "corpus/deep-includes", deep);
+
+    CCorpusGenerator::Options wide = options;
+    wide.includeDepth = 2;
+    wide.fanOut = 8;
+    corpusBenchmark(settings, "corpus/wide-includes", wide);
+
+    CCorpusGenerator::Options defines = options;
+    defines.defineCount = 2000;
+    defines.macroCount = 500;
+    defines.defineDensity = 0.6;
+    defines.macroDensity = 0.3;
+    corpusBenchmark(settings, "corpus/define-heavy", defines);
+
+    CCorpusGenerator::Options disabled = options;
+    disabled.disabledRatio = 0.6;
+    corpusBenchmark(settings, "corpus/disabled-heavy", disabled);
+
+    CCorpusGenerator::Options comments = options;
+    comments.commentRatio = 0.5;
+    corpusBenchmark(settings, "corpus/comment-heavy", comments);
+
+    lexBenchmark(settings);
+    expansionBenchmark(settings, "_expandDefine", "#define VALUE 42\n", "int x = VALUE + VALUE * VALUE - VALUE;\n", 4);
+    expansionBenchmark(settings, "_expandMacro", "#define MUL(a, b) a * b\n", "int x = MUL(1, 2) + MUL(3, 4);\n", 2);
+    lineSearchBenchmark(settings);
+    return 0;
+}
@@ -0,0 +1,33 @@
+TEMPLATE = app
+CONFIG += console c++17
+CONFIG -= app_bundle
+CONFIG -= qt
+CONFIG += thread
+
+INCLUDEPATH += ..
+
+SOURCES += Benchmark.cpp \
+    CCorpusGenerator.cpp \
+    CAllocationCounter.cpp \
+    ../CLexer.cpp \
+    ../CPreprocessor.cpp \
+    ../CLineTranslator.cpp \
+    ../CSourceBuffer.cpp \
+    ../CIncludeCache.cpp \
+    ../CThreadPool.cpp \
+    ../CIncludePrefetcher.cpp \
+    ../CDefineTable.cpp \
+    ../CSymbolTable.cpp \
+    ../CCondition.cpp \
+    ../COutputSink.cpp \
+    ../CPrecompiledHeader.cpp \
+    ../CSourceMap.cpp \
+    ../CTrace.cpp \
+    ../CArena.cpp \
+    ../CDiagnostics.cpp
+
+HEADERS += \
+    CCorpusGenerator.hpp \
+    CAllocationCounter.hpp
+
+win32:LIBS += -lpsapi
@@ -0,0 +1,24 @@
+#ifndef CALLOCATIONCOUNTER_HPP
+#define CALLOCATIONCOUNTER_HPP
+
+#include <stddef.h>
+
+// Counts calls to the global operator new, which the benchmark binary replaces, and reads the
+// peak resident set size of the process.
+class CAllocationCounter
+{
+public:
+    struct Counts
+    {
+        size_t allocations;
+        size_t bytes;
+    };
+
+    static Counts current();
+    // Allocations made since start was taken
+    static Counts since(const Counts& start);
+    // In bytes, 0 where the platform doesn't tell
+    static size_t peakResidentSize();
+};
+
+#endif // CALLOCATIONCOUNTER_HPP
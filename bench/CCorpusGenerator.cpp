@@ -0,0 +1,235 @@
+#include "CCorpusGenerator.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+// Disabled blocks are this many lines long on average
+static const unsigned int DisabledBlockLength = 8;
+// Code is wrapped in functions of this many lines
+static const unsigned int FunctionLength = 20;
+// Files on one level of the include tree, however large the fan-out
+static const unsigned int MaxFilesPerLevel = 64;
+
+CCorpusGenerator::Options::Options()
+    : seed(1),
+      rootCount(8),
+      linesPerFile(400),
+      includeDepth(2),
+      fanOut(3),
+      defineCount(200),
+      macroCount(50),
+      defineDensity(0.2),
+      macroDensity(0.1),
+      disabledRatio(0.1),
+      commentRatio(0.15)
+{
+}
+
+CCorpusGenerator::CCorpusGenerator(const Options& options)
+    : m_options(options),
+      m_random(options.seed),
+      m_counter(0)
+{
+}
+
+static unsigned int filesOnLevel(const CCorpusGenerator::Options& options, unsigned int level)
+{
+    unsigned int count = 1;
+    for (unsigned int i = 0; i < level && count < MaxFilesPerLevel; i++)
+        count *= std::max(options.fanOut, 1u);
+    return std::min(count, MaxFilesPerLevel);
+}
+
+static std::string libraryFile(unsigned int level, unsigned int index)
+{
+    return "lib_" + std::to_string(level) + "_" + std::to_string(index) + ".as";
+}
+
+bool CCorpusGenerator::write(const std::string& directory, Corpus& corpus)
+{
+    corpus.directory = directory;
+    corpus.roots.clear();
+    corpus.files.clear();
+    corpus.bytes = 0;
+    if (!makeDirectory(directory))
+        return false;
+
+    if (!_writeFile(directory + "/defines.as", _header(), corpus))
+        return false;
+
+    // Files are shared between roots the way library scripts are, each level includes the next
+    for (unsigned int level = 1; level <= m_options.includeDepth; level++)
+    {
+        unsigned int count = filesOnLevel(m_options, level);
+        for (unsigned int index = 0; index < count; index++)
+        {
+            std::string text;
+            std::string guard = "LIB_" + std::to_string(level) + "_" + std::to_string(index) + "_AS";
+            bool pragmaOnce = index % 2 == 0;
+            if (pragmaOnce)
+                text += "#pragma once\n";
+            else
+                text += "#ifndef " + guard + "\n#define " + guard + "\n";
+
+            if (level < m_options.includeDepth)
+            {
+                unsigned int next = filesOnLevel(m_options, level + 1);
+                for (unsigned int i = 0; i < m_options.fanOut; i++)
+                    text += "#include \"" + libraryFile(level + 1, (index * m_options.fanOut + i) % next) + "\"\n";
+            }
+            _appendLines(text, m_options.linesPerFile);
+            if (!pragmaOnce)
+                text += "#endif\n";
+
+            if (!_writeFile(directory + "/" + libraryFile(level, index), text, corpus))
+                return false;
+        }
+    }
+
+    for (unsigned int root = 0; root < m_options.rootCount; root++)
+    {
+        std::string text = "#include \"defines.as\"\n";
+        if (m_options.includeDepth > 0)
+        {
+            unsigned int count = filesOnLevel(m_options, 1);
+            for (unsigned int i = 0; i < m_options.fanOut; i++)
+                text += "#include \"" + libraryFile(1, (root + i) % count) + "\"\n";
+        }
+        _appendLines(text, m_options.linesPerFile);
+
+        std::string name = "root_" + std::to_string(root) + ".as";
+        if (!_writeFile(directory + "/" + name, text, corpus))
+            return false;
+        corpus.roots.push_back(name);
+    }
+    return true;
+}
+
+std::string CCorpusGenerator::code(unsigned int lines)
+{
+    std::string text;
+    _appendLines(text, lines);
+    return text;
+}
+
+bool CCorpusGenerator::makeDirectory(const std::string& directory)
+{
+    return mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+bool CCorpusGenerator::_writeFile(const std::string& path, const std::string& text, Corpus& corpus)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+    written = fclose(file) == 0 && written;
+
+    corpus.files.push_back(path);
+    corpus.bytes += text.size();
+    return written;
+}
+
+std::string CCorpusGenerator::_header()
+{
+    // A parenthesis anywhere on a #define line makes it function-like here, so only macros have them
+    std::string text = "#ifndef DEFINES_AS\n#define DEFINES_AS\n";
+    for (unsigned int i = 0; i < m_options.defineCount; i++)
+    {
+        switch (i % 3)
+        {
+            case 0: text += "#define DEF_" + std::to_string(i) + " " + std::to_string(i * 7) + "\n"; break;
+            case 1: text += "#define DEF_" + std::to_string(i) + " " + std::to_string(i) + " * 2 + 1\n"; break;
+            default: text += "#define DEF_" + std::to_string(i) + " 0x" + std::to_string(i) + "\n";
+        }
+    }
+    for (unsigned int i = 0; i < m_options.macroCount; i++)
+        text += "#define MAC_" + std::to_string(i) + "(a, b) ((a) * " + std::to_string(i + 1) + " + (b))\n";
+    text += "#endif\n";
+    return text;
+}
+
+void CCorpusGenerator::_appendLines(std::string& out, unsigned int lines)
+{
+    // Entering and leaving blocks at these rates keeps the given share of lines disabled
+    double ratio = std::min(m_options.disabledRatio, 0.95);
+    double leave = 1.0 / DisabledBlockLength;
+    double enter = ratio / (DisabledBlockLength * (1.0 - ratio));
+
+    bool disabled = false;
+    unsigned int inFunction = 0;
+    for (unsigned int line = 0; line < lines; line++)
+    {
+        if (inFunction == 0)
+        {
+            out += "void function" + std::to_string(m_counter++) + "(int arg)\n{\n";
+            line += 2;
+        }
+
+        if (disabled ? _chance(leave) : _chance(enter))
+        {
+            disabled = !disabled;
+            out += disabled ? "#ifdef FEATURE_" + std::to_string(m_random() % 16) + "_DISABLED\n" : "#endif\n";
+            line++;
+        }
+
+        if (_chance(m_options.commentRatio))
+        {
+            switch (m_random() % 3)
+            {
+                case 0: out += "    // Keeps the state of entity " + std::to_string(m_counter++) + " in step\n"; break;
+                case 1: out += "    /* see function" + std::to_string(m_counter++) + " */\n"; break;
+                default:
+                    out += "    /* Handles the update of this object\n       before the next frame starts */\n";
+                    line++;
+            }
+        }
+        else
+            _appendCodeLine(out);
+
+        if (++inFunction == FunctionLength || line + 1 >= lines)
+        {
+            if (disabled)
+            {
+                out += "#endif\n";
+                disabled = false;
+            }
+            out += "}\n";
+            inFunction = 0;
+        }
+    }
+}
+
+void CCorpusGenerator::_appendCodeLine(std::string& out)
+{
+    std::string n = std::to_string(m_counter++);
+    if (m_options.defineCount && _chance(m_options.defineDensity))
+    {
+        out += "    int v" + n + " = DEF_" + std::to_string(m_random() % m_options.defineCount) + " + arg;\n";
+        return;
+    }
+    if (m_options.macroCount && _chance(m_options.macroDensity))
+    {
+        out += "    float f" + n + " = MAC_" + std::to_string(m_random() % m_options.macroCount) + "(arg, " + n + ");\n";
+        return;
+    }
+
+    switch (m_random() % 4)
+    {
+        case 0: out += "    int v" + n + " = arg * " + n + " + 1;\n"; break;
+        case 1: out += "    string s" + n + " = \"text " + n + "\";\n"; break;
+        case 2: out += "    if (arg > " + n + ") { arg -= " + n + "; }\n"; break;
+        default: out += "    array<float> a" + n + " = { 1.5f, 2.0f, " + n + ".0f };\n";
+    }
+}
+
+bool CCorpusGenerator::_chance(double probability)
+{
+    return std::uniform_real_distribution<double>(0.0, 1.0)(m_random) < probability;
+}
@@ -0,0 +1,59 @@
+#ifndef CCORPUSGENERATOR_HPP
+#define CCORPUSGENERATOR_HPP
+
+#include <random>
+#include <string>
+#include <vector>
+
+// Writes a synthetic AngelScript code base to a directory: a shared header of defines and
+// function-like macros, and root files that each include a tree of files. The mix of lines is
+// controlled by the options, every file is the same kind of code a game script project has.
+class CCorpusGenerator
+{
+public:
+    struct Options
+    {
+        Options();
+
+        unsigned int seed;
+        unsigned int rootCount;
+        unsigned int linesPerFile;
+        unsigned int includeDepth;	//Levels of includes below each root
+        unsigned int fanOut;	//Includes per file, above the deepest level
+        unsigned int defineCount;	//Object-like defines in the shared header
+        unsigned int macroCount;	//Function-like ones
+        double defineDensity;	//Share of code lines using a define
+        double macroDensity;	//Share of code lines using a macro
+        double disabledRatio;	//Share of lines inside blocks that are compiled out
+        double commentRatio;	//Share of lines that are comments
+    };
+
+    struct Corpus
+    {
+        std::string directory;
+        std::vector<std::string> roots;	//Root files, relative to directory as includes are
+        std::vector<std::string> files;	//Every file written, roots included
+        size_t bytes;	//Total size of all files
+    };
+
+    explicit CCorpusGenerator(const Options& options);
+
+    // Creates directory if needed and overwrites the files in it
+    bool write(const std::string& directory, Corpus& corpus);
+    // A single file's worth of code, for benchmarks that don't need files
+    std::string code(unsigned int lines);
+    // True if the directory exists afterwards
+    static bool makeDirectory(const std::string& directory);
+private:
+    bool _writeFile(const std::string& path, const std::string& text, Corpus& corpus);
+    std::string _header();
+    void _appendLines(std::string& out, unsigned int lines);
+    void _appendCodeLine(std::string& out);
+    bool _chance(double probability);
+
+    Options m_options;
+    std::mt19937 m_random;
+    unsigned int m_counter;	//Keeps generated names unique
+};
+
+#endif // CCORPUSGENERATOR_HPP
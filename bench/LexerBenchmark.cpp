@@ -0,0 +1,88 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include "CLexer.hpp"
+
+// Lexes the given files (or a built-in sample) repeatedly and reports throughput.
+// Usage: LexerBenchmark [-n iterations] [file...]
+
+static const char* sampleSource =
+    "// Sample script used when no input files are given\n"
+    "#define MAX_ENTITIES 128\n"
+    "/* Entity bookkeeping\n"
+    "   for the benchmark */\n"
+    "class Entity\n"
+    "{\n"
+    "    int id = 0;\n"
+    "    float speed = 1.5f;\n"
+    "    string name = \"entity\";\n"
+    "    void update(float dt)\n"
+    "    {\n"
+    "        if (speed >= 0.0f && id != 0x1F)\n"
+    "            speed += dt * 2.0e3;\n"
+    "        uint8 flags = 0b101;\n"
+    "    }\n"
+    "}\n";
+
+static bool loadFile(const std::string& filename, std::string& out)
+{
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+    fseek(file, 0, SEEK_END);
+    size_t length = ftell(file);
+    rewind(file);
+    std::string data(length, '\0');
+    if (length)
+        length = fread(&data.front(), 1, length, file);
+    fclose(file);
+    data.resize(length);
+    out += data;
+    if (!out.empty() && out.back() != '\n')
+        out += '\n';
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 50;
+    std::string source;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (!loadFile(arg, source))
+        {
+            std::cout << "Unable to open " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (source.empty())
+    {
+        // Roughly 1MB of the sample
+        while (source.size() < (1 << 20))
+            source += sampleSource;
+    }
+
+    size_t tokenCount = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+        CLexer::TokenList tokens;
+        CLexer lexer;
+        lexer.lex(&source.front(), &source.back(), tokens);
+        tokenCount = tokens.size();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double megabytes = double(source.size()) * iterations / (1024.0 * 1024.0);
+    std::cout << "Input:      " << source.size() << " bytes, " << tokenCount << " tokens" << std::endl;
+    std::cout << "Iterations: " << iterations << std::endl;
+    std::cout << "Time:       " << elapsed << " s" << std::endl;
+    std::cout << "Throughput: " << megabytes / elapsed << " MB/s" << std::endl;
+    return 0;
+}
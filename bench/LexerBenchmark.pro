@@ -0,0 +1,15 @@
+TEMPLATE = app
+CONFIG += console c++17
+CONFIG -= app_bundle
+CONFIG -= qt
+CONFIG += thread
+
+INCLUDEPATH += ..
+
+SOURCES += LexerBenchmark.cpp \
+    ../CLexer.cpp \
+    ../CSymbolTable.cpp
+
+HEADERS += \
+    ../CLexer.hpp \
+    ../CSymbolTable.hpp
@@ -0,0 +1,66 @@
+#include "CLineTranslator.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Resolves a flood of error lines against a table with tens of thousands of ranges, one at a
+// time in random order, one at a time in sorted order and as a sorted batch.
+
+typedef std::chrono::steady_clock Clock;
+
+static double millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int rangeCount = argc > 1 ? std::stoul(argv[1]) : 50000;
+    unsigned int lookupCount = argc > 2 ? std::stoul(argv[2]) : 200000;
+    const unsigned int fileCount = 2000;
+
+    // Ranges alternate between files like nested includes do, each a few lines long
+    std::mt19937 random(1234);
+    CLineTranslator translator;
+    unsigned int line = 0;
+    for (unsigned int i = 0; i < rangeCount; i++)
+    {
+        std::string file = "scripts/include" + std::to_string(random() % fileCount) + ".as";
+        translator.table().addLineRange(file, line, line - std::min<unsigned int>(line, random() % 100));
+        line += 1 + random() % 8;
+    }
+
+    std::vector<unsigned int> lookups(lookupCount);
+    for (unsigned int& lookup : lookups)
+        lookup = random() % line;
+
+    unsigned long long checksum = 0;
+    Clock::time_point start = Clock::now();
+    for (unsigned int lookup : lookups)
+        checksum += translator.resolveOriginalLine(lookup) + translator.resolveOriginalFile(lookup).size();
+    double unsorted = millisecondsSince(start);
+
+    std::sort(lookups.begin(), lookups.end());
+    start = Clock::now();
+    for (unsigned int lookup : lookups)
+        checksum += translator.resolveOriginalLine(lookup) + translator.resolveOriginalFile(lookup).size();
+    double sorted = millisecondsSince(start);
+
+    std::vector<CLineTranslator::Location> locations(lookups.size());
+    start = Clock::now();
+    translator.resolve(lookups.data(), lookups.size(), locations.data());
+    for (const CLineTranslator::Location& location : locations)
+        checksum += location.line + translator.fileName(location.file).size();
+    double batch = millisecondsSince(start);
+
+    std::cout << rangeCount << " ranges over " << translator.table().files.size() << " files, "
+              << lookupCount << " lookups" << std::endl;
+    std::cout << "single, random order: " << unsorted << " ms" << std::endl;
+    std::cout << "single, sorted:       " << sorted << " ms" << std::endl;
+    std::cout << "batch, sorted:        " << batch << " ms" << std::endl;
+    std::cout << "checksum " << checksum << std::endl;
+    return 0;
+}
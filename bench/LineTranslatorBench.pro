@@ -0,0 +1,12 @@
+TEMPLATE = app
+CONFIG += console c++17
+CONFIG -= app_bundle
+CONFIG -= qt
+
+INCLUDEPATH += ..
+
+SOURCES += LineTranslatorBench.cpp \
+    ../CLineTranslator.cpp
+
+HEADERS += \
+    ../CLineTranslator.hpp
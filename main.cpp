@@ -5,69 +5,66 @@
 #include <stdlib.h>
 #include <list>
 
-void linkInstancePreprocessor(CLexer::TokenList& tokens, CPreprocessor::DefineTable& defineTable, CPreprocessor::PreprocessorState state)
+void linkInstancePreprocessor(CPreprocessor::Directive& directive, CPreprocessor::DefineTable& defineTable)
 {
     (void)(defineTable);
-    CPreprocessor::advanceList(tokens);
-    if (tokens.empty())
+    const CLexer::Token* source = directive.first();
+    if (source == directive.end())
         return;
 
-    CLexer::Token source = tokens.front();
-    CPreprocessor::advanceList(tokens);
-    if (source.type != CLexer::NUMBER)
+    std::string_view file = directive.location().currentFile;
+    if (source->numberType != CLexer::NUMBER_INTEGER)
     {
-        std::cout << state.currentFile + ": Degenerate link request, invalid source" << std::endl;
+        std::cout << file << ": Degenerate link request, invalid source" << std::endl;
         return;
     }
-    if (tokens.empty())
+
+    const CLexer::Token* target = directive.next(source);
+    if (target == directive.end())
     {
-        std::cout << state.currentFile + ": Degenerate link request, missing arguments" << std::endl;
+        std::cout << file << ": Degenerate link request, missing arguments" << std::endl;
         return;
     }
-
-    CLexer::Token target = tokens.front();
-    CPreprocessor::advanceList(tokens);
-    if (target.type != CLexer::NUMBER)
+    if (target->numberType != CLexer::NUMBER_INTEGER)
     {
-        std::cout << state.currentFile + ": Degenerate link request, invalid target" << std::endl;
+        std::cout << file << ": Degenerate link request, invalid target" << std::endl;
         return;
     }
-    if (tokens.empty())
+
+    const CLexer::Token* token = directive.next(target);
+    if (token == directive.end())
     {
-        std::cout << state.currentFile + ": Degenerate link request, missing arguments" << std::endl;
+        std::cout << file << ": Degenerate link request, missing arguments" << std::endl;
         return;
     }
 
-    CLexer::Token token = tokens.front();
-    CPreprocessor::advanceList(tokens);
-
-    std::vector<CLexer::Token> args;
-    if (token.type == CLexer::OPEN && token.value == "(")
+    int64_t args[2];
+    size_t argCount = 0;
+    if (token->type == CLexer::OPEN && token->value == "(")
     {
-        while (!tokens.empty())
+        for (token = directive.next(token); token != directive.end(); token = directive.next(token))
         {
-            CLexer::Token currentToken = tokens.front();
-            CPreprocessor::advanceList(tokens);
-            if (currentToken.type == CLexer::CLOSE)
+            if (token->type == CLexer::CLOSE)
                 break;
-            if (currentToken.type == CLexer::COMMA)
+            if (token->numberType != CLexer::NUMBER_INTEGER)
                 continue;
-            if (currentToken.type == CLexer::NUMBER)
-                args.push_back(currentToken);
+            if (argCount < 2)
+                args[argCount] = token->integer;
+            argCount++;
         }
     }
 
-    if (args.size() != 2)
+    if (argCount != 2)
         std::cout << "Unable to link object instances, missing arguments" << std::endl;
     else
-        std::cout << "Connecting object " << source.value << " to " << target.value << " with " << args.at(0).value << " " << args.at(1).value << std::endl;
+        std::cout << "Connecting object " << source->integer << " to " << target->integer << " with " << args[0] << " " << args[1] << std::endl;
 }
 
 int main()
 {
     CPreprocessor preprocessor;
     preprocessor.define("_DEBUG_");
-    preprocessor.registerHook("link_instance", linkInstancePreprocessor);
+    preprocessor.registerDirective("link_instance", linkInstancePreprocessor);
     if (preprocessor.preprocessFile("main.as"))
         std::cout << preprocessor.finalizedSource() << std::endl;
     else
@@ -0,0 +1,464 @@
+#include "CArena.hpp"
+#include "CCondition.hpp"
+#include "CIncludeCache.hpp"
+#include "CPrecompiledHeader.hpp"
+#include "CSymbolTable.hpp"
+#include "CThreadPool.hpp"
+#include "CPreprocessor.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Each test preprocesses a few lines that once went wrong and checks the output. Files are
+// written to the working directory, where includes are looked for.
+//
+// Usage: RegressionTests
+// Exits with the number of failed tests.
+
+struct Test
+{
+    const char* name;
+    std::function<bool(std::string&)> run;	//Sets the reason when it fails
+};
+
+static bool writeFile(const std::string& path, const std::string& contents)
+{
+    std::ofstream file(path, std::ios::binary);
+    file << contents;
+    return bool(file);
+}
+
+static bool contains(const std::string& text, const std::string& part)
+{
+    return text.find(part) != std::string::npos;
+}
+
+// Writes the file and preprocesses it, the output is left in output on success
+static bool preprocess(const std::string& path, const std::string& contents, std::string& output, std::string& reason)
+{
+    if (!writeFile(path, contents))
+    {
+        reason = "unable to write " + path;
+        return false;
+    }
+
+    CPreprocessor preprocessor;
+    std::string diagnostics;
+    preprocessor.setDiagnosticCallback([&diagnostics](const CDiagnostics& batch) { diagnostics += batch.format(); });
+    if (!preprocessor.preprocessFile(path))
+    {
+        reason = "failed: " + diagnostics;
+        return false;
+    }
+    output = preprocessor.finalizedSource();
+    return true;
+}
+
+// The root file is lexed in chunks ending after conditional directives, a continued #if has to
+// stay in one chunk
+static bool continuedConditionInRoot(std::string& reason)
+{
+    std::string output;
+    if (!preprocess("continued_root.as", "int before;\n#if 1 && \\\n    0\nint hidden;\n#else\nint shown;\n#endif\n", output, reason))
+        return false;
+
+    if (!contains(output, "int shown;") || contains(output, "int hidden;"))
+    {
+        reason = "wrong branch taken:\n" + output;
+        return false;
+    }
+    return true;
+}
+
+// Escaped character literals other than \n, \t and \r used to have an empty value, which macro
+// expansion read past
+static bool escapedCharacterInMacro(std::string& reason)
+{
+    std::string output;
+    if (!preprocess("escaped_char.as", "#define X(a) a '\\\\' a\nint y = X(1);\n", output, reason))
+        return false;
+
+    if (!contains(output, "int y = 1"))
+    {
+        reason = "macro not expanded:\n" + output;
+        return false;
+    }
+    return true;
+}
+
+// An #ifndef with an #else branch isn't an include guard, the second include takes the #else
+static bool guardWithElse(std::string& reason)
+{
+    if (!writeFile("else_guard.as", "#ifndef ELSE_GUARD\n#define ELSE_GUARD\nint first;\n#else\nint again;\n#endif\n"))
+    {
+        reason = "unable to write else_guard.as";
+        return false;
+    }
+
+    std::string output;
+    if (!preprocess("else_guard_root.as", "#include \"else_guard.as\"\n#include \"else_guard.as\"\n", output, reason))
+        return false;
+
+    if (!contains(output, "int first;") || !contains(output, "int again;"))
+    {
+        reason = "second include skipped:\n" + output;
+        return false;
+    }
+    return true;
+}
+
+// Blocks opened by #if inside the guard have to be counted to find the #endif closing it
+static bool guardAroundIf(std::string& reason)
+{
+    std::string source = "#ifndef IF_GUARD\n#define IF_GUARD\n#if 1\nint a;\n#endif\nint b;\n#endif\n";
+    CLexer lexer;
+    CLexer::TokenList tokens;
+    lexer.lex(source.data(), source.data() + source.size(), tokens);
+
+    std::string guard = CIncludeCache::detectIncludeGuard(tokens);
+    if (guard != "IF_GUARD")
+    {
+        reason = "detected \"" + guard + "\"";
+        return false;
+    }
+    return true;
+}
+
+// A precompiled header is built as the root file but used in place of an #include, so built-ins
+// telling where it is can't be replayed
+static bool precompiledLocation(std::string& reason)
+{
+    if (!writeFile("located_header.as", "int level = __INCLUDE_LEVEL__;\n"))
+    {
+        reason = "unable to write located_header.as";
+        return false;
+    }
+
+    CPreprocessor preprocessor;
+    preprocessor.setDiagnosticCallback([](const CDiagnostics&) {});
+    if (preprocessor.writePrecompiledHeader("located_header.as", "located_header.pch"))
+    {
+        reason = "header expanding __INCLUDE_LEVEL__ was precompiled";
+        return false;
+    }
+    return true;
+}
+
+// A header file touched without being changed is hashed once, then its new time is trusted
+static bool precompiledTouchedFile(std::string& reason)
+{
+    if (!writeFile("touched_header.as", "int touched;\n"))
+    {
+        reason = "unable to write touched_header.as";
+        return false;
+    }
+
+    CPreprocessor preprocessor;
+    if (!preprocessor.writePrecompiledHeader("touched_header.as", "touched_header.pch"))
+    {
+        reason = "unable to write touched_header.pch";
+        return false;
+    }
+    std::string error;
+    CPrecompiledHeader::Ptr header = CPrecompiledHeader::load("touched_header.pch", error);
+    if (!header || header->files.empty())
+    {
+        reason = "unable to load touched_header.pch: " + error;
+        return false;
+    }
+
+    std::filesystem::last_write_time("touched_header.as", std::filesystem::last_write_time("touched_header.as") + std::chrono::seconds(10));
+    if (!header->upToDate())
+    {
+        reason = "unchanged contents taken as out of date";
+        return false;
+    }
+
+    uint64_t size;
+    int64_t mtime;
+    if (!CIncludeCache::statFile(header->files[0].path, size, mtime) || header->files[0].mtime != mtime)
+    {
+        reason = "validated time not kept";
+        return false;
+    }
+    return true;
+}
+
+// Compiled conditions are cached by their tokens, an identifier a and a character 'a' have the
+// same text but aren't the same condition
+static bool conditionCacheTokenTypes(std::string& reason)
+{
+    std::string output;
+    if (!preprocess("condition_types.as", "#define a 5\n#if a == 97\nint first;\n#endif\n#if 'a' == 97\nint second;\n#endif\n", output, reason))
+        return false;
+
+    if (contains(output, "int first;") || !contains(output, "int second;"))
+    {
+        reason = "wrong blocks kept:\n" + output;
+        return false;
+    }
+    return true;
+}
+
+// Every distinct condition used to be kept for as long as the preprocessor lived
+static bool conditionCacheBudget(std::string& reason)
+{
+    CConditionCache cache(4096);
+    CLexer lexer;
+    for (int i = 0; i < 1000; i++)
+    {
+        std::string source = "X == " + std::to_string(i);
+        CLexer::TokenList tokens;
+        lexer.lex(source.data(), source.data() + source.size(), tokens);
+        std::string error;
+        if (!cache.get(tokens.begin(), tokens.end(), error))
+        {
+            reason = "unable to compile " + source + ": " + error;
+            return false;
+        }
+    }
+
+    if (cache.memoryUsed() > cache.memoryBudget() || cache.evictions() == 0 || cache.size() >= 1000)
+    {
+        reason = std::to_string(cache.size()) + " conditions kept in " + std::to_string(cache.memoryUsed()) + " bytes";
+        return false;
+    }
+    return true;
+}
+
+// Names already interned are found without locking while other threads add names and grow the
+// table, every thread has to agree on every id
+static bool symbolTableThreads(std::string& reason)
+{
+    CSymbolTable table;
+    const int threadCount = 8;
+    const int names = 20000;
+    std::vector<std::vector<CSymbolTable::Id>> ids(threadCount, std::vector<CSymbolTable::Id>(names));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&table, &ids, t, names]()
+        {
+            // Each thread walks the names from another starting point, so adds and finds overlap
+            for (int i = 0; i < names; i++)
+            {
+                int n = (i + t * names / threadCount) % names;
+                ids[t][n] = table.intern("name" + std::to_string(n));
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    if (table.size() != size_t(names))
+    {
+        reason = std::to_string(table.size()) + " names interned";
+        return false;
+    }
+    for (int n = 0; n < names; n++)
+    {
+        std::string name = "name" + std::to_string(n);
+        for (int t = 0; t < threadCount; t++)
+        {
+            if (ids[t][n] != ids[0][n] || table.name(ids[t][n]) != name || table.find(name) != ids[t][n])
+            {
+                reason = name + " got different ids";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Long root files are lexed a piece at a time, cut only where a statement ends
+static bool longRootFile(std::string& reason)
+{
+    std::string source = "#define ADD(a, b) a + b\n";
+    const int lines = 8000;
+    for (int i = 0; i < lines; i++)
+        source += "int v" + std::to_string(i) + " = (ADD(" + std::to_string(i) + ", 1) *\n    2);\n";
+    source += "#if 1\nint last;\n#endif\n";
+
+    std::string output;
+    if (!preprocess("long_root.as", source, output, reason))
+        return false;
+
+    for (int i = 0; i < lines; i++)
+    {
+        if (!contains(output, "int v" + std::to_string(i) + " = (" + std::to_string(i) + " + 1 *\n    2);"))
+        {
+            reason = "line " + std::to_string(i) + " not expanded";
+            return false;
+        }
+    }
+    if (!contains(output, "int last;"))
+    {
+        reason = "end of the file missing";
+        return false;
+    }
+    return true;
+}
+
+// Arenas merge their blocks on reset, one large run used to set what they kept for good
+static bool arenaRetainLimit(std::string& reason)
+{
+    CArena arena(std::pmr::get_default_resource(), 64 * 1024, 1024 * 1024);
+    for (int i = 0; i < 64; i++)
+        (void)arena.allocate(256 * 1024);
+    arena.reset();
+    if (arena.capacity() > arena.retainLimit())
+    {
+        reason = std::to_string(arena.capacity()) + " bytes kept after a large run";
+        return false;
+    }
+
+    // Runs within the limit still get their blocks merged and kept
+    for (int i = 0; i < 6; i++)
+        (void)arena.allocate(100 * 1024);
+    arena.reset();
+    if (arena.capacity() < 600 * 1024)
+    {
+        reason = "only " + std::to_string(arena.capacity()) + " bytes kept after a small run";
+        return false;
+    }
+    return true;
+}
+
+// Workers are started once and reused, every batch has to run each task exactly once whatever
+// its size
+static bool threadPoolBatches(std::string& reason)
+{
+    CThreadPool pool(4);
+    for (size_t batch = 0; batch < 200; batch++)
+    {
+        size_t taskCount = batch % 9;
+        std::vector<std::atomic<int>> runs(taskCount);
+        for (std::atomic<int>& count : runs)
+            count = 0;
+        pool.run(taskCount, [&runs](size_t task) { runs[task]++; });
+        for (size_t task = 0; task < taskCount; task++)
+        {
+            if (runs[task] != 1)
+            {
+                reason = "task " + std::to_string(task) + " of batch " + std::to_string(batch) + " ran " + std::to_string(runs[task]) + " times";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The map has to read back as it was written, and text from a define body continued over
+// several lines has to map to the line it was written on and to the use of the define
+static bool sourceMapExpansion(std::string& reason)
+{
+    std::string path = "mapped_define.as";
+    if (!writeFile(path, "#define PAIR int first; \\\n    int second;\nint before;\nPAIR\nint after;\n"))
+    {
+        reason = "unable to write " + path;
+        return false;
+    }
+
+    CPreprocessor preprocessor;
+    preprocessor.setSourceMapEnabled(true);
+    if (!preprocessor.preprocessFile(path))
+    {
+        reason = "failed to preprocess";
+        return false;
+    }
+    std::string output = preprocessor.finalizedSource();
+    const CSourceMap& map = preprocessor.sourceMap();
+
+    std::string json = map.serialize("mapped_define.out");
+    CSourceMap parsed;
+    if (!contains(json, "\"version\":3") || !parsed.parse(json))
+    {
+        reason = "unable to read back " + json;
+        return false;
+    }
+    if (parsed.files != map.files || parsed.names != map.names || parsed.expansions.size() != map.expansions.size()
+        || parsed.lineCount() != map.lineCount() || parsed.segmentCount() != map.segmentCount())
+    {
+        reason = "read back differently: " + json;
+        return false;
+    }
+    for (unsigned int line = 0; line < map.lineCount(); line++)
+    {
+        for (unsigned int column = 0; column < 64; column++)
+        {
+            const CSourceMap::Segment* written = map.lookup(line, column);
+            const CSourceMap::Segment* read = parsed.lookup(line, column);
+            if (!written != !read || (written && (written->column != read->column || written->original.file != read->original.file
+                || written->original.line != read->original.line || written->original.column != read->original.column
+                || written->expansion != read->expansion)))
+            {
+                reason = "segment at " + std::to_string(line) + ":" + std::to_string(column) + " read back differently: " + json;
+                return false;
+            }
+        }
+    }
+
+    size_t offset = output.find("int second;");
+    if (offset == std::string::npos)
+    {
+        reason = "define not expanded:\n" + output;
+        return false;
+    }
+    size_t lineStart = output.rfind('\n', offset) + 1;
+    unsigned int line = unsigned(std::count(output.begin(), output.begin() + offset, '\n'));
+    const CSourceMap::Segment* segment = parsed.lookup(line, unsigned(offset - lineStart));
+    if (!segment || segment->original.file == CSourceMap::None || segment->original.line != 1
+        || segment->expansion == CSourceMap::None)
+    {
+        reason = "second line of the define mapped wrong: " + json;
+        return false;
+    }
+    const CSourceMap::Expansion& expansion = parsed.expansions[segment->expansion];
+    if (parsed.names[expansion.name] != "PAIR" || expansion.site.line != 3)
+    {
+        reason = "expansion mapped wrong: " + json;
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    std::vector<Test> tests =
+    {
+        {"continued #if in a root file", continuedConditionInRoot},
+        {"escaped character literal in a macro", escapedCharacterInMacro},
+        {"include guard with an #else branch", guardWithElse},
+        {"include guard around an #if block", guardAroundIf},
+        {"precompiled header expanding __INCLUDE_LEVEL__", precompiledLocation},
+        {"precompiled header file touched but unchanged", precompiledTouchedFile},
+        {"condition cache telling identifiers from characters", conditionCacheTokenTypes},
+        {"condition cache memory budget", conditionCacheBudget},
+        {"symbol table used from several threads", symbolTableThreads},
+        {"root file longer than a lex chunk", longRootFile},
+        {"arena retain limit", arenaRetainLimit},
+        {"thread pool reused across batches", threadPoolBatches},
+        {"source map of a multi-line define", sourceMapExpansion}
+    };
+
+    int failures = 0;
+    for (const Test& test : tests)
+    {
+        std::string reason;
+        if (test.run(reason))
+            std::cout << "passed: " << test.name << std::endl;
+        else
+        {
+            std::cout << "FAILED: " << test.name << ": " << reason << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}